@@ -0,0 +1,433 @@
+/* Micro- and macro-benchmarks for the ray tracer.
+ *
+ * usage: raytracer_bench [--baseline FILE] [--write-baseline FILE] [--tolerance T]
+ *
+ * Every benchmark reports its throughput in items (rays, tests, faces) per second.
+ * All ray sets are drawn from fixed seeds so runs are comparable. With --baseline,
+ * a benchmark slower than (1 - T) times its stored throughput counts as a
+ * regression and the program exits with 1. Run it from the Project2 directory
+ * so the mesh files are found. The tile order benchmarks also count hardware
+ * cache misses per ray where the kernel lets the process read them (Linux
+ * perf events). */
+
+#include "vec.h"
+#include "mesh.h"
+#include "octree.h"
+#include "raytracer.h"
+#include "scene.h"
+#include "stats.h"
+#include "definitions.h"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+constexpr unsigned BENCH_SEED = 20190611;
+constexpr int RAY_SET_SIZE = 4096;
+
+struct BenchResult {
+	string name;
+	double items;		// processed items (rays, tests, faces)
+	double seconds;
+	double cache_misses = -1;	// hardware cache misses while running, -1 if not counted
+	double rate() const { return seconds > 0 ? items / seconds : 0; }
+};
+
+/* Counts the hardware cache misses of the process, and of the threads it
+ * starts while counting, from construction on. count() is -1 where the
+ * counter can't be opened (other systems, perf_event_paranoid, containers).
+ * The misses of a thread are added when it exits. */
+class CacheMissCounter {
+private:
+	int fd;
+public:
+	CacheMissCounter() : fd(-1) {
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof attr);
+		attr.size = sizeof attr;
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		attr.disabled = 1;
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (fd >= 0) {
+			ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+			ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+		}
+#endif
+	}
+	~CacheMissCounter() {
+#ifdef __linux__
+		if (fd >= 0)
+			close(fd);
+#endif
+	}
+	CacheMissCounter(const CacheMissCounter &) = delete;
+	CacheMissCounter &operator= (const CacheMissCounter &) = delete;
+
+	double count() const {
+#ifdef __linux__
+		unsigned long long value;
+		if (fd >= 0 && read(fd, &value, sizeof value) == sizeof value)
+			return (double)value;
+#endif
+		return -1;
+	}
+};
+
+static volatile double sink;	// keeps results observable so the work is not optimized away
+
+/* Random rays starting inside the box [-extent, extent]^3 with uniformly distributed directions */
+static vector<Ray> random_rays(int n, double extent, unsigned seed) {
+	mt19937 gen(seed);
+	uniform_real_distribution<double> pos(-extent, extent);
+	normal_distribution<double> dir(0., 1.);
+	vector<Ray> rays;
+	rays.reserve(n);
+	for (int i = 0; i < n; i++) {
+		Vec3d o(pos(gen), pos(gen), pos(gen));
+		Vec3d d(dir(gen), dir(gen), dir(gen));
+		d.normalize();
+		rays.push_back(Ray(o, d, 1));
+	}
+	return rays;
+}
+
+/* Rays from a sphere around the mesh aimed at random points of its bounding box */
+static vector<Ray> aimed_rays(int n, double radius, double extent, unsigned seed) {
+	mt19937 gen(seed);
+	uniform_real_distribution<double> target(-extent, extent);
+	normal_distribution<double> dir(0., 1.);
+	vector<Ray> rays;
+	rays.reserve(n);
+	for (int i = 0; i < n; i++) {
+		Vec3d o(dir(gen), dir(gen), dir(gen));
+		o.normalize();
+		o *= radius;
+		Vec3d d = Vec3d(target(gen), target(gen), target(gen)) - o;
+		d.normalize();
+		rays.push_back(Ray(o, d, 1));
+	}
+	return rays;
+}
+
+static BenchResult bench_intersect_face() {
+	Mesh bunny("bunny.off", Material(), translate(Vec3d(0., 0., 0.)), 1);
+	vector<Ray> rays = aimed_rays(64, 2., 0.5, BENCH_SEED);
+
+	Timer timer;
+	double acc = 0;
+	for (size_t r = 0; r < rays.size(); r++) {
+		const Face *faces = bunny.get_const_faces();
+		for (int f = 0; f < bunny.get_size(); f++)
+			acc += intersect_face(rays[r], faces[f]);
+	}
+	sink = acc;
+	return { "intersect_face", (double)rays.size() * bunny.get_size(), timer.seconds() };
+}
+
+/* octree: a lazy octree, the only kind that keeps its node tree */
+static BenchResult bench_penetratedBy(const Octree &octree) {
+	vector<Ray> rays = random_rays(RAY_SET_SIZE, 5., BENCH_SEED + 1);
+	const Octree::OctreeNode *root = octree.getRoot();
+
+	// the root and its children, if any
+	vector<const Octree::OctreeNode *> nodes(1, root);
+	if (!root->isLeaf()) {
+		for (int i = 0; i < 8; i++)
+			nodes.push_back(root->getChild(i));
+	}
+
+	constexpr int REPEAT = 50;
+	Timer timer;
+	int count = 0;
+	for (int k = 0; k < REPEAT; k++) {
+		for (size_t r = 0; r < rays.size(); r++) {
+			for (size_t n = 0; n < nodes.size(); n++)
+				count += nodes[n]->penetratedBy(rays[r]);
+		}
+	}
+	sink = count;
+	return { "OctreeNode::penetratedBy", (double)REPEAT * rays.size() * nodes.size(), timer.seconds() };
+}
+
+static BenchResult bench_build(const char *name, const char *filename) {
+	Mesh mesh(filename, Material(), translate(Vec3d(0., 0., 0.)), 1);
+	vector<Face *> faceptrs;
+	for (int i = 0; i < mesh.get_size(); i++)
+		faceptrs.push_back(mesh.get_faces() + i);
+
+	int repeat = mesh.get_size() > 100000 ? 1 : 100000 / mesh.get_size();
+	Timer timer;
+	for (int k = 0; k < repeat; k++) {
+		Octree octree(faceptrs.data(), faceptrs.size());
+		sink = octree.getFaceCount(0);
+	}
+	return { name, (double)repeat * mesh.get_size(), timer.seconds() };
+}
+
+static BenchResult bench_getNearestIntersect(const Octree &octree) {
+	vector<Ray> rays = random_rays(RAY_SET_SIZE, 5., BENCH_SEED + 2);
+
+	Timer timer;
+	int hits = 0;
+	for (size_t r = 0; r < rays.size(); r++) {
+		Face face;	Vec3d pos;
+		hits += octree.getNearestIntersect(rays[r], face, pos);
+	}
+	sink = hits;
+	return { "Octree::getNearestIntersect", (double)rays.size(), timer.seconds() };
+}
+
+/* Settings of a bench_render() run; the defaults render the scene plainly */
+struct RenderOptions {
+	bool raster = false;		// primary visibility by rasterization
+	int shadow_maps = 0;		// shadow map resolution, 0: shadow rays only
+	bool leaf_classes = false;	// skip shadow rays in octree leaves lit or shadowed as a whole
+	double irradiance = 0;		// irradiance cache record radius, 0: no cache
+	double lod = 0;				// level-of-detail bias in faces per pixel, 0: full meshes
+	bool compressed = false;	// octree over quantized geometry
+	bool lazy_octree = false;	// octree nodes built as rays reach them
+};
+
+static BenchResult bench_render(const Scene &scene, const char *name = "RayTracer::render",
+	const RenderOptions &options = RenderOptions()) {
+	RayTracer rayTracer(scene.meshes, scene.n_meshes, scene.lights, scene.n_lights, scene.camera, options.lazy_octree);
+	rayTracer.setRasterization(options.raster);
+	rayTracer.setShadowMaps(options.shadow_maps);
+	rayTracer.setLeafClassification(options.leaf_classes);
+	rayTracer.setIrradianceCache(options.irradiance);
+	rayTracer.setLevelOfDetail(options.lod);
+	rayTracer.selectLevels(scene.camera);
+	rayTracer.setCompressedGeometry(options.compressed);
+
+	Vec3d **pixels = rayTracer.render();
+	cout << endl;
+	// the next benchmarks render the full meshes
+	rayTracer.setLevelOfDetail(0);
+	rayTracer.selectLevels(scene.camera);
+
+	const RenderStats &stats = rayTracer.getStats();
+	for (int i = 0; i < scene.camera.height; i++)
+		delete[] pixels[i];
+	delete[] pixels;
+
+	double rays = (double)(stats.primary_rays + stats.reflection_rays + stats.refraction_rays + stats.shadow_rays);
+	return { name, rays, stats.seconds[RenderStats::RENDERING] };
+}
+
+/* The demo scene traced in the given work order, counting cache misses. The
+ * counter starts before the ray tracer so its worker threads inherit it, and
+ * is read once they have exited. */
+static BenchResult bench_tile_order(const Scene &scene, const char *name, TileOrder order) {
+	CacheMissCounter counter;
+	double rays, seconds;
+	{
+		RayTracer rayTracer(scene.meshes, scene.n_meshes, scene.lights, scene.n_lights, scene.camera);
+		rayTracer.setTileOrder(order);
+
+		Vec3d **pixels = rayTracer.render();
+		cout << endl;
+		for (int i = 0; i < scene.camera.height; i++)
+			delete[] pixels[i];
+		delete[] pixels;
+
+		const RenderStats &stats = rayTracer.getStats();
+		rays = (double)(stats.primary_rays + stats.reflection_rays + stats.refraction_rays + stats.shadow_rays);
+		seconds = stats.seconds[RenderStats::RENDERING];
+	}
+	return { name, rays, seconds, counter.count() };
+}
+
+/* The demo scene with the bunnies out of core, 1 MB of them resident */
+static BenchResult bench_out_of_core() {
+	Scene scene(64, 1 << 20);
+	RayTracer rayTracer(scene.meshes, scene.n_meshes, scene.lights, scene.n_lights, scene.camera);
+	rayTracer.setPagedMeshes(scene.paged);
+
+	Vec3d **pixels = rayTracer.render();
+	cout << endl;
+	for (int i = 0; i < scene.camera.height; i++)
+		delete[] pixels[i];
+	delete[] pixels;
+
+	const RenderStats &stats = rayTracer.getStats();
+	double rays = (double)(stats.primary_rays + stats.reflection_rays + stats.refraction_rays + stats.shadow_rays);
+	return { "RayTracer::render(out of core)", rays, stats.seconds[RenderStats::RENDERING] };
+}
+
+/* The demo scene lit by many dim lights, with light culling and sampling */
+static BenchResult bench_many_lights(const Scene &scene) {
+	constexpr int N_LIGHTS = 256;
+	mt19937 gen(BENCH_SEED + 3);
+	uniform_real_distribution<double> room(-9., 9.);
+	vector<Light> lights;
+	for (int i = 0; i < N_LIGHTS; i++)
+		lights.push_back(Light(room(gen), room(gen) / 2 + 4.5, room(gen), 1., 1., 1., 0.05));
+
+	Camera camera = scene.camera;
+	camera.height = 32;
+	RayTracer rayTracer(scene.meshes, scene.n_meshes, lights.data(), N_LIGHTS, camera);
+	rayTracer.setLightCulling(0.03);
+	rayTracer.setLightSampling(4);
+
+	Vec3d **pixels = rayTracer.render();
+	cout << endl;
+	for (int i = 0; i < camera.height; i++)
+		delete[] pixels[i];
+	delete[] pixels;
+
+	const RenderStats &stats = rayTracer.getStats();
+	double rays = (double)(stats.primary_rays + stats.reflection_rays + stats.refraction_rays + stats.shadow_rays);
+	return { "RayTracer::render(256 lights)", rays, stats.seconds[RenderStats::RENDERING] };
+}
+
+/* Reads a flat JSON object of "name": number pairs */
+static map<string, double> read_baseline(const char *filename) {
+	map<string, double> ret;
+	ifstream file(filename);
+	if (!file.is_open()) {
+		cerr << "cannot open baseline " << filename << endl;
+		return ret;
+	}
+	stringstream ss;
+	ss << file.rdbuf();
+	string text = ss.str();
+
+	size_t pos = 0;
+	while ((pos = text.find('"', pos)) != string::npos) {
+		size_t end = text.find('"', pos + 1);
+		size_t colon = text.find(':', end);
+		if (end == string::npos || colon == string::npos)
+			break;
+		ret[text.substr(pos + 1, end - pos - 1)] = atof(text.c_str() + colon + 1);
+		pos = text.find_first_of(",}", colon);
+	}
+	return ret;
+}
+
+static void write_baseline(const char *filename, const vector<BenchResult> &results) {
+	ofstream file(filename);
+	file << "{\n";
+	for (size_t i = 0; i < results.size(); i++)
+		file << "  \"" << results[i].name << "\": " << results[i].rate() << (i + 1 < results.size() ? ",\n" : "\n");
+	file << "}\n";
+}
+
+int main(int argc, char **argv) {
+	const char *baseline = nullptr;
+	const char *new_baseline = nullptr;
+	double tolerance = 0.25;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+			baseline = argv[++i];
+		else if (strcmp(argv[i], "--write-baseline") == 0 && i + 1 < argc)
+			new_baseline = argv[++i];
+		else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+			tolerance = atof(argv[++i]);
+		else {
+			cerr << "usage: " << argv[0] << " [--baseline FILE] [--write-baseline FILE] [--tolerance T]" << endl;
+			return 2;
+		}
+	}
+
+	// The main.cpp scene at a reduced resolution
+	Scene scene(64);
+	vector<Face *> faceptrs;
+	for (int i = 0; i < scene.n_meshes; i++) {
+		for (int j = 0; j < scene.meshes[i].get_size(); j++)
+			faceptrs.push_back(scene.meshes[i].get_faces() + j);
+	}
+	Octree octree(faceptrs.data(), faceptrs.size());
+	Octree lazy(faceptrs.data(), faceptrs.size(), nullptr, true);
+	lazy.divide();
+
+	vector<BenchResult> results;
+	results.push_back(bench_intersect_face());
+	results.push_back(bench_penetratedBy(lazy));
+	results.push_back(bench_build("Octree(bunny.off)", "bunny.off"));
+	results.push_back(bench_build("Octree(sphere.off)", "sphere.off"));
+	results.push_back(bench_getNearestIntersect(octree));
+	RenderOptions raster, shadow_maps, leaf_classes, irradiance, lod, compressed, lazy_octree;
+	raster.raster = true;
+	shadow_maps.shadow_maps = 512;
+	leaf_classes.leaf_classes = true;
+	irradiance.irradiance = 0.25;
+	lod.lod = 1;
+	compressed.compressed = true;
+	lazy_octree.lazy_octree = true;
+	results.push_back(bench_render(scene));
+	results.push_back(bench_render(scene, "RayTracer::render(raster)", raster));
+	results.push_back(bench_render(scene, "RayTracer::render(shadow maps)", shadow_maps));
+	results.push_back(bench_render(scene, "RayTracer::render(leaf classes)", leaf_classes));
+	results.push_back(bench_render(scene, "RayTracer::render(irradiance cache)", irradiance));
+	results.push_back(bench_render(scene, "RayTracer::render(lod)", lod));
+	{
+		// compressed geometry frees the meshes' faces: a scene of its own
+		Scene compressed_scene(64);
+		results.push_back(bench_render(compressed_scene, "RayTracer::render(compressed geometry)", compressed));
+	}
+	results.push_back(bench_render(scene, "RayTracer::render(lazy octree)", lazy_octree));
+	results.push_back(bench_tile_order(scene, "RayTracer::render(scanline)", TILE_ORDER_SCANLINE));
+	results.push_back(bench_tile_order(scene, "RayTracer::render(morton)", TILE_ORDER_MORTON));
+	results.push_back(bench_tile_order(scene, "RayTracer::render(hilbert)", TILE_ORDER_HILBERT));
+	results.push_back(bench_out_of_core());
+	results.push_back(bench_many_lights(scene));
+
+	map<string, double> reference;
+	if (baseline != nullptr)
+		reference = read_baseline(baseline);
+
+	int regressions = 0;
+	cout << left << setw(40) << "benchmark" << right << setw(14) << "items/s" << setw(12) << "seconds"
+		<< setw(14) << "misses/item" << setw(12) << "baseline" << endl;
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult &res = results[i];
+		cout << left << setw(40) << res.name << right << setw(14) << setprecision(4) << res.rate()
+			<< setw(12) << res.seconds;
+		if (res.cache_misses >= 0 && res.items > 0)
+			cout << setw(14) << res.cache_misses / res.items;
+		else
+			cout << setw(14) << "-";
+		map<string, double>::const_iterator it = reference.find(res.name);
+		if (it != reference.end() && it->second > 0) {
+			double ratio = res.rate() / it->second;
+			cout << setw(11) << fixed << setprecision(2) << ratio << "x" << defaultfloat;
+			if (ratio < 1 - tolerance) {
+				cout << "  REGRESSION";
+				regressions++;
+			}
+		}
+		cout << endl;
+	}
+
+	// an eager octree keeps only the packed nodes; the node tree they were
+	// packed from is the lazy octree's, divided in full
+	cout << endl << "octree memory: packed nodes " << octree.getPackedBytes() / 1024 << " KB, node tree freed "
+		<< lazy.getNodeBytes() / 1024 << " KB" << endl;
+
+	if (new_baseline != nullptr)
+		write_baseline(new_baseline, results);
+
+	return regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,606 @@
+/* Intersection-equivalence harness.
+ *
+ * usage: raytracer_equivalence [--rays N] [--seed S] [--threads T] [--strict]
+ *
+ * Fires random and adversarial rays (axis-aligned, grazing, through shared edges
+ * and vertices, along the edges and silhouettes of analytic primitives and
+ * along the faces of octree node boxes, where quantized child boxes would lose
+ * hits) at the demo scene and at a set of analytic shapes (boxes, an ellipsoid,
+ * a tilted quad, a sphere among triangles), and compares every accelerator
+ * against the brute-force reference. A disagreement is a hit/miss mismatch or a different hit
+ * distance. Different faces at the same distance (ties on shared edges) are
+ * reported as well, and only count as failures with --strict. The octree over
+ * quantized geometry is only held to what quantization can explain (see
+ * within_quantization()); its other disagreements count as usual. A lazy
+ * octree is traced from the threads of a pool, which race to divide its nodes.
+ * The triangle meshes are also preprocessed into paged files, and PagedMesh's
+ * intersect(), occluded() and batched intersect() are checked against brute
+ * force over the same triangles rounded to floats, as the files hold them,
+ * once with every block resident and once with a budget that forces evictions,
+ * also traced from the threads of a pool.
+ * Exits with 1 on any failure. Run it from the Project2 directory. */
+
+#include "vec.h"
+#include "mesh.h"
+#include "octree.h"
+#include "bruteforce.h"
+#include "scene.h"
+#include "stats.h"
+#include "primitive.h"
+#include "compressedgeometry.h"
+#include "pagedmesh.h"
+#include "workerpool.h"
+#include "definitions.h"
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <random>
+#include <functional>
+#include <string>
+#include <cstdio>
+#include <thread>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+
+using namespace std;
+
+constexpr int MAX_REPORTED = 10;		// disagreements printed per accelerator and ray class
+constexpr int MIN_POOL_THREADS = 4;		// threads racing in the lazy octree and the evicting paged mesh, at least
+constexpr double DISTANCE_TOLERANCE = 1e-9;	// relative
+constexpr size_t EVICTING_BUDGET = 2 * 4096;	// bytes of paged blocks resident, less than two blocks
+static const char PAGED_PATH[] = "equivalence.paged";
+
+enum RayClass {
+	RANDOM,
+	AXIS_ALIGNED,
+	GRAZING,
+	SHARED_EDGE,
+	VERTEX,
+	PRIMITIVE_EDGE,
+	NODE_BOUNDARY,
+	N_RAY_CLASSES
+};
+
+static const char *class_names[N_RAY_CLASSES] = {
+	"random", "axis-aligned", "grazing", "shared-edge", "vertex", "primitive-edge", "node-boundary"
+};
+
+/* Analytic shapes the demo scene has none or few of, built in place next to
+ * each other as a scene's meshes are */
+struct Shapes {
+	static constexpr int N_SHAPES = 7;
+	Mesh *meshes;
+	int n_meshes;
+
+	Shapes() : n_meshes(N_SHAPES) {
+		Material mat;
+		meshes = static_cast<Mesh *>(::operator new(n_meshes * sizeof(Mesh)));
+		new (&meshes[0]) Mesh(Mesh::CUBE, mat, translate(Vec3d(2, 1, -1)), 1.5, true);		// axis-aligned box
+		new (&meshes[1]) Mesh(Mesh::CUBE, mat, translate(Vec3d(-2, 0, 0)) * rotate(0.5, Vec3d(0, 1, 0)) *
+			rotate(0.3, Vec3d(1, 0, 0)) * scale(1., 0.5, 2.), 1, true);							// parallelepiped
+		new (&meshes[2]) Mesh(Mesh::SPHERE, mat, translate(Vec3d(0, 2, 1)) * scale(2., 1., 1.), 1, true);	// ellipsoid
+		new (&meshes[3]) Mesh(Mesh::SQUARE, mat, translate(Vec3d(0, -1, 0)) * rotate(0.3, Vec3d(1, 0, 0)), 4, true);
+		new (&meshes[4]) Mesh(Mesh::SPHERE, mat, translate(Vec3d(2, 1, -1)), 1, true);		// pokes out of the box
+		new (&meshes[5]) Mesh(Mesh::CUBE, mat, translate(Vec3d(0, 0, 2.5)), 0.5, true);		// touches the quad
+		new (&meshes[6]) Mesh("sphere.off", mat, translate(Vec3d(1, -0.5, 2)), 1);			// triangles among them
+	}
+	~Shapes() {
+		for (int i = 0; i < n_meshes; i++)
+			meshes[i].~Mesh();
+		::operator delete(meshes);
+	}
+	Shapes(const Shapes &) = delete;
+	Shapes &operator= (const Shapes &) = delete;
+};
+
+/* An acceleration structure under test */
+struct Accelerator {
+	const char *name;
+	function<bool(const Ray &, Face &, Vec3d &)> intersect;
+	double quantization;	// farthest its triangle corners lie from the real ones, 0 if exact
+};
+
+static Vec3d random_direction(mt19937 &gen) {
+	normal_distribution<double> n(0., 1.);
+	Vec3d d(n(gen), n(gen), n(gen));
+	return d.normalize();
+}
+
+static const Face &random_face(const vector<const Face *> &faces, mt19937 &gen) {
+	uniform_int_distribution<size_t> pick(0, faces.size() - 1);
+	return *faces[pick(gen)];
+}
+
+/* A ray ending at target, starting some distance away against its direction */
+static Ray ray_towards(const Vec3d &target, const Vec3d &dir, mt19937 &gen) {
+	uniform_real_distribution<double> dist(0.5, 8.);
+	return Ray(target - dist(gen) * dir, dir, 1);
+}
+
+/* A point on an edge of a box or quad, or on a sphere, in the shape's frame */
+static Vec3d primitive_edge_point(const Primitive &p, mt19937 &gen) {
+	uniform_real_distribution<double> side(-1., 1.);
+	Vec3d q;
+	if (p.kind == Primitive::SPHERE)
+		return random_direction(gen);
+	int free_axis = gen() % (p.kind == Primitive::QUAD ? 2 : 3);
+	for (int a = 0; a < 3; a++)
+		q[a] = a == free_axis ? side(gen) : (gen() % 2 ? 1. : -1.);
+	if (p.kind == Primitive::QUAD)
+		q[Z] = 0;
+	return q;
+}
+
+/* Box of an octree node */
+struct Box {
+	Vec3d low, high;
+};
+
+static Ray make_ray(RayClass cls, const vector<const Face *> &faces, const vector<const Face *> &primitives,
+	const vector<Box> &boxes, mt19937 &gen) {
+	uniform_real_distribution<double> unit(0., 1.);
+	uniform_real_distribution<double> room(-9.5, 9.5);
+
+	switch (cls) {
+	case AXIS_ALIGNED: {
+		Vec3d d;
+		d[gen() % 3] = gen() % 2 ? 1. : -1.;
+		return Ray(Vec3d(room(gen), room(gen), room(gen)), d, 1);
+	}
+	case GRAZING: {
+		// aim at a point on a face, almost parallel to its plane
+		const Face &f = random_face(faces, gen);
+		double s = unit(gen), t = unit(gen) * (1 - s);
+		Vec3d p = *f.vertices[0] + s * (*f.vertices[1] - *f.vertices[0]) + t * (*f.vertices[2] - *f.vertices[0]);
+		Vec3d tangent = f.normal.cross(random_direction(gen));
+		tangent.normalize();
+		Vec3d d = tangent + pow(10., -1 - 6 * unit(gen)) * (gen() % 2 ? f.normal : -f.normal);
+		return ray_towards(p, d.normalize(), gen);
+	}
+	case SHARED_EDGE: {
+		const Face &f = random_face(faces, gen);
+		int e = gen() % 3;
+		Vec3d p = *f.vertices[e] + unit(gen) * (*f.vertices[(e + 1) % 3] - *f.vertices[e]);
+		return ray_towards(p, random_direction(gen), gen);
+	}
+	case VERTEX: {
+		const Face &f = random_face(faces, gen);
+		return ray_towards(*f.vertices[gen() % 3], random_direction(gen), gen);
+	}
+	case PRIMITIVE_EDGE: {
+		// through an edge or corner of a box or quad, or a sphere's silhouette
+		if (primitives.empty())
+			break;
+		const Primitive &p = *random_face(primitives, gen).primitive;
+		Vec3d q = primitive_edge_point(p, gen);
+		Vec3d target = p.center + q[X] * p.axes[0] + q[Y] * p.axes[1] + q[Z] * p.axes[2];
+		Vec3d d = random_direction(gen);
+		if (p.kind == Primitive::SPHERE) {
+			// tangent to the surface
+			Vec3d n = p.normal(target);
+			d = d - d.dot(n) * n;
+			d.normalize();
+		}
+		return ray_towards(target, d, gen);
+	}
+	case NODE_BOUNDARY: {
+		// through a face of a node's box, half of them almost parallel to it
+		uniform_int_distribution<size_t> pick(0, boxes.size() - 1);
+		const Box &box = boxes[pick(gen)];
+		int a = gen() % 3;
+		Vec3d p, n;
+		for (int k = 0; k < 3; k++)
+			p[k] = box.low[k] + unit(gen) * (box.high[k] - box.low[k]);
+		p[a] = gen() % 2 ? box.high[a] : box.low[a];
+		n[a] = 1;
+		Vec3d d = random_direction(gen);
+		if (gen() % 2) {
+			d[a] = 0;
+			d.normalize();
+			d = d + pow(10., -1 - 6 * unit(gen)) * (gen() % 2 ? n : -n);
+			d.normalize();
+		}
+		return ray_towards(p, d, gen);
+	}
+	default:
+		;
+	}
+	return Ray(Vec3d(room(gen), room(gen), room(gen)), random_direction(gen), 1);
+}
+
+/* Faces of a paged mesh have no vertices, and are told apart by their normals */
+static bool same_face(const Face &l, const Face &r) {
+	if (l.vertices[0] == nullptr || r.vertices[0] == nullptr)
+		return l.normal == r.normal;
+	return l.vertices[0] == r.vertices[0] && l.vertices[1] == r.vertices[1] && l.vertices[2] == r.vertices[2];
+}
+
+/* Is the point within eps of an edge of the triangle? */
+static bool near_edge(const Face &face, const Vec3d &p, double eps) {
+	if (face.primitive != nullptr)
+		return false;
+	for (int e = 0; e < 3; e++) {
+		const Vec3d &a = *face.vertices[e], &b = *face.vertices[(e + 1) % 3];
+		Vec3d ab = b - a;
+		double t = ab.dot(ab) > 0 ? fmax(0., fmin(1., (p - a).dot(ab) / ab.dot(ab))) : 0;
+		if (p.distance(a + t * ab) <= eps)
+			return true;
+	}
+	return false;
+}
+
+/* How far a hit on the face may move along the ray when its corners move by
+ * eps: eps over the cosine between the ray and the face, unbounded for a ray
+ * parallel to it. */
+static double slack(const Face &face, const Vec3d &d, double eps) {
+	return eps / fabs(face.normal.dot(d));
+}
+
+/* Tolerance policy for geometry whose corners moved by at most eps:
+ * - a hit on the same face may move along the ray by its slack();
+ * - a ray whose nearer hit lies within slack() + eps of an edge of the hit
+ *   face may hit or miss that face, and then whatever lies behind it.
+ * Primitives keep their exact test, so disagreements on them always count. */
+static bool within_quantization(const Ray &ray, bool hit, const Face &face, double r,
+	const Face *ref_face, double ref_r, double eps) {
+	Vec3d o = ray.getOrigin(), d = ray.getDirection();
+	if (hit && ref_face != nullptr && same_face(face, *ref_face) && face.primitive == nullptr &&
+		abs(r - ref_r) <= slack(face, d, eps))
+		return true;
+	if (ref_face != nullptr && (!hit || ref_r <= r))
+		return near_edge(*ref_face, o + ref_r * d, slack(*ref_face, d, eps) + eps);
+	return hit && near_edge(face, o + r * d, slack(face, d, eps) + eps);
+}
+
+/* Compares the accelerators with the reference hits of the rays and prints
+ * a table of disagreements per accelerator.
+ * return value: the failures */
+static int compare(const char *title, const vector<Accelerator> &accelerators, const vector<Ray> &rays,
+	const vector<RayClass> &classes, const vector<const Face *> &ref_faces, const vector<double> &ref_r, bool strict) {
+	int failures = 0;
+	for (size_t a = 0; a < accelerators.size(); a++) {
+		long long mismatches[N_RAY_CLASSES] = {}, ties[N_RAY_CLASSES] = {};
+		int reported[N_RAY_CLASSES] = {};
+
+		for (size_t i = 0; i < rays.size(); i++) {
+			Face face;	Vec3d pos;
+			bool hit = accelerators[a].intersect(rays[i], face, pos);
+			bool ref_hit = ref_faces[i] != nullptr;
+			double r = hit ? rays[i].getOrigin().distance(pos) : 0;
+
+			bool mismatch = hit != ref_hit ||
+				(hit && abs(r - ref_r[i]) > DISTANCE_TOLERANCE * fmax(1., ref_r[i]));
+			if (mismatch && accelerators[a].quantization > 0 &&
+				within_quantization(rays[i], hit, face, r, ref_faces[i], ref_r[i], accelerators[a].quantization))
+				continue;
+			bool tie = !mismatch && hit && !same_face(face, *ref_faces[i]);
+			if (!mismatch && !tie)
+				continue;
+
+			RayClass cls = classes[i];
+			(mismatch ? mismatches : ties)[cls]++;
+			if (reported[cls]++ < MAX_REPORTED) {
+				cout << setprecision(17) << title << " " << accelerators[a].name << " " << class_names[cls]
+					<< (mismatch ? " mismatch" : " face tie") << ": ray " << i
+					<< " origin " << rays[i].getOrigin() << " direction " << rays[i].getDirection()
+					<< " reference " << (ref_hit ? ref_r[i] : -1) << " got " << (hit ? r : -1) << endl;
+			}
+		}
+
+		cout << setprecision(6) << endl << title << ", " << accelerators[a].name;
+		if (accelerators[a].quantization > 0)
+			cout << " (within quantization error " << accelerators[a].quantization << ")";
+		cout << ":" << endl;
+		cout << left << setw(16) << "ray class" << right << setw(12) << "mismatches" << setw(12) << "face ties" << endl;
+		for (int c = 0; c < N_RAY_CLASSES; c++) {
+			cout << left << setw(16) << class_names[c] << right << setw(12) << mismatches[c] << setw(12) << ties[c] << endl;
+			failures += mismatches[c] + (strict ? ties[c] : 0);
+		}
+	}
+	return failures;
+}
+
+/* Checks every accelerator over the meshes against the brute-force reference.
+ * return value: the failures */
+static int check(const char *title, Mesh *meshes, int n_meshes, int n_rays, unsigned seed, int n_threads, bool strict) {
+	BruteForce reference(meshes, n_meshes);
+
+	vector<Face *> faceptrs;
+	vector<const Face *> const_faceptrs, primitives;
+	for (int i = 0; i < n_meshes; i++) {
+		for (int j = 0; j < meshes[i].get_size(); j++) {
+			faceptrs.push_back(meshes[i].get_faces() + j);
+			const_faceptrs.push_back(meshes[i].get_faces() + j);
+		}
+		if (meshes[i].is_analytic())
+			primitives.push_back(meshes[i].get_const_faces());
+	}
+	Octree octree(faceptrs.data(), faceptrs.size());
+	// an eager octree frees its node tree once packed; a lazy one divided
+	// in full keeps it, with exact boxes
+	Octree tree(faceptrs.data(), faceptrs.size(), nullptr, true);
+	tree.divide();
+	vector<Box> boxes;
+	vector<const Octree::OctreeNode *> stack(1, tree.getRoot());
+	while (!stack.empty()) {
+		const Octree::OctreeNode *node = stack.back();
+		stack.pop_back();
+		if (!node->isEmpty())
+			boxes.push_back({ node->getLowest(), node->getHighest() });
+		if (!node->isLeaf()) {
+			for (int i = 0; i < 8; i++)
+				stack.push_back(node->getChild(i));
+		}
+	}
+
+	// getNearestIntersect() traverses the packed nodes of an eager octree,
+	// the node tree of a lazy one
+	auto node_tree = [&](const Ray &ray, Face &f, Vec3d &v) { return tree.getNearestIntersect(ray, f, v); };
+	CompressedGeometry geometry(meshes, n_meshes);
+	Octree compressed(faceptrs.data(), faceptrs.size(), &geometry);
+	// its hit faces have no vertices: the triangle hit in the node stands for
+	// the mesh's face, to be compared as the reference's
+	auto compressed_hit = [&](const Ray &ray, Face &f, Vec3d &v) {
+		double r;
+		Face built;
+		unsigned node;
+		if (compressed.getNearestFace(ray, r, built, &node) == nullptr)
+			return false;
+		for (unsigned i = 0; i < compressed.getFaceCount(node); i++) {
+			unsigned id = compressed.getFaceId(node, i);
+			if (geometry.intersect(ray, id) == r)
+				f = *faceptrs[id];
+		}
+		v = ray.getOrigin() + r * ray.getDirection();
+		return true;
+	};
+	vector<Accelerator> accelerators = {
+		{ "Octree(packed nodes)", [&](const Ray &ray, Face &f, Vec3d &v) { return octree.getNearestIntersect(ray, f, v); }, 0 },
+		{ "Octree(node tree)", node_tree, 0 },
+		{ "Octree(compressed geometry)", compressed_hit, geometry.getMaxError() },
+	};
+
+	// Rays, round-robin over the classes
+	mt19937 gen(seed);
+	vector<Ray> rays;
+	vector<RayClass> classes;
+	for (int i = 0; i < n_rays; i++) {
+		RayClass cls = (RayClass)(i % N_RAY_CLASSES);
+		rays.push_back(make_ray(cls, const_faceptrs, primitives, boxes, gen));
+		classes.push_back(cls);
+	}
+
+	Timer timer;
+	vector<const Face *> ref_faces(n_rays);
+	vector<double> ref_r(n_rays);
+	reference.nearestBatch(rays.data(), n_rays, ref_faces.data(), ref_r.data(), n_threads);
+	cout << title << ": " << n_rays << " reference rays against " << reference.getSize() << " faces in "
+		<< timer.seconds() << " s" << endl;
+
+	// The lazy octree, its nodes divided by whichever thread enters them first;
+	// neighbouring rays are traced at once, and start at the same root
+	Octree lazy(faceptrs.data(), faceptrs.size(), nullptr, true);
+	int lazy_threads = n_threads > 0 ? n_threads : max(MIN_POOL_THREADS, (int)thread::hardware_concurrency());
+	vector<char> lazy_hits(n_rays);
+	vector<Face> lazy_faces(n_rays);
+	vector<Vec3d> lazy_pos(n_rays);
+	{
+		WorkerPool pool(lazy_threads);
+		pool.run(n_rays, [&](int i) { lazy_hits[i] = lazy.getNearestIntersect(rays[i], lazy_faces[i], lazy_pos[i]); });
+	}
+	// compare() passes the rays themselves, which gives their index
+	accelerators.push_back({ "Octree(lazy, traced on a pool)", [&](const Ray &ray, Face &f, Vec3d &v) {
+		size_t i = &ray - rays.data();
+		f = lazy_faces[i];
+		v = lazy_pos[i];
+		return lazy_hits[i] != 0;
+	}, 0 });
+	int failures = compare(title, accelerators, rays, classes, ref_faces, ref_r, strict);
+
+	// divided in full, the lazy octree keeps no more than one divided at once,
+	// and packs as the eager one
+	lazy.divide();
+	cout << endl << title << ": lazy octree on " << lazy_threads << " threads, node tree "
+		<< lazy.getNodeBytes() / 1024 << " KB divided in full, at once " << tree.getNodeBytes() / 1024
+		<< " KB; packed " << lazy.getPackedBytes() / 1024 << " KB, eager " << octree.getPackedBytes() / 1024 << " KB" << endl;
+	if (lazy.getNodeBytes() != tree.getNodeBytes()) {
+		cout << title << ": the lazy octree's node tree differs from one divided at once" << endl;
+		failures++;
+	}
+	if (lazy.getPackedBytes() != octree.getPackedBytes() || octree.getNodeBytes() != 0) {
+		cout << title << ": the lazy octree's packed nodes differ from the eager one's, or that kept its node tree" << endl;
+		failures++;
+	}
+	return failures;
+}
+
+/* A triangle mesh with its corners rounded to floats, as a paged file holds them */
+struct RoundedMesh {
+	vector<Vec3d> corners;		// 3 per face
+	vector<Face> faces;
+
+	RoundedMesh(Mesh &mesh) : corners(3 * mesh.get_size()), faces(mesh.get_size()) {
+		const Face *original = mesh.get_const_faces();
+		for (size_t i = 0; i < faces.size(); i++) {
+			for (int k = 0; k < 3; k++) {
+				// a component at a time: g++ 12 -O2 drops the rounding from Vec3d((float)x, ...)
+				for (int a = 0; a < 3; a++)
+					corners[3 * i + k][a] = (float)(*original[i].vertices[k])[a];
+				faces[i].vertices[k] = &corners[3 * i + k];
+			}
+			faces[i].normal = (corners[3 * i + 1] - corners[3 * i]).cross(corners[3 * i + 2] - corners[3 * i]);
+			faces[i].normal.normalize();
+			faces[i].material = original[i].material;
+		}
+	}
+};
+
+/* Checks a PagedMesh over a triangle mesh against the brute-force reference,
+ * with all the file resident and within EVICTING_BUDGET.
+ * return value: the failures */
+static int check_paged(const char *title, Mesh &mesh, int n_rays, unsigned seed, int n_threads, bool strict) {
+	if (!PagedMesh::write(mesh, PAGED_PATH, 1)) {
+		cout << title << ": can't write " << PAGED_PATH << endl;
+		return 1;
+	}
+	PagedMesh resident(PAGED_PATH, *mesh.get_material(), (size_t)-1, 1);
+	PagedMesh evicting(PAGED_PATH, *mesh.get_material(), EVICTING_BUDGET, 1);
+	if (!resident.isOpen() || !evicting.isOpen()) {
+		cout << title << ": can't map " << PAGED_PATH << endl;
+		remove(PAGED_PATH);
+		return 1;
+	}
+
+	RoundedMesh rounded(mesh);
+	vector<const Face *> faceptrs;
+	for (size_t i = 0; i < rounded.faces.size(); i++)
+		faceptrs.push_back(&rounded.faces[i]);
+	BruteForce reference(faceptrs);
+
+	// the boxes of the file's blocks and of their groups of faces
+	vector<Box> boxes;
+	for (unsigned run : { PAGED_BLOCK_TRIANGLES, PAGED_GROUP_TRIANGLES }) {
+		for (size_t first = 0; first < faceptrs.size(); first += run) {
+			Box box = { *faceptrs[first]->vertices[0], *faceptrs[first]->vertices[0] };
+			for (size_t i = first; i < min(faceptrs.size(), first + run); i++) {
+				for (int k = 0; k < 3; k++) {
+					for (int a = 0; a < 3; a++) {
+						box.low[a] = fmin(box.low[a], (*faceptrs[i]->vertices[k])[a]);
+						box.high[a] = fmax(box.high[a], (*faceptrs[i]->vertices[k])[a]);
+					}
+				}
+			}
+			boxes.push_back(box);
+		}
+	}
+
+	mt19937 gen(seed);
+	vector<Ray> rays;
+	vector<RayClass> classes;
+	for (int i = 0; i < n_rays; i++) {
+		RayClass cls = (RayClass)(i % N_RAY_CLASSES);
+		rays.push_back(make_ray(cls, faceptrs, vector<const Face *>(), boxes, gen));
+		classes.push_back(cls);
+	}
+	vector<const Face *> ref_faces(n_rays);
+	vector<double> ref_r(n_rays);
+	reference.nearestBatch(rays.data(), n_rays, ref_faces.data(), ref_r.data(), n_threads);
+
+	vector<double> resident_r, evicting_r;
+	vector<Face> resident_faces, evicting_faces;
+	resident.intersect(rays, resident_r, resident_faces);
+	evicting.intersect(rays, evicting_r, evicting_faces);
+
+	// threads paging blocks in and out under each other's rays
+	vector<double> pooled_r(n_rays, INFTY);
+	vector<Face> pooled_faces(n_rays);
+	{
+		WorkerPool pool(n_threads > 0 ? n_threads : max(MIN_POOL_THREADS, (int)thread::hardware_concurrency()));
+		pool.run(n_rays, [&](int i) { evicting.intersect(rays[i], INFTY, pooled_r[i], pooled_faces[i]); });
+	}
+
+	// compare() passes the rays themselves, which gives their index
+	auto single = [&](const PagedMesh &paged) {
+		return [&](const Ray &ray, Face &f, Vec3d &v) {
+			double r;
+			if (!paged.intersect(ray, INFTY, r, f))
+				return false;
+			v = ray.getOrigin() + r * ray.getDirection();
+			return true;
+		};
+	};
+	auto batch = [&](const vector<double> &ret_r, const vector<Face> &ret_faces) {
+		return [&](const Ray &ray, Face &f, Vec3d &v) {
+			size_t i = &ray - rays.data();
+			if (ret_r[i] == INFTY)
+				return false;
+			f = ret_faces[i];
+			v = ray.getOrigin() + ret_r[i] * ray.getDirection();
+			return true;
+		};
+	};
+	// a hit at the reference distance if occluded() turns true there, at the origin if elsewhere
+	auto occluded = [&](const PagedMesh &paged) {
+		return [&](const Ray &ray, Face &f, Vec3d &v) {
+			size_t i = &ray - rays.data();
+			if (!paged.occluded(ray, INFTY))
+				return false;
+			double r = 0;
+			if (ref_faces[i] != nullptr) {
+				f = *ref_faces[i];
+				double tolerance = DISTANCE_TOLERANCE * fmax(1., ref_r[i]);
+				if (!paged.occluded(ray, ref_r[i] - tolerance) && paged.occluded(ray, ref_r[i] + tolerance))
+					r = ref_r[i];
+			}
+			v = ray.getOrigin() + r * ray.getDirection();
+			return true;
+		};
+	};
+	vector<Accelerator> accelerators = {
+		{ "PagedMesh intersect()", single(resident), 0 },
+		{ "PagedMesh occluded()", occluded(resident), 0 },
+		{ "PagedMesh batched intersect()", batch(resident_r, resident_faces), 0 },
+		{ "PagedMesh intersect(), evicting", single(evicting), 0 },
+		{ "PagedMesh occluded(), evicting", occluded(evicting), 0 },
+		{ "PagedMesh batched intersect(), evicting", batch(evicting_r, evicting_faces), 0 },
+		{ "PagedMesh intersect(), evicting on a pool", batch(pooled_r, pooled_faces), 0 },
+	};
+	int failures = compare(title, accelerators, rays, classes, ref_faces, ref_r, strict);
+
+	cout << endl << title << ": " << resident.getBlocks() << " blocks, " << evicting.getFaults() << " faults and "
+		<< evicting.getEvictions() << " evictions within " << EVICTING_BUDGET << " bytes" << endl;
+	if (evicting.getEvictions() == 0) {
+		cout << title << ": nothing evicted" << endl;
+		failures++;
+	}
+	remove(PAGED_PATH);
+	return failures;
+}
+
+int main(int argc, char **argv) {
+	int n_rays = 10000;
+	unsigned seed = 20190611;
+	int n_threads = 0;
+	bool strict = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--rays") == 0 && i + 1 < argc)
+			n_rays = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = strtoul(argv[++i], nullptr, 10);
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+			n_threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--strict") == 0)
+			strict = true;
+		else {
+			cerr << "usage: " << argv[0] << " [--rays N] [--seed S] [--threads T] [--strict]" << endl;
+			return 2;
+		}
+	}
+
+	int failures = 0;
+	{
+		Scene scene;
+		failures += check("demo scene", scene.meshes, scene.n_meshes, n_rays, seed, n_threads, strict);
+		for (int i = 0; i < scene.n_meshes; i++) {
+			if (!scene.meshes[i].is_analytic())
+				failures += check_paged(("demo scene mesh " + to_string(i)).c_str(), scene.meshes[i],
+					n_rays, seed + 2 + i, n_threads, strict);
+		}
+	}
+	{
+		Shapes shapes;
+		failures += check("shapes", shapes.meshes, shapes.n_meshes, n_rays, seed + 1, n_threads, strict);
+		for (int i = 0; i < shapes.n_meshes; i++) {
+			if (!shapes.meshes[i].is_analytic())
+				failures += check_paged(("shapes mesh " + to_string(i)).c_str(), shapes.meshes[i],
+					n_rays, seed + 2 + i, n_threads, strict);
+		}
+	}
+
+	cout << endl << (failures ? "FAILED" : "OK") << endl;
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+#include "bruteforce.h"
+#include "octree.h"
+#include "definitions.h"
+
+#include <thread>
+
+BruteForce::BruteForce(Mesh *meshes, int n_meshes) {
+	for (int i = 0; i < n_meshes; i++) {
+		const Face *faces = meshes[i].get_const_faces();
+		for (int j = 0; j < meshes[i].get_size(); j++)
+			faceptrs.push_back(&faces[j]);
+	}
+}
+
+bool BruteForce::getNearestIntersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const {
+	double r;
+	const Face *face = nearest(ray, r);
+	if (face == nullptr)
+		return false;
+	ret_face = *face;
+	ret_vec = ray.getOrigin() + r * ray.getDirection();
+	return true;
+}
+
+const Face *BruteForce::nearest(const Ray &ray, double &ret_r) const {
+	const Face *ret = nullptr;
+	double min_r = INFTY;
+	for (size_t i = 0; i < faceptrs.size(); i++) {
+		double r = intersect_face(ray, *faceptrs[i]);
+		if (r != -1 && r < min_r) {
+			min_r = r;
+			ret = faceptrs[i];
+		}
+	}
+	ret_r = min_r;
+	return ret;
+}
+
+void BruteForce::nearestBatch(const Ray *rays, int n, const Face **ret_faces, double *ret_r, int n_threads) const {
+	if (n_threads <= 0)
+		n_threads = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+
+	// interleaved ray assignment keeps the threads evenly loaded
+	vector<thread> workers;
+	for (int t = 0; t < n_threads; t++) {
+		workers.push_back(thread([=]() {
+			for (int i = t; i < n; i += n_threads)
+				ret_faces[i] = nearest(rays[i], ret_r[i]);
+		}));
+	}
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "vec.h"
+#include "mesh.h"
+#include "ray.h"
+#include "definitions.h"
+
+#include <vector>
+
+using namespace std;
+
+/* BruteForce is the reference intersector: every ray is tested against every face
+ * of every mesh, with the same ray-triangle test the octree leaves use.
+ * It is slow by design and only meant to validate the acceleration structures. */
+class BruteForce {
+private:
+	vector<const Face *> faceptrs;
+
+public:
+	BruteForce(Mesh *meshes, int n_meshes);
+	BruteForce(const vector<const Face *> &faces) : faceptrs(faces) {}
+
+	/* Nearest intersection, same contract as Octree::getNearestIntersect() */
+	bool getNearestIntersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const;
+
+	/* Nearest face and its ray parameter, nullptr if the ray misses everything */
+	const Face *nearest(const Ray &ray, double &ret_r) const;
+
+	/* nearest() for a batch of rays, split over n_threads worker threads
+	 * (0: one per hardware thread). ret_faces and ret_r hold n entries. */
+	void nearestBatch(const Ray *rays, int n, const Face **ret_faces, double *ret_r, int n_threads = 0) const;
+
+	int getSize() const { return faceptrs.size(); }
+};
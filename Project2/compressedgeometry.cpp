@@ -0,0 +1,99 @@
+#include "compressedgeometry.h"
+#include "octree.h"
+
+#include <cmath>
+#include <unordered_map>
+
+constexpr double QUANTIZATION_STEPS = 65535.;	// per axis of a mesh's box
+
+CompressedGeometry::CompressedGeometry(Mesh *meshes, int n_meshes) {
+	for (int m = 0; m < n_meshes; m++) {
+		const Face *mesh_faces = meshes[m].get_const_faces();
+		int n_faces = meshes[m].get_size();
+
+		// the mesh's vertices, once each, and their box
+		Range range = { Vec3d(INFTY), Vec3d(0.), (unsigned)(positions.size() / 3), mesh_faces[0].material,
+			meshes[m].is_analytic() ? mesh_faces[0].primitive : nullptr, mesh_faces[0].normal };
+		Vec3d high(-INFTY);
+		unordered_map<const Vec3d *, unsigned> index;
+		vector<const Vec3d *> vertices;
+		for (int f = 0; f < n_faces; f++) {
+			for (int j = 0; j < 3; j++) {
+				const Vec3d *v = mesh_faces[f].vertices[j];
+				if (index.insert(make_pair(v, (unsigned)vertices.size())).second) {
+					vertices.push_back(v);
+					for (int a = 0; a < 3; a++) {
+						range.low[a] = fmin(range.low[a], (*v)[a]);
+						high[a] = fmax(high[a], (*v)[a]);
+					}
+				}
+			}
+		}
+		for (int a = 0; a < 3; a++)
+			range.step[a] = high[a] > range.low[a] ? (high[a] - range.low[a]) / QUANTIZATION_STEPS : 0;
+
+		for (size_t i = 0; i < vertices.size(); i++) {
+			for (int a = 0; a < 3; a++) {
+				double q = range.step[a] > 0 ? floor(((*vertices[i])[a] - range.low[a]) / range.step[a] + 0.5) : 0;
+				positions.push_back((unsigned short)fmax(0., fmin(QUANTIZATION_STEPS, q)));
+			}
+		}
+		for (int f = 0; f < n_faces; f++) {
+			for (int j = 0; j < 3; j++)
+				indices.push_back(range.first_vertex + index[mesh_faces[f].vertices[j]]);
+			range_of.push_back(ranges.size());
+		}
+		ranges.push_back(range);
+	}
+}
+
+Vec3d CompressedGeometry::vertex(unsigned id, int corner) const {
+	const Range &range = ranges[range_of[id]];
+	const unsigned short *q = &positions[3 * indices[3 * id + corner]];
+	return Vec3d(range.low[X] + q[X] * range.step[X], range.low[Y] + q[Y] * range.step[Y],
+		range.low[Z] + q[Z] * range.step[Z]);
+}
+
+Face CompressedGeometry::face(unsigned id) const {
+	const Range &range = ranges[range_of[id]];
+	Face ret;
+	ret.vertices[0] = ret.vertices[1] = ret.vertices[2] = nullptr;
+	ret.material = range.material;
+	ret.primitive = range.primitive;
+	if (range.primitive != nullptr)
+		ret.normal = range.normal;
+	else {
+		ret.normal = (vertex(id, 1) - vertex(id, 0)).cross(vertex(id, 2) - vertex(id, 0));
+		ret.normal.normalize();
+	}
+	return ret;
+}
+
+double CompressedGeometry::intersect(const Ray &ray, unsigned id) const {
+	const Range &range = ranges[range_of[id]];
+	if (range.primitive != nullptr)
+		return range.primitive->intersect(ray);
+
+	// decoded corners, normal on demand
+	Vec3d v[3];
+	for (int j = 0; j < 3; j++) {
+		const unsigned short *q = &positions[3 * indices[3 * id + j]];
+		for (int a = 0; a < 3; a++)
+			v[j][a] = range.low[a] + q[a] * range.step[a];
+	}
+	Vec3d n = (v[1] - v[0]).cross(v[2] - v[0]);
+	n.normalize();
+	return intersect_triangle(ray, v[0], v[1], v[2], n);
+}
+
+double CompressedGeometry::getMaxError() const {
+	double ret = 0;
+	for (size_t r = 0; r < ranges.size(); r++)
+		ret = fmax(ret, ranges[r].step.norm() / 2);
+	return ret;
+}
+
+size_t CompressedGeometry::getBytes() const {
+	return ranges.size() * sizeof(Range) + positions.size() * sizeof(unsigned short) +
+		indices.size() * sizeof(unsigned) + range_of.size() * sizeof(unsigned short);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "vec.h"
+#include "ray.h"
+#include "mesh.h"
+#include "definitions.h"
+
+#include <vector>
+
+using namespace std;
+
+/* CompressedGeometry is a compact copy of the triangles of a set of meshes
+ * that stands in for their faces. Vertices are quantized to 16 bits per axis
+ * within their mesh's bounding box and shared through 32-bit indices;
+ * normals are not stored but computed from the decoded corners on demand.
+ * That is 14 bytes per triangle (indices and mesh) plus 6 per vertex,
+ * against 64 per Face and 24 per vertex. Triangles are numbered as the
+ * meshes' faces in order, the order RayTracer hands them to the octree;
+ * primitives keep their analytic test. The decoded corners are within half
+ * a step (1/131070 of the mesh's extent) of the real ones, and shared
+ * corners decode alike, so the surface stays watertight. Decoding costs
+ * time: this trades compute for memory and bandwidth.
+ * A face is only built for a hit (face()): it has the decoded normal and
+ * the mesh's material, but no vertices, as a PagedMesh's. */
+class CompressedGeometry {
+private:
+	struct Range {
+		Vec3d low, step;		// decoding of the mesh's vertices
+		unsigned first_vertex;
+		Material *material;
+		const Primitive *primitive;		// of an analytic mesh, else nullptr
+		Vec3d normal;					// of an analytic mesh's face
+	};
+
+	vector<Range> ranges;				// per mesh
+	vector<unsigned short> positions;	// 3 per vertex
+	vector<unsigned> indices;			// 3 per triangle, into positions
+	vector<unsigned short> range_of;	// mesh of every triangle
+
+public:
+	CompressedGeometry(Mesh *meshes, int n_meshes);
+
+	/* intersect_face() of triangle id with the decoded corners */
+	double intersect(const Ray &ray, unsigned id) const;
+
+	Vec3d vertex(unsigned id, int corner) const;		// decoded corner of triangle id
+	Face face(unsigned id) const;		// triangle id as a hit face
+
+	// Getters
+	int getSize() const { return range_of.size(); }
+	size_t getBytes() const;		// memory of the compressed triangles
+	double getMaxError() const;		// farthest a decoded corner lies from the real one
+};
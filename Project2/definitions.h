@@ -3,6 +3,8 @@
 #include "vec.h"
 #include "material.h"
 
+#include <cfloat>
+
 #ifndef M_PI
 	#define M_PI 3.14159265358979323846
 #endif
@@ -32,22 +34,47 @@ enum Color {
 	A = 3
 };
 
+struct Primitive;
+
 /* Representing a face: 3 vertices, face normal, and material properties.
- * Vertices and material properties should be stored by pointers to save memory. */
+ * Vertices and material properties should be stored by pointers to save memory.
+ * A face may instead stand for an analytic primitive; its normal is then the
+ * one at the hit point once cast() found it. */
 struct Face {
 	Vec3d *vertices[3];		// CCW direction be front. Triangles only.
 	Vec3d normal;
 	Material *material;
+	const Primitive *primitive = nullptr;	// the analytic shape, nullptr for a triangle
 };
 
-/* Representing a point light: position, RGB color, and intensity. */
+/* Representing a light: position, RGB color, and intensity.
+ * Point lights cast hard shadows. Quad and sphere area lights are centred on
+ * position and cast soft shadows, sampled over their surface. */
 struct Light {
+	enum Shape {
+		POINT,
+		QUAD,
+		SPHERE
+	};
+
 	Vec3d position;			// xyz coordinate		
 	Vec4d color;			// RGBI color + intensity
+	Shape shape;
+	Vec3d edge_u, edge_v;	// QUAD: the two edges spanning the quad
+	double radius;			// SPHERE: sphere radius
 
 	// Easy initializer
 	Light(double x, double y, double z, double r, double g, double b, double i)
-		: position(Vec3d(x,y,z)), color(Vec4d(r,g,b,i)) {}
+		: position(Vec3d(x,y,z)), color(Vec4d(r,g,b,i)), shape(POINT), radius(0) {}
+	Light(const Vec3d &center, const Vec3d &u, const Vec3d &v, double r, double g, double b, double i)
+		: position(center), color(Vec4d(r,g,b,i)), shape(QUAD), edge_u(u), edge_v(v), radius(0) {}
+	Light(const Vec3d &center, double _radius, double r, double g, double b, double i)
+		: position(center), color(Vec4d(r,g,b,i)), shape(SPHERE), radius(_radius) {}
+
+	// Largest distance of a point on the light from its position
+	double extent() const {
+		return shape == QUAD ? (edge_u + edge_v).norm() / 2 : radius;
+	}
 };
 
 /* Representing a camera. Sets view and projection transform parameters.
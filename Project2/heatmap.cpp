@@ -0,0 +1,114 @@
+#include "heatmap.h"
+#include "definitions.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+static Vec3d ramp(double t);
+static void draw_label(Vec3d **img, int height, int width, int x, int y_top, double value, int size);
+
+/* 3x5 glyphs, row-major from the top row, 3 bits per row */
+static const char glyph_chars[] = "0123456789.kM";
+static const int glyphs[] = {
+	0b111101101101111, 0b010110010010111, 0b111001111100111, 0b111001111001111,
+	0b101101111001001, 0b111100111001111, 0b111100111101111, 0b111001001001001,
+	0b111101111101111, 0b111101111001111, 0b000000000000010, 0b100101110101101,
+	0b101111111101101
+};
+
+Vec3d **heatmap(double **costs, int height, int width) {
+	// cost range
+	double max_cost = 0, min_cost = INFTY;
+	for (int i = 0; i < height; i++) {
+		for (int j = 0; j < width; j++) {
+			max_cost = fmax(max_cost, costs[i][j]);
+			min_cost = fmin(min_cost, costs[i][j]);
+		}
+	}
+	// the ramp spans min_cost to max_cost, as the legend's labels say
+	double log_min = log1p(min_cost), log_range = log1p(max_cost) - log_min;
+
+	Vec3d **img = new Vec3d*[height];
+	for (int i = 0; i < height; i++) {
+		img[i] = new Vec3d[width];
+		for (int j = 0; j < width; j++)
+			img[i][j] = ramp(log_range > 0 ? (log1p(costs[i][j]) - log_min) / log_range : 0);
+	}
+
+	// Legend: a vertical colour strip on the right edge, bottom = min, top = max
+	int size = height >= 300 ? 2 : 1;			// glyph pixel size
+	int strip_w = width / 24 > 4 ? width / 24 : 4;
+	int margin = 4 * size;
+	int strip_x = width - strip_w - margin;
+	int strip_lo = margin + 6 * size;			// room for the min label
+	int strip_hi = height - margin - 6 * size;	// room for the max label
+	if (strip_x <= 0 || strip_hi <= strip_lo)
+		return img;
+
+	for (int i = strip_lo - 1; i <= strip_hi + 1; i++) {
+		for (int j = strip_x - 1; j <= strip_x + strip_w; j++) {
+			bool border = i == strip_lo - 1 || i == strip_hi + 1 || j == strip_x - 1 || j == strip_x + strip_w;
+			// log-scaled strip, same mapping as the pixels
+			img[i][j] = border ? Vec3d(1.) : ramp((double)(i - strip_lo) / (strip_hi - strip_lo));
+		}
+	}
+	// ticks at each quarter of the scale
+	for (int q = 1; q < 4; q++) {
+		int i = strip_lo + q * (strip_hi - strip_lo) / 4;
+		for (int j = strip_x - 3 * size; j < strip_x; j++)
+			img[i][j] = Vec3d(1.);
+	}
+
+	draw_label(img, height, width, strip_x + strip_w, height - margin / 2, max_cost, size);
+	draw_label(img, height, width, strip_x + strip_w, strip_lo - 2 * size, min_cost, size);
+	return img;
+}
+
+/* blue -> cyan -> green -> yellow -> red, t in [0,1] */
+static Vec3d ramp(double t) {
+	static const Vec3d stops[] = {
+		Vec3d(0., 0., 1.), Vec3d(0., 1., 1.), Vec3d(0., 1., 0.), Vec3d(1., 1., 0.), Vec3d(1., 0., 0.)
+	};
+	t = t < 0 ? 0 : (t > 1 ? 1 : t);
+	double s = t * 4;
+	int k = s >= 4 ? 3 : (int)s;
+	s -= k;
+	return (1 - s) * stops[k] + s * stops[k + 1];
+}
+
+/* Writes the value right-aligned to x, top row at y_top */
+static void draw_label(Vec3d **img, int height, int width, int x, int y_top, double value, int size) {
+	char text[16];
+	if (value < 1000)
+		snprintf(text, sizeof text, "%d", (int)(value + 0.5));
+	else if (value < 10000)
+		snprintf(text, sizeof text, "%.1fk", value / 1000);
+	else if (value < 1000000)
+		snprintf(text, sizeof text, "%dk", (int)(value / 1000 + 0.5));
+	else
+		snprintf(text, sizeof text, "%.1fM", value / 1000000);
+
+	int len = strlen(text);
+	int x0 = x - len * 4 * size;
+	for (int c = 0; c < len; c++) {
+		const char *found = strchr(glyph_chars, text[c]);
+		if (found == nullptr)
+			continue;
+		int glyph = glyphs[found - glyph_chars];
+		for (int r = 0; r < 5; r++) {
+			for (int b = 0; b < 3; b++) {
+				if (!(glyph & (1 << ((4 - r) * 3 + (2 - b)))))
+					continue;
+				for (int dy = 0; dy < size; dy++) {
+					for (int dx = 0; dx < size; dx++) {
+						int i = y_top - r * size - dy;
+						int j = x0 + c * 4 * size + b * size + dx;
+						if (i >= 0 && i < height && j >= 0 && j < width)
+							img[i][j] = Vec3d(1.);
+					}
+				}
+			}
+		}
+	}
+}
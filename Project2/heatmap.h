@@ -0,0 +1,19 @@
+#pragma once
+
+#include "vec.h"
+#include "definitions.h"
+
+/* What the traversal-cost heatmap encodes per pixel. */
+enum HeatmapMode {
+	HEATMAP_NONE,			// heatmap disabled
+	HEATMAP_NODES,			// octree nodes visited by the pixel's ray tree
+	HEATMAP_TRIANGLES,		// triangle tests of the pixel's ray tree
+	HEATMAP_TIME			// microseconds spent on the pixel
+};
+
+/* heatmap() maps per-pixel costs to colours on a logarithmic blue-green-red scale
+ * from the lowest cost to the highest, and draws a legend strip with the
+ * min/max labels along the right edge.
+ * params: costs          - per-pixel costs, [height][width]
+ * return value: RGB pixels in [0,1], [height][width], allocated with new[]   */
+Vec3d **heatmap(double **costs, int height, int width);
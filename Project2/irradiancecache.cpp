@@ -0,0 +1,107 @@
+#include "irradiancecache.h"
+
+#include <cmath>
+#include <mutex>
+
+constexpr int IRRADIANCE_MIN_RECORDS = 3;		// records needed around a hit to interpolate
+constexpr double IRRADIANCE_MIN_COS = 0.97;		// records' normals must be this close to the hit's
+constexpr double IRRADIANCE_PLANE = 0.05;		// and the hit this close to their plane, per radius
+constexpr double IRRADIANCE_MAX_SPREAD = 0.1;	// largest difference of the visibilities averaged
+
+/* Do the lights cast the same shadows? Colour and intensity don't matter. */
+static bool same_shape(const Light &a, const Light &b) {
+	return a.position == b.position && a.shape == b.shape && a.edge_u == b.edge_u && a.edge_v == b.edge_v &&
+		a.radius == b.radius;
+}
+
+IrradianceCache::IrradianceCache(const Light *_lights, int _n_lights, double _radius)
+	: n_lights(_n_lights), radius(_radius), lights(_lights, _lights + _n_lights) {}
+
+long long IrradianceCache::cell_key(int x, int y, int z) const {
+	// 21 bits per axis
+	const long long mask = (1 << 21) - 1;
+	return ((x & mask) << 42) | ((y & mask) << 21) | (z & mask);
+}
+
+void IrradianceCache::update(const Light *_lights) {
+	unique_lock<shared_timed_mutex> lock(m);
+	bool changed = false;
+	for (int l = 0; l < n_lights; l++) {
+		changed |= !same_shape(lights[l], _lights[l]);
+		lights[l] = _lights[l];
+	}
+	if (changed) {
+		records.clear();
+		visibility.clear();
+		cells.clear();
+	}
+}
+
+bool IrradianceCache::lookup(const Vec3d &pos, const Vec3d &normal, float *ret) const {
+	thread_local vector<double> sums, weights;
+	thread_local vector<float> lows, highs;
+	thread_local vector<int> counts;
+	sums.assign(n_lights, 0);
+	weights.assign(n_lights, 0);
+	lows.assign(n_lights, 1.f);
+	highs.assign(n_lights, 0.f);
+	counts.assign(n_lights, 0);
+
+	int usable = 0;
+	int c[3];
+	for (int a = 0; a < 3; a++)
+		c[a] = (int)floor(pos[a] / radius);
+	{
+		shared_lock<shared_timed_mutex> lock(m);
+		for (int x = c[0] - 1; x <= c[0] + 1; x++) {
+			for (int y = c[1] - 1; y <= c[1] + 1; y++) {
+				for (int z = c[2] - 1; z <= c[2] + 1; z++) {
+					unordered_map<long long, vector<int> >::const_iterator it = cells.find(cell_key(x, y, z));
+					if (it == cells.end())
+						continue;
+					for (size_t k = 0; k < it->second.size(); k++) {
+						const Record &record = records[it->second[k]];
+						// within the radius, on the same surface
+						Vec3d d = pos - record.pos;
+						double dist = d.norm();
+						if (dist >= radius || normal.dot(record.normal) < IRRADIANCE_MIN_COS ||
+							fabs(d.dot(record.normal)) > IRRADIANCE_PLANE * radius)
+							continue;
+						usable++;
+						double w = 1 - dist / radius;
+						for (int l = 0; l < n_lights; l++) {
+							float v = visibility[record.first + l];
+							if (v < 0)
+								continue;
+							sums[l] += w * v;
+							weights[l] += w;
+							lows[l] = fmin(lows[l], v);
+							highs[l] = fmax(highs[l], v);
+							counts[l]++;
+						}
+					}
+				}
+			}
+		}
+	}
+
+	for (int l = 0; l < n_lights; l++) {
+		bool agree = counts[l] >= IRRADIANCE_MIN_RECORDS && highs[l] - lows[l] <= IRRADIANCE_MAX_SPREAD && weights[l] > 0;
+		ret[l] = agree ? (float)(sums[l] / weights[l]) : -1.f;
+	}
+	return usable >= IRRADIANCE_MIN_RECORDS;
+}
+
+void IrradianceCache::insert(const Vec3d &pos, const Vec3d &normal, const float *vis) {
+	unique_lock<shared_timed_mutex> lock(m);
+	Record record = { pos, normal, (int)visibility.size() };
+	visibility.insert(visibility.end(), vis, vis + n_lights);
+	cells[cell_key((int)floor(pos[X] / radius), (int)floor(pos[Y] / radius), (int)floor(pos[Z] / radius))]
+		.push_back(records.size());
+	records.push_back(record);
+}
+
+int IrradianceCache::getSize() const {
+	shared_lock<shared_timed_mutex> lock(m);
+	return records.size();
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "vec.h"
+#include "definitions.h"
+
+#include <vector>
+#include <unordered_map>
+#include <shared_mutex>
+
+using namespace std;
+
+/* IrradianceCache keeps the light visibility of earlier hits, the expensive
+ * part of the direct lighting, as records with a validity radius. A hit takes
+ * a light's visibility from the records around it when there are enough of
+ * them on the same surface (close normals, near the record's plane) and they
+ * agree on it; the visibility is then their average, weighted by distance.
+ * Where they disagree, at shadow edges, the hit computes it exactly.
+ * Hits without enough records around add one. The shading itself (angles,
+ * falloff, highlights) is always computed per hit.
+ * The records are shared by the worker threads: lookups take a shared lock,
+ * additions an exclusive one. Which records a hit sees depends on the order
+ * the workers reach them in, so the image may vary slightly between runs. */
+class IrradianceCache {
+private:
+	struct Record {
+		Vec3d pos, normal;
+		int first;				// offset of its visibility per light in visibility
+	};
+
+	int n_lights;
+	double radius;				// validity radius of every record, also the cell size
+	vector<Light> lights;		// as the visibility was computed
+	vector<Record> records;
+	vector<float> visibility;	// [record][light], -1 if not known
+	unordered_map<long long, vector<int> > cells;	// records per grid cell
+	mutable shared_timed_mutex m;	// guards records, visibility and cells
+
+	long long cell_key(int x, int y, int z) const;
+
+public:
+	IrradianceCache(const Light *lights, int n_lights, double radius);
+
+	/* Forgets every record if a light moved or changed shape */
+	void update(const Light *lights);
+
+	/* Visibility per light at pos from the records around it, in ret, -1 where
+	 * they are too few or disagree. Returns false if there were too few records
+	 * around on the surface, so the hit should add one. */
+	bool lookup(const Vec3d &pos, const Vec3d &normal, float *ret) const;
+
+	/* Adds a record with the visibility per light, -1 where not known */
+	void insert(const Vec3d &pos, const Vec3d &normal, const float *vis);
+
+	// Getters
+	double getRadius() const { return radius; }
+	int getSize() const;
+};
@@ -0,0 +1,379 @@
+#include "leafvisibility.h"
+#include "primitive.h"
+
+#include <cmath>
+#include <cfloat>
+#include <algorithm>
+#include <utility>
+
+constexpr double SHAFT_MARGIN = 1e-5;		// faces this close to the shaft count as inside
+constexpr double PLANE_TOLERANCE = 1e-12;	// points this close to a face's plane count as on it
+constexpr double COVER_MARGIN = 1e-6;		// covering faces must hold the group this far inside
+constexpr int GROUPS_PER_ITEM = 64;			// groups classified per worker item
+constexpr double LARGE_FACE_FRACTION = 16;	// faces wider than the scene / this are large
+constexpr int LARGE_FACE_CELLS = 16;		// cells per side of a large face
+
+/* A plane n.x = d, outside where n.x > d */
+struct Plane {
+	Vec3d n;
+	double d;
+};
+
+/* Interleaved bits of the position's 10-bit grid coordinates in the box */
+static unsigned morton_code(const Vec3d &pos, const Vec3d &low, const Vec3d &high) {
+	unsigned code = 0;
+	for (int a = 0; a < 3; a++) {
+		double t = high[a] > low[a] ? (pos[a] - low[a]) / (high[a] - low[a]) : 0;
+		unsigned c = (unsigned)fmin(1023., fmax(0., t * 1024));
+		for (int bit = 0; bit < 10; bit++)
+			code |= ((c >> bit) & 1u) << (3 * bit + a);
+	}
+	return code;
+}
+
+static int hull_points(const Face &face, Vec3d *corners, const Vec3d **ret);
+static bool planar(const Face &face);
+static bool may_block(const Face &face, const vector<const Face *> &group, const vector<const Vec3d *> *points,
+	const Vec3d &light);
+static bool covers(const Face &face, const vector<const Vec3d *> &vertices, const Vec3d &light);
+
+/* A packed octree node on a walk, with its box */
+struct NodeBox {
+	unsigned k;
+	Vec3d low, high;
+};
+
+/* Pushes the children of the walked node, if any */
+static void push_children(const Octree &octree, const NodeBox &node, vector<NodeBox> &stack) {
+	unsigned first = octree.getChildren(node.k);
+	if (first == 0)
+		return;
+	for (int i = 0; i < 8; i++) {
+		NodeBox child = { first + i, Vec3d(), Vec3d() };
+		octree.getChildBox(node.k, i, node.low, node.high, child.low, child.high);
+		stack.push_back(child);
+	}
+}
+
+LeafVisibility::LeafVisibility(const Octree *_octree) : octree(_octree), n_cells(0) {
+	Vec3d scene = octree->getHighest() - octree->getLowest();
+	double large = fmax(scene[X], fmax(scene[Y], scene[Z])) / LARGE_FACE_FRACTION;
+	auto bounds = [](Group &group) {
+		group.low = Vec3d(INFTY);
+		group.high = Vec3d(-INFTY);
+		for (size_t f = 0; f < group.faces.size(); f++) {
+			Vec3d low, high;
+			face_bounds(*group.faces[f], low, high);
+			for (int a = 0; a < 3; a++) {
+				group.low[a] = fmin(group.low[a], low[a]);
+				group.high[a] = fmax(group.high[a], high[a]);
+			}
+		}
+	};
+
+	// Groups: every leaf, runs of nearby faces of an inner node, as many as a
+	// leaf holds at most, and every large face or primitive
+	vector<NodeBox> stack(1, NodeBox{ 0, octree->getLowest(), octree->getHighest() });
+	while (!stack.empty()) {
+		NodeBox node = stack.back();
+		stack.pop_back();
+		vector<pair<unsigned, const Face *> > faces;
+		for (unsigned f = 0; f < octree->getFaceCount(node.k); f++) {
+			const Face *face = octree->getFace(node.k, f);
+			Vec3d centroid = (*face->vertices[0] + *face->vertices[1] + *face->vertices[2]) / 3;
+			faces.push_back(make_pair(morton_code(centroid, node.low, node.high), face));
+		}
+		sort(faces.begin(), faces.end());
+		int run = 0;
+		size_t current = 0;		// the group of small faces being filled
+		for (size_t f = 0; f < faces.size(); f++) {
+			const Face &face = *faces[f].second;
+			Group group;
+			group.faces.push_back(&face);
+			bounds(group);
+			Vec3d extent = group.high - group.low;
+			if (fmax(extent[X], fmax(extent[Y], extent[Z])) > large) {
+				int a = extent[X] < extent[Y] ? (extent[X] < extent[Z] ? X : Z) : (extent[Y] < extent[Z] ? Y : Z);
+				group.res = LARGE_FACE_CELLS;
+				group.axes[0] = (a + 1) % 3;
+				group.axes[1] = (a + 2) % 3;
+				groups.push_back(group);
+			}
+			else if (face.primitive != nullptr)
+				groups.push_back(group);
+			else if (run++ % MAX_CHILDREN_PER_NODE == 0) {
+				current = groups.size();
+				groups.push_back(group);
+			}
+			else
+				groups[current].faces.push_back(&face);
+		}
+		push_children(*octree, node, stack);
+	}
+
+	for (size_t g = 0; g < groups.size(); g++) {
+		Group &group = groups[g];
+		bounds(group);
+		group.first = n_cells;
+		n_cells += group.res * group.res;
+		for (size_t f = 0; f < group.faces.size(); f++) {
+			const Face &face = *group.faces[f];
+			group_of[FaceKey{ { face.vertices[0], face.vertices[1], face.vertices[2] } }] = g;
+		}
+	}
+}
+
+void LeafVisibility::update(const Light *lights, int n_lights, WorkerPool &pool) {
+	positions.resize(n_lights);
+	classes.resize(n_lights);
+	for (int l = 0; l < n_lights; l++) {
+		if (lights[l].shape != Light::POINT) {
+			classes[l].clear();
+			continue;
+		}
+		if (!classes[l].empty() && positions[l] == lights[l].position)
+			continue;
+
+		positions[l] = lights[l].position;
+		vector<char> &light_classes = classes[l];
+		light_classes.assign(n_cells, MIXED);
+		int n_items = (groups.size() + GROUPS_PER_ITEM - 1) / GROUPS_PER_ITEM;
+		pool.run(n_items, [&](int item) {
+			for (size_t g = item * GROUPS_PER_ITEM; g < groups.size() && g < (size_t)(item + 1) * GROUPS_PER_ITEM; g++) {
+				for (int c = 0; c < groups[g].res * groups[g].res; c++)
+					light_classes[groups[g].first + c] = classify(groups[g], c, positions[l]);
+			}
+		});
+	}
+}
+
+LeafVisibility::Class LeafVisibility::lookup(const Face &face, const Vec3d &pos, int light) const {
+	if (light >= (int)classes.size() || classes[light].empty())
+		return MIXED;
+	unordered_map<FaceKey, int, FaceKeyHash>::const_iterator it =
+		group_of.find(FaceKey{ { face.vertices[0], face.vertices[1], face.vertices[2] } });
+	if (it == group_of.end())
+		return MIXED;
+	const Group &group = groups[it->second];
+	if (group.res == 1)
+		return (Class)classes[light][group.first];
+	int cell = 0;
+	for (int k = 1; k >= 0; k--) {
+		int a = group.axes[k];
+		double t = group.high[a] > group.low[a] ? (pos[a] - group.low[a]) / (group.high[a] - group.low[a]) : 0;
+		int c = (int)fmin(group.res - 1., fmax(0., floor(t * group.res)));
+		cell = cell * group.res + c;
+	}
+	return (Class)classes[light][group.first + cell];
+}
+
+LeafVisibility::Class LeafVisibility::classify(const Group &group, int cell, const Vec3d &light) const {
+	// Region: the group's box, or the cell's part of it, padded for the cell
+	// lookup's rounding
+	Vec3d region_low = group.low, region_high = group.high;
+	if (group.res > 1) {
+		for (int k = 0; k < 2; k++) {
+			int a = group.axes[k];
+			int c = k == 0 ? cell % group.res : cell / group.res;
+			double size = (group.high[a] - group.low[a]) / group.res;
+			region_low[a] = group.low[a] + c * size - SHAFT_MARGIN;
+			region_high[a] = group.low[a] + (c + 1) * size + SHAFT_MARGIN;
+		}
+	}
+	Vec3d corners[8];
+	for (int c = 0; c < 8; c++) {
+		corners[c] = Vec3d(c & 1 ? region_high[X] : region_low[X], c & 2 ? region_high[Y] : region_low[Y],
+			c & 4 ? region_high[Z] : region_low[Z]);
+	}
+	// points spanning the hit points: the faces' vertices, or the region's
+	// corners for a cell or a primitive, alone in its group
+	bool boxed = group.res > 1 || group.faces[0]->primitive != nullptr;
+	vector<const Vec3d *> vertices;
+	if (boxed) {
+		for (int c = 0; c < 8; c++)
+			vertices.push_back(&corners[c]);
+	}
+	else {
+		for (size_t f = 0; f < group.faces.size(); f++) {
+			for (int k = 0; k < 3; k++)
+				vertices.push_back(group.faces[f]->vertices[k]);
+		}
+	}
+
+	// Shaft: the bounding box of the region and the light, and the planes
+	// through the light and an edge of the region that have it on one side
+	Vec3d low, high;
+	for (int a = 0; a < 3; a++) {
+		low[a] = fmin(region_low[a], light[a]) - SHAFT_MARGIN;
+		high[a] = fmax(region_high[a], light[a]) + SHAFT_MARGIN;
+	}
+	vector<Plane> planes;
+	for (int c = 0; c < 8; c++) {
+		for (int bit = 1; bit < 8; bit <<= 1) {
+			if (c & bit)
+				continue;
+			Vec3d n = (corners[c] - light).cross(corners[c | bit] - light);
+			double len = n.norm();
+			if (len < 1e-12)
+				continue;
+			n /= len;
+			double d = n.dot(light);
+			int above = 0, below = 0;
+			for (int k = 0; k < 8; k++) {
+				double s = n.dot(corners[k]) - d;
+				above += s > PLANE_TOLERANCE;
+				below += s < -PLANE_TOLERANCE;
+			}
+			if (above && below)
+				continue;
+			if (above)
+				planes.push_back({ -n, -d });
+			else
+				planes.push_back({ n, d });
+		}
+	}
+	auto outside = [&](const Vec3d *const *v, int n_v) {
+		for (size_t p = 0; p < planes.size(); p++) {
+			int k = 0;
+			while (k < n_v && planes[p].n.dot(*v[k]) - planes[p].d > SHAFT_MARGIN)
+				k++;
+			if (k == n_v)
+				return true;
+		}
+		return false;
+	};
+
+	// Faces in the shaft, found through the octree
+	Class ret = LIT;
+	vector<NodeBox> stack(1, NodeBox{ 0, octree->getLowest(), octree->getHighest() });
+	while (!stack.empty()) {
+		NodeBox node = stack.back();
+		stack.pop_back();
+		const Vec3d &node_low = node.low, &node_high = node.high;
+		if (node_low[X] > high[X] || node_high[X] < low[X] || node_low[Y] > high[Y] || node_high[Y] < low[Y] ||
+			node_low[Z] > high[Z] || node_high[Z] < low[Z])
+			continue;
+		Vec3d node_corners[8];
+		const Vec3d *node_ptrs[8];
+		for (int c = 0; c < 8; c++) {
+			node_corners[c] = Vec3d(c & 1 ? node_high[X] : node_low[X], c & 2 ? node_high[Y] : node_low[Y],
+				c & 4 ? node_high[Z] : node_low[Z]);
+			node_ptrs[c] = &node_corners[c];
+		}
+		if (outside(node_ptrs, 8))
+			continue;
+		push_children(*octree, node, stack);
+
+		for (unsigned f = 0; f < octree->getFaceCount(node.k); f++) {
+			const Face &face = *octree->getFace(node.k, f);
+			Vec3d face_corners[8];
+			const Vec3d *hull[8];
+			int n_hull = hull_points(face, face_corners, hull);
+			if (outside(hull, n_hull) || !may_block(face, group.faces, boxed ? &vertices : nullptr, light))
+				continue;
+			if (covers(face, vertices, light))
+				return SHADOWED;
+			ret = MIXED;
+		}
+		// any cover is most likely a large face, stored near the root
+		if (ret == MIXED)
+			return ret;
+	}
+	return ret;
+}
+
+/* Points whose hull holds the face, in ret: its vertices, or the corners of a
+ * primitive's bounding box, stored in corners. Returns their number. */
+static int hull_points(const Face &face, Vec3d *corners, const Vec3d **ret) {
+	if (face.primitive == nullptr) {
+		for (int k = 0; k < 3; k++)
+			ret[k] = face.vertices[k];
+		return 3;
+	}
+	Vec3d low, high;
+	face_bounds(face, low, high);
+	for (int c = 0; c < 8; c++) {
+		corners[c] = Vec3d(c & 1 ? high[X] : low[X], c & 2 ? high[Y] : low[Y], c & 4 ? high[Z] : low[Z]);
+		ret[c] = &corners[c];
+	}
+	return 8;
+}
+
+/* Does the face lie in the plane of its normal through its first vertex? */
+static bool planar(const Face &face) {
+	return face.primitive == nullptr || face.primitive->kind == Primitive::QUAD;
+}
+
+/* Can the face block a segment from a point on a face of the group to the light?
+ * points, if not null, span the points of interest on the group's faces. */
+static bool may_block(const Face &face, const vector<const Face *> &group, const vector<const Vec3d *> *points,
+	const Vec3d &light) {
+	Vec3d corners[8];
+	const Vec3d *hull[8];
+	int n_hull = hull_points(face, corners, hull);
+	double d = face.normal.dot(*face.vertices[0]);
+	double side = face.normal.dot(light) - d;
+	for (size_t g = 0; g < group.size(); g++) {
+		const Face &other = *group[g];
+		// the group's face faces the light, and the face is behind it
+		double other_d = other.normal.dot(*other.vertices[0]);
+		if (planar(other) && other.normal.dot(light) - other_d > PLANE_TOLERANCE) {
+			int k = 0;
+			while (k < n_hull && other.normal.dot(*hull[k]) - other_d <= PLANE_TOLERANCE)
+				k++;
+			if (k == n_hull)
+				continue;
+		}
+		// the group's face and the light are on one side of the face
+		if (planar(face) && fabs(side) > PLANE_TOLERANCE) {
+			const Vec3d *const *v = points != nullptr ? points->data() : other.vertices;
+			int n_v = points != nullptr ? points->size() : 3;
+			int k = 0;
+			while (k < n_v && (face.normal.dot(*v[k]) - d) * (side > 0 ? 1 : -1) >= -PLANE_TOLERANCE)
+				k++;
+			if (k == n_v)
+				continue;
+		}
+		return true;
+	}
+	return false;
+}
+
+/* Does every segment from a point spanned by the vertices to the light pass through the face? */
+static bool covers(const Face &face, const vector<const Vec3d *> &vertices, const Vec3d &light) {
+	if (!planar(face))
+		return false;
+	const Vec3d &v0 = *face.vertices[0];
+	double d = face.normal.dot(v0);
+	double side = face.normal.dot(light) - d;
+	if (fabs(side) < COVER_MARGIN)
+		return false;
+
+	// a quad's face vertices are its centre and the ends of its half axes
+	bool quad = face.primitive != nullptr;
+	Vec3d u = *face.vertices[1] - v0;
+	Vec3d v = *face.vertices[2] - v0;
+	double uv = u.dot(v), uu = u.dot(u), vv = v.dot(v);
+	double denom = uv * uv - uu * vv;
+	if (denom == 0.)
+		return false;
+
+	for (size_t k = 0; k < vertices.size(); k++) {
+		const Vec3d &p = *vertices[k];
+		// on the far side, and not grazing the face
+		double s = face.normal.dot(p) - d;
+		if (s * side > -COVER_MARGIN * fabs(side))
+			return false;
+		if (fabs(side - s) / light.distance(p) < 1e3 * FLT_EPSILON)
+			return false;
+		// where the segment crosses the face's plane, well inside the face
+		Vec3d w = light + side / (side - s) * (p - light) - v0;
+		double wu = w.dot(u), wv = w.dot(v);
+		double a = (uv * wv - vv * wu) / denom;
+		double b = (uv * wu - uu * wv) / denom;
+		if (quad ? fabs(a) > 1 - COVER_MARGIN || fabs(b) > 1 - COVER_MARGIN :
+			a < COVER_MARGIN || b < COVER_MARGIN || a + b > 1 - COVER_MARGIN)
+			return false;
+	}
+	return true;
+}
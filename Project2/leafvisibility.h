@@ -0,0 +1,78 @@
+#pragma once
+
+#include "vec.h"
+#include "octree.h"
+#include "workerpool.h"
+#include "definitions.h"
+
+#include <vector>
+#include <unordered_map>
+
+using namespace std;
+
+/* LeafVisibility classifies, per point light, the faces of every octree leaf
+ * as fully lit, fully shadowed or mixed. The faces stored in inner nodes
+ * straddle the node's dividing planes; they are classified in runs of a
+ * leaf's size, in Morton order of their centroids. Large faces (walls,
+ * floors) are classified alone, per cell of a grid laid over them, and so
+ * are analytic primitives, by their bounding boxes.
+ * The tests are conservative, so a lit or shadowed group needs no shadow ray:
+ *   lit      - no face may cut the shaft between the group's bounding box and
+ *              the light. A face can't for a face of the group that lies, with
+ *              the light, on one side of its plane, or that faces the light
+ *              with the face behind its own plane.
+ *   shadowed - a single face covers the group's faces as seen from the light
+ * Everything else is mixed. Finding a cover stops at the first node holding
+ * a face that may block, as large covering faces are stored near the root.
+ * The octree is walked through its packed nodes, so a lazy one must be
+ * divided first (Octree::divide()). */
+class LeafVisibility {
+public:
+	enum Class : char {
+		MIXED,
+		LIT,
+		SHADOWED
+	};
+
+private:
+	/* Faces classified together, and their bounding box */
+	struct Group {
+		vector<const Face *> faces;
+		Vec3d low, high;
+		int res = 1;		// cells per side over the two widest axes, 1 if not split
+		int axes[2] = {};	// the two widest axes, if split
+		int first = 0;		// index of the first cell's class
+	};
+
+	/* A face is known by its vertices, as faces are passed around by value */
+	struct FaceKey {
+		const Vec3d *v[3];
+		bool operator==(const FaceKey &other) const {
+			return v[0] == other.v[0] && v[1] == other.v[1] && v[2] == other.v[2];
+		}
+	};
+	struct FaceKeyHash {
+		size_t operator()(const FaceKey &key) const {
+			hash<const void *> h;
+			return h(key.v[0]) ^ (h(key.v[1]) * 31) ^ (h(key.v[2]) * 961);
+		}
+	};
+
+	const Octree *octree;
+	vector<Group> groups;
+	unordered_map<FaceKey, int, FaceKeyHash> group_of;
+	vector<Vec3d> positions;		// per light, as classified
+	vector<vector<char> > classes;	// [light][cell of a group], empty for area lights
+	int n_cells;
+
+	Class classify(const Group &group, int cell, const Vec3d &light) const;
+
+public:
+	LeafVisibility(const Octree *octree);
+
+	/* Classifies the groups for the point lights that are new or moved */
+	void update(const Light *lights, int n_lights, WorkerPool &pool);
+
+	/* Class of the group of the face at pos for the light, MIXED if unknown */
+	Class lookup(const Face &face, const Vec3d &pos, int light) const;
+};
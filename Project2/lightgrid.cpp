@@ -0,0 +1,79 @@
+#include "lightgrid.h"
+#include "ray.h"
+#include "definitions.h"
+
+#include <cmath>
+
+constexpr int MAX_GRID_RES = 32;
+
+static double influence_radius(double intensity, double threshold);
+static double box_distance2(const Vec3d &p, const Vec3d &low, const Vec3d &high);
+
+LightGrid::LightGrid(const Light *_lights, int _n_lights, double threshold, const Vec3d &low, const Vec3d &high)
+	: lights(_lights), n_lights(_n_lights), lowest(low), highest(high) {
+	for (int i = 0; i < n_lights; i++) {
+		radii.push_back(influence_radius(lights[i].color[A], threshold) + lights[i].extent());
+		outside.push_back(i);
+	}
+
+	// about two cells per light along each axis, a handful of lights per cell
+	res = (int)ceil(2 * cbrt((double)n_lights));
+	res = res < 1 ? 1 : (res > MAX_GRID_RES ? MAX_GRID_RES : res);
+	cells.resize(res * res * res);
+
+	Vec3d cell = (highest - lowest) / res;
+	for (int x = 0; x < res; x++) {
+		for (int y = 0; y < res; y++) {
+			for (int z = 0; z < res; z++) {
+				Vec3d clow = lowest + Vec3d(x * cell[X], y * cell[Y], z * cell[Z]);
+				Vec3d chigh = clow + cell;
+				for (int i = 0; i < n_lights; i++) {
+					if (box_distance2(lights[i].position, clow, chigh) <= radii[i] * radii[i])
+						cells[(x * res + y) * res + z].push_back(i);
+				}
+			}
+		}
+	}
+}
+
+void LightGrid::query(const Vec3d &pos, vector<int> &ret) const {
+	const vector<int> *candidates = &outside;
+	int idx[3];
+	bool inside = true;
+	for (int k = 0; k < 3; k++) {
+		double extent = highest[k] - lowest[k];
+		idx[k] = extent > 0 ? (int)((pos[k] - lowest[k]) / extent * res) : 0;
+		if (idx[k] == res && pos[k] <= highest[k])
+			idx[k] = res - 1;		// on the upper boundary
+		inside = inside && idx[k] >= 0 && idx[k] < res && pos[k] >= lowest[k];
+	}
+	if (inside)
+		candidates = &cells[(idx[X] * res + idx[Y]) * res + idx[Z]];
+
+	for (size_t i = 0; i < candidates->size(); i++) {
+		int l = (*candidates)[i];
+		Vec3d d = lights[l].position - pos;
+		if (d.dot(d) <= radii[l] * radii[l])
+			ret.push_back(l);
+	}
+}
+
+/* Distance at which intensity * Ray::falloff() reaches threshold:
+ * 1 + 0.005 r^2 + 0.005 r = intensity / threshold */
+static double influence_radius(double intensity, double threshold) {
+	if (threshold <= 0)
+		return INFINITY;
+	if (intensity <= threshold)
+		return 0;
+	double c = 1 - intensity / threshold;
+	return (-0.005 + sqrt(0.005 * 0.005 - 4 * 0.005 * c)) / (2 * 0.005);
+}
+
+static double box_distance2(const Vec3d &p, const Vec3d &low, const Vec3d &high) {
+	double d2 = 0;
+	for (int k = 0; k < 3; k++) {
+		double d = p[k] < low[k] ? low[k] - p[k] : (p[k] > high[k] ? p[k] - high[k] : 0);
+		d2 += d * d;
+	}
+	return d2;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "vec.h"
+#include "definitions.h"
+
+#include <vector>
+
+using namespace std;
+
+/* LightGrid culls lights whose contribution is negligible at a point.
+ * A light's contribution falls off with Ray::falloff(), so it drops below the
+ * threshold beyond a fixed radius around the light (plus the extent of area
+ * lights). The grid is laid over the scene bounds and every cell lists the
+ * lights whose radius reaches into it, so a query only looks at the lights
+ * of one cell. */
+class LightGrid {
+private:
+	const Light *lights;
+	int n_lights;
+	vector<double> radii;		// influence radius of each light
+	Vec3d lowest, highest;		// grid bounds
+	int res;					// cells per axis
+	vector<vector<int> > cells;	// light indices per cell, x-major
+	vector<int> outside;		// lights to check for points outside the grid: all of them
+
+public:
+	/* params: lights, n_lights - the lights to be culled
+	 *         threshold        - minimum intensity * falloff a light must reach
+	 *         low, high        - bounds of the region that will be queried */
+	LightGrid(const Light *lights, int n_lights, double threshold, const Vec3d &low, const Vec3d &high);
+
+	/* Indices of the lights that reach the threshold at pos, appended to ret */
+	void query(const Vec3d &pos, vector<int> &ret) const;
+
+	double getRadius(int light) const { return radii[light]; }
+};
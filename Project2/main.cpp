@@ -1,4 +1,9 @@
 #include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
 #include "bmploader.h"
 #include "vec.h"
 #include "mesh.h"
@@ -6,90 +11,197 @@
 #include "raytracer.h"
 #include "definitions.h"
 #include "octree.h"
+#include "scene.h"
+#include "stats.h"
+#include "heatmap.h"
+#include "tileorder.h"
 
 using namespace std;
 
-constexpr int NUM_OBJS_TO_BE_RENDERED = 10;
-
-int execute();
-
-int main() {
+/* Command-line render options */
+struct Options {
+	HeatmapMode heatmap_mode = HEATMAP_NONE;
+	double light_cull = 0;		// light culling threshold, 0: off
+	int light_samples = 0;		// lights sampled per hit, 0: all
+	double area_lights = 0;		// replace the point lights by square area lights of this size, 0: off
+	int aa_min = 0, aa_max = 0;	// adaptive anti-aliasing samples per pixel, 0: off
+	double aa_contrast = 0.1;	// colour difference that gets a pixel more samples
+	bool progressive = false;	// coarse-to-fine passes
+	double budget = 0;			// render time budget in seconds, 0: none
+	bool snapshots = false;		// save the image after every pass
+	double stereo = 0;			// eye separation of a stereo pair, 0: a single view
+	bool raster = false;		// primary visibility by rasterization
+	int shadow_maps = 0;		// shadow map resolution, 0: shadow rays only
+	bool leaf_classes = false;	// skip shadow rays in octree leaves lit or shadowed as a whole
+	double irradiance = 0;		// irradiance cache record radius, 0: no cache
+	double lod = 0;				// level-of-detail bias in faces per pixel, 0: full meshes
+	bool compressed = false;	// octree over quantized geometry
+	double out_of_core = 0;		// resident budget of the out-of-core bunnies in MB, 0: in memory
+	bool lazy_octree = false;	// octree nodes built as rays reach them
+	TileOrder tile_order = TILE_ORDER_HILBERT;	// order of the work tiles
+	int tile_size = 16;			// work tile side in pixels
+};
+
+int execute(const Options &options);
+static void save_image(Vec3d **img, int h, int w, const char *outputname);
+
+/* usage: raytracer [--heatmap nodes|triangles|time] [--light-cull THRESHOLD] [--light-samples N]
+ *                  [--area-lights SIZE] [--aa MIN_SAMPLES MAX_SAMPLES] [--aa-contrast T]
+ *                  [--progressive] [--budget SECONDS] [--snapshots] [--stereo SEPARATION] [--raster]
+ *                  [--shadow-maps RESOLUTION] [--leaf-classes] [--irradiance-cache RADIUS]
+ *                  [--lod BIAS] [--compressed-geometry] [--out-of-core BUDGET_MB]
+ *                  [--lazy-octree] [--tile-order scanline|morton|hilbert] [--tile-size PIXELS] */
+int main(int argc, char **argv) {
+	Options options;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--heatmap") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "nodes") == 0)
+				options.heatmap_mode = HEATMAP_NODES;
+			else if (strcmp(argv[i], "triangles") == 0)
+				options.heatmap_mode = HEATMAP_TRIANGLES;
+			else if (strcmp(argv[i], "time") == 0)
+				options.heatmap_mode = HEATMAP_TIME;
+		}
+		else if (strcmp(argv[i], "--light-cull") == 0 && i + 1 < argc)
+			options.light_cull = atof(argv[++i]);
+		else if (strcmp(argv[i], "--light-samples") == 0 && i + 1 < argc)
+			options.light_samples = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--area-lights") == 0 && i + 1 < argc)
+			options.area_lights = atof(argv[++i]);
+		else if (strcmp(argv[i], "--aa") == 0 && i + 2 < argc) {
+			options.aa_min = atoi(argv[++i]);
+			options.aa_max = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--aa-contrast") == 0 && i + 1 < argc)
+			options.aa_contrast = atof(argv[++i]);
+		else if (strcmp(argv[i], "--progressive") == 0)
+			options.progressive = true;
+		else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+			options.budget = atof(argv[++i]);
+		else if (strcmp(argv[i], "--snapshots") == 0)
+			options.snapshots = true;
+		else if (strcmp(argv[i], "--stereo") == 0 && i + 1 < argc)
+			options.stereo = atof(argv[++i]);
+		else if (strcmp(argv[i], "--raster") == 0)
+			options.raster = true;
+		else if (strcmp(argv[i], "--shadow-maps") == 0 && i + 1 < argc)
+			options.shadow_maps = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--leaf-classes") == 0)
+			options.leaf_classes = true;
+		else if (strcmp(argv[i], "--irradiance-cache") == 0 && i + 1 < argc)
+			options.irradiance = atof(argv[++i]);
+		else if (strcmp(argv[i], "--lod") == 0 && i + 1 < argc)
+			options.lod = atof(argv[++i]);
+		else if (strcmp(argv[i], "--compressed-geometry") == 0)
+			options.compressed = true;
+		else if (strcmp(argv[i], "--out-of-core") == 0 && i + 1 < argc)
+			options.out_of_core = atof(argv[++i]);
+		else if (strcmp(argv[i], "--lazy-octree") == 0)
+			options.lazy_octree = true;
+		else if (strcmp(argv[i], "--tile-order") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "scanline") == 0)
+				options.tile_order = TILE_ORDER_SCANLINE;
+			else if (strcmp(argv[i], "morton") == 0)
+				options.tile_order = TILE_ORDER_MORTON;
+			else if (strcmp(argv[i], "hilbert") == 0)
+				options.tile_order = TILE_ORDER_HILBERT;
+		}
+		else if (strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc)
+			options.tile_size = atoi(argv[++i]);
+	}
 
-	return execute();
+	return execute(options);
 }
 
-int execute() {
-	// vars
-
-	Material material[NUM_OBJS_TO_BE_RENDERED];
-	Mat4d models[NUM_OBJS_TO_BE_RENDERED];
-
-	material[0] = Material(Vec4d(1., 1., 1., 1), 100.0, 0.);   // Material property
-	material[1] = Material(Vec4d(0.9, 0.9, 0.9, 1), 100.0, 1.);
-	material[2] = Material(Vec4d(1., 0., 0., 1), 100.0, 0.0);
-	material[3] = Material(Vec4d(0.663, 0.875, 0.929, 1), 100.0, 0.0);
-	material[4] = Material(Vec4d(1., 1.0, 1.0, 0.), 1.4, 0.0);
-	material[5] = Material(Vec4d(0., 1., 0., 1), 100.0, 0.0);
-
-	models[0] = translate(Vec3d(0, 0., 0));   // Model transform matrix
-	models[1] = translate(Vec3d(0, -0.5, 0));
-	models[2] = translate(Vec3d(-0.3, 1., 0.3)) * rotate(M_PI / 4, Vec3d(0, 1, 0));
-	models[3] = translate(Vec3d(0, 0, -2.5)) * rotate(M_PI / 2, Vec3d(1, 0, 0));
-	models[4] = translate(Vec3d(0.15, 0.25, 3.5));
-	models[5] = translate(Vec3d(0.3, 0.1, 1.));
-	models[6] = translate(Vec3d(-10, 0, 0)) * rotate(M_PI / 2, Vec3d(0,0,-1));
-	models[7] = translate(Vec3d(10, 0, 0)) * rotate(M_PI / 2, Vec3d(0,0,1));
-	models[8] = translate(Vec3d(0, 0, 10)) * rotate(M_PI / 2, Vec3d(1,0,0));
-	models[9] = translate(Vec3d(0, 10, 0)) * rotate(M_PI, Vec3d(1,0,0));
-
-	cout << models[0] << endl;
-
-	Mesh meshes[NUM_OBJS_TO_BE_RENDERED] = {
-		Mesh("bunny.off", material[0], models[0], 1),
-		Mesh(Mesh::SQUARE, material[1], models[1], 10),      //mirror floor
-		Mesh(Mesh::SQUARE, material[3], models[3], 10),      //sky blue back board
-		Mesh("sphere.off", material[2], models[2], 0.7),
-		Mesh("bunny.off", material[4], models[4], 1),		// Transparent
-		Mesh("sphere.off", material[5], models[5], 1),
-		Mesh(Mesh::SQUARE, material[3], models[6], 10),		// left wall
-		Mesh(Mesh::SQUARE, material[3], models[7], 10),		// right wall
-		Mesh(Mesh::SQUARE, material[3], models[8], 10),		// back wall
-		Mesh(Mesh::SQUARE, material[3], models[9], 10),		// ceiling
-	};
-
-	// Configure lights
-	Light lights[] = {
-		Light(1, 6, 6, 1., 1., 1., 1),
-		Light(-1, 6, 6, 1., 1., 1., 1)
-	};
-
-	// Configure camera
-	Camera camera(
-		0, 0, 9,	// eye
-		0, 0, 0,	// center
-		0, 1, 0,	// up
-		360, 		// img height
-		60,			// fovy
-		1.,			// aspect
-		0.5, 10		// zNear, zFar
-	);
+int execute(const Options &options) {
+	// Load the scene: meshes, lights and camera
+	Timer loading;
+	Scene scene(360, (size_t)(options.out_of_core * (1 << 20)));
+	double loading_seconds = loading.seconds();
+	Camera &camera = scene.camera;
+	if (options.area_lights > 0) {
+		// horizontal square lights in place of the point lights
+		for (int i = 0; i < scene.n_lights; i++) {
+			Light &l = scene.lights[i];
+			l = Light(l.position, Vec3d(options.area_lights, 0, 0), Vec3d(0, 0, options.area_lights),
+				l.color[R], l.color[G], l.color[B], l.color[A]);
+		}
+	}
 
 	// Run
-	RayTracer rayTracer(meshes, sizeof meshes / sizeof(Mesh), lights, sizeof lights / sizeof(Light), camera);
-	Vec3d** result = rayTracer.render();
+	RayTracer rayTracer(scene.meshes, scene.n_meshes, scene.lights, scene.n_lights, camera, options.lazy_octree);
+	rayTracer.recordPhase(RenderStats::LOADING, loading_seconds);
+	rayTracer.setHeatmapMode(options.heatmap_mode);
+	rayTracer.setTileOrder(options.tile_order, options.tile_size);
+	rayTracer.setLightCulling(options.light_cull);
+	rayTracer.setLightSampling(options.light_samples);
+	rayTracer.setAntialiasing(options.aa_min, options.aa_max, options.aa_contrast);
+	rayTracer.setProgressive(options.progressive, options.budget);
+	rayTracer.setRasterization(options.raster);
+	rayTracer.setShadowMaps(options.shadow_maps);
+	rayTracer.setLeafClassification(options.leaf_classes);
+	rayTracer.setIrradianceCache(options.irradiance);
+	rayTracer.setLevelOfDetail(options.lod);
+	rayTracer.selectLevels(camera);
+	rayTracer.setCompressedGeometry(options.compressed);
+	rayTracer.setPagedMeshes(scene.paged);
+
+	// Views: the camera, or a stereo pair with the eyes moved apart sideways
+	vector<Camera> cameras(1, camera);
+	if (options.stereo > 0) {
+		Vec3d left = camera.up.cross(camera.position - camera.center);
+		left.normalize();
+		cameras.assign(2, camera);
+		cameras[0].position += options.stereo / 2 * left;
+		cameras[0].center += options.stereo / 2 * left;
+		cameras[1].position -= options.stereo / 2 * left;
+		cameras[1].center -= options.stereo / 2 * left;
+	}
+	const char *names[] = { "BUNNY2", "BUNNY2_right" };
 
 	int h = camera.height;
 	int w = h * camera.aspect_ratio;
+	if (options.snapshots) {
+		rayTracer.setSnapshotHook([h, w, &names](Vec3d **pixels, int view, int pass, double seconds) {
+			char name[32];
+			snprintf(name, sizeof name, "%s_pass%d.BMP", names[view], pass);
+			save_image(pixels, h, w, name);
+			cout << " [pass " << pass << ": " << seconds << " s] ";
+		});
+	}
+	vector<Vec3d **> result = rayTracer.render(cameras);
+
+	Timer encoding;
+	for (size_t v = 0; v < result.size(); v++) {
+		char name[32];
+		snprintf(name, sizeof name, "%s.BMP", names[v]);
+		save_image(result[v], h, w, name);
+		if (options.heatmap_mode != HEATMAP_NONE) {
+			snprintf(name, sizeof name, "%s_heatmap.BMP", names[v]);
+			save_image(rayTracer.heatmap(v), h, w, name);
+		}
+	}
+	rayTracer.recordPhase(RenderStats::ENCODING, encoding.seconds());
+
+	// Per-frame statistics
+	ofstream statsfile("BUNNY2.json");
+	rayTracer.getStats().writeJSON(statsfile);
+	return 0;
+}
+
+static void save_image(Vec3d **img, int h, int w, const char *outputname) {
 	uchar4 *converted = new uchar4[h*w];
 	for (int i = 0; i < h; i++) {
 		for (int j = 0; j < w; j++) {
-			converted[h*i + j].x = result[i][j][R] * 255;
-			converted[h*i + j].y = result[i][j][G] * 255;
-			converted[h*i + j].z = result[i][j][B] * 255;
+			converted[h*i + j].x = img[i][j][R] * 255;
+			converted[h*i + j].y = img[i][j][G] * 255;
+			converted[h*i + j].z = img[i][j][B] * 255;
 		}
 
 	}
 
-	SaveBMPFile((uchar4 *)converted, h, w, "BUNNY2.BMP", "360-360.bmp");
-	return 0;
-}
\ No newline at end of file
+	SaveBMPFile((uchar4 *)converted, h, w, outputname, "360-360.BMP");
+	delete[] converted;
+}
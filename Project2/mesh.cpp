@@ -1,30 +1,75 @@
 #include "mesh.h"
+#include "simplify.h"
 #include "definitions.h"
 
 #include <iostream>
 #include <fstream>
 #include <cstring>
 #include <cassert>
+#include <vector>
+#include <algorithm>
 
 using namespace std;
 
 static double INF = 1000;
 
+constexpr double LOD_RATIO = 0.25;		// faces of a level of detail per face of the one before
+constexpr int LOD_MIN_FACES = 200;		// the coarsest level has at least this many
+static const char LOD_MAGIC[8] = { 'M', 'E', 'S', 'H', 'L', 'O', 'D', '2' };
+
 static void update_maxmin(const Vec3d &v, Vec3d &max, Vec3d &min);
 static void get_normal(Face &f);
+static void optimize_layout(vector<Vec3d> &positions, vector<int> &triangles);
+static unsigned long long file_hash(const char *filename);
+static bool load_levels(const char *filename, unsigned long long hash, vector<MeshLevel> &levels);
+static void save_levels(const char *filename, unsigned long long hash, const vector<MeshLevel> &levels);
+
+Mesh::Mesh(const char *filename, const Material &mat, const Mat4d &_model, double dim, bool lod)
+	: mesh_dim(dim), material(mat), level(0) {
+	load(MeshFile(filename, lod), _model);
+}
 
-Mesh::Mesh(const char *filename, const Material &mat, const Mat4d &_model, double dim)
-	: mesh_dim(dim), material(mat) {
-	offFileLoader(filename, _model);
+Mesh::Mesh(const MeshFile &file, const Material &mat, const Mat4d &_model, double dim)
+	: mesh_dim(dim), material(mat), level(0) {
+	load(file, _model);
 }
 
 /* Simple-shape mesh loader */
 /* ϸ  model matrix    ֵ **  1 ֽð 0,0,0 ߽, z࿡ ϰų z  ֵ ּ. */
-Mesh::Mesh(Shape shape, const Material &mat, const Mat4d &_model, double dim)
-	: mesh_dim(dim), material(mat) {
+Mesh::Mesh(Shape shape, const Material &mat, const Mat4d &_model, double dim, bool analytic)
+	: mesh_dim(dim), material(mat), level(0) {
 	// Model transformation matrix
 	Mat4d model = _model * scale(dim);
 
+	if (analytic && shape != TRIANGLE) {
+		// one face standing for the primitive: its centre and half axes,
+		// u x v along the square's normal
+		this->mesh_size = 1;
+		vertices = new Vec3d[4];
+		faces = new Face[mesh_size];
+		this->vertices[0] = Vec3d(0, 0, 0);
+		if (shape == SQUARE) {
+			this->vertices[1] = Vec3d(0, 0, 0.5);
+			this->vertices[2] = Vec3d(0.5, 0, 0);
+			this->vertices[3] = Vec3d(0, 0.5, 0);
+		}
+		else {
+			this->vertices[1] = Vec3d(0.5, 0, 0);
+			this->vertices[2] = Vec3d(0, 0.5, 0);
+			this->vertices[3] = Vec3d(0, 0, 0.5);
+		}
+		for (int i = 0; i < 4; i++)
+			vertices[i] = model * vertices[i];
+		for (int i = 0; i < 3; i++)
+			faces[0].vertices[i] = &vertices[i];
+		faces[0].material = &material;
+		faces[0].primitive = &primitive;
+		primitive.kind = shape == SQUARE ? Primitive::QUAD : (shape == CUBE ? Primitive::BOX : Primitive::SPHERE);
+		update_primitive();
+		return;
+	}
+
+
 	switch (shape) {
 	case TRIANGLE:
 		this->mesh_size = 1;
@@ -154,7 +199,7 @@ Mesh::Mesh(Shape shape, const Material &mat, const Mat4d &_model, double dim)
 		break;
 
 	case SPHERE:
-		offFileLoader("sphere.off", _model);
+		load(MeshFile("sphere.off"), _model);
 		break;
 	default:
 		;
@@ -166,6 +211,54 @@ Mesh::~Mesh() {
 	delete faces;
 }
 
+void Mesh::release() {
+	delete[] vertices;
+	delete[] faces;
+	vertices = nullptr;
+	faces = nullptr;
+	mesh_size = 0;
+	vector<vector<Vec3d> >().swap(lod_vertices);
+	vector<vector<Face> >().swap(lod_faces);
+	level = 0;
+}
+
+void Mesh::transform(const Mat4d &m) {
+	if (is_analytic()) {
+		for (int i = 0; i < 4; i++)
+			vertices[i] = m * vertices[i];
+		update_primitive();
+		return;
+	}
+
+	// every vertex once: the faces share them
+	vector<Vec3d *> moved;
+	for (int i = 0; i < mesh_size; i++) {
+		for (int j = 0; j < 3; j++)
+			moved.push_back(faces[i].vertices[j]);
+	}
+	sort(moved.begin(), moved.end());
+	moved.erase(unique(moved.begin(), moved.end()), moved.end());
+	for (size_t i = 0; i < moved.size(); i++)
+		*moved[i] = m * *moved[i];
+
+	for (int i = 0; i < mesh_size; i++)
+		get_normal(faces[i]);
+
+	// the levels of detail own their vertices
+	for (size_t k = 0; k < lod_faces.size(); k++) {
+		for (size_t i = 0; i < lod_vertices[k].size(); i++)
+			lod_vertices[k][i] = m * lod_vertices[k][i];
+		for (size_t i = 0; i < lod_faces[k].size(); i++)
+			get_normal(lod_faces[k][i]);
+	}
+}
+
+void Mesh::update_primitive() {
+	primitive.set(primitive.kind, vertices[0], vertices[1] - vertices[0], vertices[2] - vertices[0],
+		vertices[3] - vertices[0]);
+	get_normal(faces[0]);
+}
+
 static void update_maxmin(const Vec3d &v, Vec3d &max, Vec3d &min)
 {
 	if (v[X] > max[X])
@@ -191,8 +284,154 @@ static void get_normal(Face &f)
 	f.normal.normalize();
 }
 
-void Mesh::offFileLoader(const char *filename, const Mat4d &_model) {
-	FILE *f;
+/* Interleaved bits of the position's 21-bit grid coordinates in the box */
+static unsigned long long morton_code(const Vec3d &pos, const Vec3d &low, const Vec3d &high) {
+	unsigned long long code = 0;
+	for (int a = 0; a < 3; a++) {
+		double t = high[a] > low[a] ? (pos[a] - low[a]) / (high[a] - low[a]) : 0;
+		unsigned long long c = (unsigned long long)fmin(2097151., fmax(0., t * 2097152));
+		for (int bit = 0; bit < 21; bit++)
+			code |= ((c >> bit) & 1ull) << (3 * bit + a);
+	}
+	return code;
+}
+
+/* Memory layout of an indexed triangle mesh for traversal: welds vertices at
+ * the same position (dropping the faces that collapse), sorts the faces in
+ * Morton order of their centroids, and numbers the vertices in the order the
+ * faces first use them. Faces close in space, as in an octree leaf, are then
+ * close in memory, and so are their vertices. */
+static void optimize_layout(vector<Vec3d> &positions, vector<int> &triangles) {
+	int nv = positions.size(), nf = triangles.size() / 3;
+
+	// 1. Weld: every position maps to the first vertex there
+	vector<int> order(nv), weld(nv);
+	for (int i = 0; i < nv; i++)
+		order[i] = i;
+	sort(order.begin(), order.end(), [&](int a, int b) {
+		for (int c = 0; c < 3; c++) {
+			if (positions[a][c] != positions[b][c])
+				return positions[a][c] < positions[b][c];
+		}
+		return a < b;
+	});
+	for (int i = 0; i < nv; i++)
+		weld[order[i]] = i > 0 && positions[order[i]] == positions[order[i - 1]] ? weld[order[i - 1]] : order[i];
+
+	// 2. Faces in Morton order of their centroids
+	Vec3d low(INFTY), high(-INFTY);
+	vector<Vec3d> centroids(nf);
+	vector<pair<unsigned long long, int> > keys;
+	for (int i = 0; i < nf; i++) {
+		int *v = &triangles[3 * i];
+		for (int j = 0; j < 3; j++)
+			v[j] = weld[v[j]];
+		centroids[i] = (positions[v[0]] + positions[v[1]] + positions[v[2]]) / 3;
+		update_maxmin(centroids[i], high, low);
+	}
+	for (int i = 0; i < nf; i++) {
+		const int *v = &triangles[3 * i];
+		if (v[0] != v[1] && v[1] != v[2] && v[0] != v[2])
+			keys.push_back(make_pair(morton_code(centroids[i], low, high), i));
+	}
+	stable_sort(keys.begin(), keys.end(), [](const pair<unsigned long long, int> &a, const pair<unsigned long long, int> &b) {
+		return a.first < b.first;
+	});
+
+	// 3. Vertices in the order of first use
+	vector<int> index(nv, -1), sorted;
+	vector<Vec3d> used;
+	for (size_t i = 0; i < keys.size(); i++) {
+		for (int j = 0; j < 3; j++) {
+			int v = triangles[3 * keys[i].second + j];
+			if (index[v] < 0) {
+				index[v] = used.size();
+				used.push_back(positions[v]);
+			}
+			sorted.push_back(index[v]);
+		}
+	}
+	positions.swap(used);
+	triangles.swap(sorted);
+}
+
+/* FNV-1a hash of a file's bytes */
+static unsigned long long file_hash(const char *filename) {
+	ifstream file(filename, ios::in | ios::binary);
+	unsigned long long hash = 14695981039346656037ull;
+	char buf[4096];
+	while (file.read(buf, sizeof buf) || file.gcount() > 0) {
+		for (streamsize i = 0; i < file.gcount(); i++) {
+			hash ^= (unsigned char)buf[i];
+			hash *= 1099511628211ull;
+		}
+	}
+	return hash;
+}
+
+/* The levels of detail of a mesh file from its cache, <file>.lod: the magic,
+ * the hash of the mesh file and the parameters they were built with, the
+ * number of levels, then per level its vertex and face counts, the positions
+ * (as in the mesh file) and the vertex indices. False if there is no cache or
+ * it is for another file or other parameters. */
+static bool load_levels(const char *filename, unsigned long long hash, vector<MeshLevel> &levels) {
+	string path = string(filename) + ".lod";
+	ifstream file(path.c_str(), ios::in | ios::binary);
+	char magic[sizeof LOD_MAGIC];
+	unsigned long long file_hash;
+	double ratio;
+	int min_faces, n_levels;
+	if (!file.read(magic, sizeof magic) || memcmp(magic, LOD_MAGIC, sizeof magic) != 0)
+		return false;
+	file.read((char *)&file_hash, sizeof file_hash);
+	file.read((char *)&ratio, sizeof ratio);
+	file.read((char *)&min_faces, sizeof min_faces);
+	file.read((char *)&n_levels, sizeof n_levels);
+	if (!file || file_hash != hash || ratio != LOD_RATIO || min_faces != LOD_MIN_FACES || n_levels < 0)
+		return false;
+
+	levels.assign(n_levels, MeshLevel());
+	for (int k = 0; k < n_levels && file; k++) {
+		int nv = 0, nf = 0;
+		file.read((char *)&nv, sizeof nv);
+		file.read((char *)&nf, sizeof nf);
+		if (!file || nv < 0 || nf < 0)
+			return false;
+		levels[k].vertices.resize(nv);
+		levels[k].triangles.resize(3 * nf);
+		for (int i = 0; i < nv; i++)
+			file.read((char *)&levels[k].vertices[i][0], 3 * sizeof(double));
+		file.read((char *)levels[k].triangles.data(), 3 * nf * sizeof(int));
+		for (int i = 0; i < 3 * nf; i++) {
+			if (levels[k].triangles[i] < 0 || levels[k].triangles[i] >= nv)
+				return false;
+		}
+	}
+	return (bool)file;
+}
+
+static void save_levels(const char *filename, unsigned long long hash, const vector<MeshLevel> &levels) {
+	string path = string(filename) + ".lod";
+	ofstream file(path.c_str(), ios::out | ios::binary);
+	if (!file.is_open())
+		return;		// read-only: the levels are built again next time
+	int min_faces = LOD_MIN_FACES, n_levels = levels.size();
+	file.write(LOD_MAGIC, sizeof LOD_MAGIC);
+	file.write((const char *)&hash, sizeof hash);
+	file.write((const char *)&LOD_RATIO, sizeof LOD_RATIO);
+	file.write((const char *)&min_faces, sizeof min_faces);
+	file.write((const char *)&n_levels, sizeof n_levels);
+	for (int k = 0; k < n_levels; k++) {
+		int nv = levels[k].vertices.size(), nf = levels[k].triangles.size() / 3;
+		file.write((const char *)&nv, sizeof nv);
+		file.write((const char *)&nf, sizeof nf);
+		for (int i = 0; i < nv; i++)
+			file.write((const char *)&levels[k].vertices[i][0], 3 * sizeof(double));
+		file.write((const char *)levels[k].triangles.data(), 3 * nf * sizeof(int));
+	}
+}
+
+MeshFile::MeshFile(const char *filename, bool lod) {
 	char buf[64];
 	int nv, nf;
 
@@ -208,49 +447,64 @@ void Mesh::offFileLoader(const char *filename, const Mat4d &_model) {
 	fileio >> nv >> nf >> buf;
 	assert(nv >= 0 && nf >= 0);
 
-	// 2+. Try to allocate mem space
-	vertices = new Vec3d[nv];
-	faces = new Face[nf];
-	assert(vertices != 0 && faces != 0);
-	mesh_size = nf;
-
-	// 3. Vertex Coordinates
+	// 3. Vertex Coordinates (w/ finding max/min)
 	Vec3d v_max = { -INF, -INF, -INF };
 	Vec3d v_min = { INF, INF, INF };
-
-	// 3-1. Read the positions (w/ finding max/min)
+	positions.resize(nv);
 	for (int i = 0; i < nv; ++i)
 	{
-		fileio >> (vertices[i][X]) >> (vertices[i][Y]) >> (vertices[i][Z]);
-		update_maxmin(vertices[i], v_max, v_min);
+		fileio >> (positions[i][X]) >> (positions[i][Y]) >> (positions[i][Z]);
+		update_maxmin(positions[i], v_max, v_min);
 	}
-
-	// 3-2. Tune the vertices to be centered, properly sized
-	Vec3d center = { (v_max[X] + v_min[X]) / 2,
+	center = { (v_max[X] + v_min[X]) / 2,
 		(v_max[Y] + v_min[Y]) / 2, (v_max[Z] + v_min[Z]) / 2 };
-	double mulfact;
-	if (v_max[X] - v_min[X] > v_max[Y] - v_min[Y]
-		&& v_max[X] - v_min[X] > v_max[Z] - v_min[Z])
-		mulfact = mesh_dim / (v_max[X] - v_min[X]);
-	else if (v_max[Y] - v_min[Y] > v_max[Z] - v_min[Z])
-		mulfact = mesh_dim / (v_max[Y] - v_min[Y]);
-	else
-		mulfact = mesh_dim / (v_max[Z] - v_min[Z]);
-
-	Mat4d model = _model * scale(mulfact) * translate(-center);
-	for (int i = 0; i < nv; ++i)
+	extent = fmax(v_max[X] - v_min[X], fmax(v_max[Y] - v_min[Y], v_max[Z] - v_min[Z]));
+
+	// 4. Face Coordinates (Only triangular faces)
+	triangles.resize(3 * nf);
+	for (int i = 0; i < nf; ++i)
 	{
-		vertices[i] = model * vertices[i];
+		fileio >> buf >> triangles[3 * i] >> triangles[3 * i + 1] >> triangles[3 * i + 2];
 	}
+	fileio.close();
 
-	// 4. Face Coordinates (Only triangular faces)
+	// 4-1. Weld and reorder for traversal
+	optimize_layout(positions, triangles);
+
+	// 5. Levels of detail, from the cache if it is up to date
+	if (!lod)
+		return;
+	unsigned long long hash = file_hash(filename);
+	if (!load_levels(filename, hash, levels)) {
+		levels = simplify(positions, triangles, LOD_RATIO, LOD_MIN_FACES);
+		save_levels(filename, hash, levels);
+	}
+	for (size_t k = 0; k < levels.size(); k++)
+		optimize_layout(levels[k].vertices, levels[k].triangles);
+}
+
+void Mesh::load(const MeshFile &file, const Mat4d &_model) {
+	// Tune the vertices to be centered, properly sized
+	Mat4d model = _model * scale(mesh_dim / file.extent) * translate(-file.center);
+	const vector<Vec3d> &positions = file.positions;
+	const vector<int> &triangles = file.triangles;
+	int nv = positions.size(), nf = triangles.size() / 3;
+
+	// Try to allocate mem space
+	vertices = new Vec3d[nv];
+	faces = new Face[nf];
+	assert(vertices != 0 && faces != 0);
+	mesh_size = nf;
+
+	for (int i = 0; i < nv; ++i)
+	{
+		vertices[i] = model * positions[i];
+	}
 	for (int i = 0; i < nf; ++i)
 	{
-		int idx1, idx2, idx3;
-		fileio >> buf >> idx1 >> idx2 >> idx3;
-		faces[i].vertices[0] = vertices + idx1;
-		faces[i].vertices[1] = vertices + idx2;
-		faces[i].vertices[2] = vertices + idx3;
+		faces[i].vertices[0] = vertices + triangles[3 * i];
+		faces[i].vertices[1] = vertices + triangles[3 * i + 1];
+		faces[i].vertices[2] = vertices + triangles[3 * i + 2];
 
 		// get normal
 		get_normal(faces[i]);
@@ -258,6 +512,22 @@ void Mesh::offFileLoader(const char *filename, const Mat4d &_model) {
 		faces[i].material = &material;
 	}
 
-	fileio.close();
-
-}
\ No newline at end of file
+	// Levels of detail
+	const vector<MeshLevel> &levels = file.levels;
+	lod_vertices.resize(levels.size());
+	lod_faces.resize(levels.size());
+	for (size_t k = 0; k < levels.size(); k++) {
+		const MeshLevel &src = levels[k];
+		lod_vertices[k].resize(src.vertices.size());
+		for (size_t i = 0; i < src.vertices.size(); i++)
+			lod_vertices[k][i] = model * src.vertices[i];
+		lod_faces[k].resize(src.triangles.size() / 3);
+		for (size_t i = 0; i < lod_faces[k].size(); i++) {
+			Face &face = lod_faces[k][i];
+			for (int j = 0; j < 3; j++)
+				face.vertices[j] = &lod_vertices[k][src.triangles[3 * i + j]];
+			get_normal(face);
+			face.material = &material;
+		}
+	}
+}
@@ -1,10 +1,31 @@
 #pragma once
 #include "vec.h"
 #include "material.h"
+#include "primitive.h"
+#include "simplify.h"
 #include "definitions.h"
 
+#include <vector>
+
+/* MeshFile is an .off file as read for Mesh: its vertices welded and its
+ * faces laid out for traversal, and its levels of detail if asked for, all
+ * as in the file, before any transform. Meshes loaded from the same file
+ * can share one MeshFile, and files can be read on several threads. */
+struct MeshFile {
+	std::vector<Vec3d> positions;
+	std::vector<int> triangles;		// 3 per face
+	Vec3d center;					// of the bounding box
+	double extent;					// the box's largest side
+	std::vector<MeshLevel> levels;	// finest first, none unless asked for
+
+	MeshFile(const char *filename, bool lod = false);
+};
+
 /* Mesh class loads a triangular mesh from the .off formatted
- * file, computes the face normals, and fetches material property. */
+ * file, computes the face normals, and fetches material property.
+ * A mesh loaded with levels of detail also keeps coarser copies of itself
+ * (see simplify()), cached on disk next to the file as <file>.lod. One level
+ * is active at a time: get_size() and the faces are the active level's. */
 class Mesh {
 public:
 	enum Shape {
@@ -19,19 +40,41 @@ private:
 	int mesh_size;		// number of faces in the mesh
 	double mesh_dim;		// Maximum length among x, y, z direction dimensions.
 	Material material;	// Material property
+	Primitive primitive;	// the analytic shape, if the mesh is one
+	std::vector<std::vector<Vec3d> > lod_vertices;	// levels of detail 1.., coarser and coarser
+	std::vector<std::vector<Face> > lod_faces;
+	int level;			// active level, 0 is the mesh itself
 public:
 	// Constructor: Mesh file read & loader. It does everything needed.
-	Mesh(const char *filename, const Material &mat, const Mat4d &_model, double dim = 1);
-	Mesh(Shape shape, const Material &mat, const Mat4d &_model, double dim = 1);
+	// lod: also build (or load) the levels of detail
+	Mesh(const char *filename, const Material &mat, const Mat4d &_model, double dim = 1, bool lod = false);
+	// Constructor: the same from a file read before, with levels of detail if it has them
+	Mesh(const MeshFile &file, const Material &mat, const Mat4d &_model, double dim = 1);
+	// analytic: SQUARE, CUBE and SPHERE become a single Primitive instead of triangles
+	Mesh(Shape shape, const Material &mat, const Mat4d &_model, double dim = 1, bool analytic = false);
 	~Mesh();
 
 	// Getters
-	int get_size() { return mesh_size; }
+	int get_size() { return get_size(level); }
+	int get_size(int lod) { return lod == 0 ? mesh_size : lod_faces[lod - 1].size(); }	// faces of a level
 	int get_dimension() { return mesh_dim; }
 	const Material *get_material() { return &material; }
-	const Face *get_const_faces() { return faces; }
-	Face *get_faces() { return faces; }
+	const Face *get_const_faces() { return get_faces(); }
+	Face *get_faces() { return level == 0 ? faces : lod_faces[level - 1].data(); }
+	int get_levels() { return 1 + lod_faces.size(); }
+	int get_level() { return level; }
+	bool is_analytic() { return mesh_size > 0 && faces[0].primitive != nullptr; }
+
+	// Setters
+	void set_material(const Material &mat) { material = mat; }	// the faces keep pointing to it
+	void transform(const Mat4d &m);		// moves every vertex, updating the face normals
+	void set_level(int lod) { level = lod; }	// in [0, get_levels()); rebuild the octree after
+	/* Frees the faces and vertices of every level, for a renderer that keeps
+	 * its own copy of them (see RayTracer::setCompressedGeometry()). The
+	 * material and primitive stay; the mesh has no faces left after. */
+	void release();
 
 private:
-	void offFileLoader(const char *filename, const Mat4d &_model);
+	void load(const MeshFile &file, const Mat4d &_model);	// sized to mesh_dim, then moved by _model
+	void update_primitive();	// the primitive spanned by vertices[0..3]
 };
\ No newline at end of file
@@ -1,9 +1,14 @@
 #include "octree.h"
 #include "definitions.h"
+#include "stats.h"
+#include "primitive.h"
+#include "compressedgeometry.h"
 
 #include <queue>
 #include <functional>
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 
 using namespace std; 
 
@@ -38,13 +43,96 @@ static const Vec3d min(const Vec3d &l, const Vec3d &r);
 static const Vec3d max(const Vec3d &l, const Vec3d &r);
 static const Vec3d findDividingCenter(vector<Face *> facePtrs);
 static byte findChild(const Face &f, const Vec3d &cubeLow, const Vec3d &cubeMid, const Vec3d &cubeHigh);
-static double intersect_face(const Ray &ray, const Face &face);
+static bool penetrates(const Vec3d &lowest, const Vec3d &highest, const Ray &ray);
 
-Octree::Octree(Face ** _faceptrs, int len) {
+static_assert(sizeof(Octree::PackedNode) == 64, "a packed node is one cache line");
+
+/* Coordinate of quantization step q of axis a in the box; the last step is the box's high end */
+static inline double dequantize(const Vec3d &low, const Vec3d &high, int a, int q) {
+	return q == 255 ? high[a] : low[a] + q * ((high[a] - low[a]) / 255);
+}
+
+/* Decoded box of child i of a packed node whose box is low-high */
+static inline void child_box(const Octree::PackedNode &n, int i, const Vec3d &low, const Vec3d &high,
+	Vec3d &ret_low, Vec3d &ret_high) {
+	for (int a = 0; a < 3; a++) {
+		ret_low[a] = dequantize(low, high, a, n.child_low[i][a]);
+		ret_high[a] = dequantize(low, high, a, n.child_high[i][a]);
+	}
+}
+
+Octree::Octree(Face ** _faceptrs, int len, const CompressedGeometry *_geometry, bool _lazy)
+	: lazy(_lazy && _geometry == nullptr), faces(_faceptrs, _faceptrs + len), geometry(_geometry) {
 	vector<Face *> __faceptrs;
 	for (int i = 0; i < len; i++)
 		__faceptrs.push_back(_faceptrs[i]);
-	root = new OctreeNode(__faceptrs, nullptr, -1);
+	root = new OctreeNode(__faceptrs, nullptr, -1, lazy);
+
+	root_low = root->getLowest();
+	root_high = root->getHighest();
+	if (lazy)
+		return;
+	divide();
+	// the packed nodes hold everything the node tree did, and compressed
+	// geometry the faces
+	delete root;
+	root = nullptr;
+	if (geometry != nullptr)
+		vector<const Face *>().swap(faces);
+}
+
+void Octree::divide() {
+	if (!packed.empty())
+		return;
+	root->divide();
+	unordered_map<const Face *, unsigned> ids;
+	for (size_t i = 0; i < faces.size(); i++)
+		ids[faces[i]] = i;
+	packed.resize(1);
+	pack(root, 0, root_low, root_high, ids);
+}
+
+void Octree::pack(const OctreeNode *node, unsigned k, const Vec3d &low, const Vec3d &high,
+	const unordered_map<const Face *, unsigned> &ids) {
+	PackedNode &n = packed[k];
+	n = PackedNode();
+	n.first_face = packed_ids.size();
+	n.n_faces = node->getSize();
+	for (int i = 0; i < node->getSize(); i++)
+		packed_ids.push_back(ids.at(node->getFaces()[i]));
+	if (node->isLeaf())
+		return;
+
+	unsigned first = packed.size();
+	packed[k].children = first;
+	packed.resize(first + 8);		// n is no longer valid
+	Vec3d lows[8], highs[8];
+	for (int i = 0; i < 8; i++) {
+		const OctreeNode *child = node->getChild(i);
+		PackedNode &p = packed[k];
+		for (int a = 0; a < 3; a++) {
+			if (child->isEmpty()) {
+				p.child_low[i][a] = 255;
+				p.child_high[i][a] = 0;
+				continue;
+			}
+			// outwards, past any rounding of dequantize()
+			double extent = high[a] - low[a];
+			double t_low = extent > 0 ? (child->getLowest()[a] - low[a]) / extent * 255 : 0;
+			double t_high = extent > 0 ? (child->getHighest()[a] - low[a]) / extent * 255 : 255;
+			int q_low = (int)fmax(0., fmin(255., floor(t_low)));
+			int q_high = (int)fmax(0., fmin(255., ceil(t_high)));
+			while (q_low > 0 && dequantize(low, high, a, q_low) > child->getLowest()[a])
+				q_low--;
+			while (q_high < 255 && dequantize(low, high, a, q_high) < child->getHighest()[a])
+				q_high++;
+			p.child_low[i][a] = q_low;
+			p.child_high[i][a] = q_high;
+		}
+		child_box(p, i, low, high, lows[i], highs[i]);
+	}
+	for (int i = 0; i < 8; i++)
+		pack(node->getChild(i), first + i, lows[i], highs[i], ids);
 }
 
 Octree::~Octree() {
@@ -55,6 +143,8 @@ Octree::~Octree() {
 void Octree::showAll(Node *ptr) const {
 	if (ptr == nullptr)
 		ptr = root;
+	if (ptr == nullptr)
+		return;
 	static int size = 0;
 	
 	if (!ptr->isLeaf()) {
@@ -63,11 +153,38 @@ void Octree::showAll(Node *ptr) const {
 	}
 }
 
+void Octree::getChildBox(unsigned k, int i, const Vec3d &low, const Vec3d &high, Vec3d &ret_low, Vec3d &ret_high) const {
+	child_box(packed[k], i, low, high, ret_low, ret_high);
+}
+
+size_t Octree::getNodeBytes() const {
+	if (root == nullptr)
+		return 0;
+	size_t bytes = 0;
+	vector<const OctreeNode *> stack(1, root);
+	while (!stack.empty()) {
+		const OctreeNode *node = stack.back();
+		stack.pop_back();
+		bytes += node->getBytes();
+		if (!node->isLeaf()) {
+			for (int i = 0; i < 8; i++)
+				stack.push_back(node->getChild(i));
+		}
+	}
+	return bytes;
+}
+
+size_t Octree::getPackedBytes() const {
+	return packed.capacity() * sizeof(PackedNode) + packed_ids.capacity() * sizeof(unsigned) +
+		faces.capacity() * sizeof(const Face *);
+}
+
 bool Octree::getNearestIntersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const {
-	if (!root->penetratedBy(ray))
-		return false;
 	double r;
-	if (root->nearestIntersect(ray, ret_face, r)) {
+	Face built;
+	const Face *face = getNearestFace(ray, r, built);
+	if (face != nullptr) {
+		ret_face = *face;
 		ret_vec = ray.getOrigin() + r * ray.getDirection();
 		return true;
 	}
@@ -75,54 +192,166 @@ bool Octree::getNearestIntersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec)
 		return false;
 }
 
+const Face *Octree::getNearestFace(const Ray &ray, double &ret_r, Face &buffer, unsigned *ret_node) const {
+	if (!penetrates(root_low, root_high, ray))
+		return nullptr;
+	const Face *face;
+	if (lazy) {
+		const OctreeNode *hit_node;
+		if (!root->nearestIntersect(ray, face, ret_r, hit_node))
+			return nullptr;
+		if (ret_node != nullptr)
+			*ret_node = (unsigned)-1;
+		return face;
+	}
+	unsigned id, node;
+	if (nearest(ray, 0, root_low, root_high, id, ret_r, node)) {
+		if (ret_node != nullptr)
+			*ret_node = node;
+		if (geometry == nullptr)
+			return faces[id];
+		buffer = geometry->face(id);
+		return &buffer;
+	}
+	else
+		return nullptr;
+}
+
+/* OctreeNode::nearestIntersect() over the packed nodes, k with the box low-high */
+bool Octree::nearest(const Ray &ray, unsigned k, const Vec3d &low, const Vec3d &high,
+	unsigned &ret_id, double &ret_r, unsigned &ret_node) const {
+	const PackedNode &n = packed[k];
+	RenderStats &stats = RenderStats::local();
+	stats.nodes_visited++;
+	stats.triangle_tests += n.n_faces;
+
+	unsigned candidate_id = 0;
+	unsigned candidate_node = k;
+	double min_r = INFTY;
+	const unsigned *ids = packed_ids.data() + n.first_face;
+	for (unsigned i = 0; i < n.n_faces; i++) {
+		double candidate_r = geometry != nullptr ? geometry->intersect(ray, ids[i]) : intersect_face(ray, *faces[ids[i]]);
+		if (candidate_r != -1 && candidate_r < min_r) {
+			candidate_id = ids[i];
+			min_r = candidate_r;
+		}
+	}
+
+	if (n.children != 0) {
+		for (int i = 0; i < 8; i++) {
+			if (n.child_low[i][X] > n.child_high[i][X])
+				continue;		// empty
+			Vec3d c_low, c_high;
+			child_box(n, i, low, high, c_low, c_high);
+			if (!penetrates(c_low, c_high, ray))
+				continue;
+			unsigned r_id;
+			double r_r;
+			unsigned r_node;
+			if (nearest(ray, n.children + i, c_low, c_high, r_id, r_r, r_node) && r_r < min_r) {
+				min_r = r_r;
+				candidate_id = r_id;
+				candidate_node = r_node;
+			}
+		}
+	}
+
+	if (min_r != INFTY) {
+		ret_id = candidate_id;
+		ret_r = min_r;
+		ret_node = candidate_node;
+		return true;
+	}
+	else
+		return false;
+}
+
+
 
+const Node::Split Node::undivided = {};
+constexpr unsigned RELEASED = 1u << 31;		// OctreeNode::dividing once faceptrs is freed
 
 Node::OctreeNode()
-	: lowest(Vec3d(INFTY)), highest(Vec3d(-INFTY)), dividing_center(Vec3d(0.)),
-	parent(nullptr), children(nullptr), index(-1) {}
+	: lowest(Vec3d(INFTY)), highest(Vec3d(-INFTY)), parent(nullptr), split(&undivided), dividing(0), index(-1) {}
 
-Node::OctreeNode(const vector<Face *> &_faceptrs, OctreeNode *_parent, byte _index)
-	: faceptrs(_faceptrs), parent(_parent), index(_index) {
+Node::OctreeNode(const vector<Face *> &_faceptrs, OctreeNode *_parent, byte _index, bool lazy)
+	: faceptrs(_faceptrs), parent(_parent), split(nullptr), dividing(0), index(_index) {
 	lowest = findLowest(faceptrs);
 	highest = findHighest(faceptrs);
-	children = nullptr;
+	if (!lazy)
+		expand(false);
+}
 
-	if (faceptrs.size() < MAX_CHILDREN_PER_NODE) {
-		return;
+const Node::Split *Node::expand(bool lazy) const {
+	const Split *published = split.load(memory_order_acquire);
+	if (published != nullptr)
+		return published;
+
+	// faceptrs is only read by threads counted in dividing, and they only
+	// start reading while no split is published
+	dividing.fetch_add(1);
+	published = split.load();
+	if (published != nullptr) {
+		leave(published);
+		return published;
 	}
 
-	Vec3d center = findDividingCenter(faceptrs);
-	vector<Face *> myChildren[8]{};
-	for (vector<Face *>::iterator it = faceptrs.begin(); it != faceptrs.end();) {
-		byte idx = findChild(**it, lowest, center, highest);
-		if (idx != (byte)-1) {
-			myChildren[idx].push_back(*it);
-			it = faceptrs.erase(it);
+	const Split *divided = &undivided;
+	if (faceptrs.size() >= MAX_CHILDREN_PER_NODE) {
+		Vec3d center = findDividingCenter(faceptrs);
+		vector<Face *> kept;
+		vector<Face *> myChildren[8]{};
+		for (size_t f = 0; f < faceptrs.size(); f++) {
+			byte idx = findChild(*faceptrs[f], lowest, center, highest);
+			if (idx != (byte)-1)
+				myChildren[idx].push_back(faceptrs[f]);
+			else
+				kept.push_back(faceptrs[f]);
+		}
+		if (kept.size() != faceptrs.size()) {
+			Split *s = new Split{ kept, center, {} };
+			for (int i = 0; i < 8; i++)
+				s->children[i] = new Node(myChildren[i], const_cast<Node *>(this), i, lazy);
+			divided = s;
 		}
-		else
-			++it;
 	}
 
-	if (faceptrs.size() != _faceptrs.size()) {
-		dividing_center = center;
-		children = new Node*[8];
-		for (int i = 0; i < 8; i++) {
-			children[i] = new Node(myChildren[i], this, i);
-		}
+	// publish, unless another thread was first
+	if (split.compare_exchange_strong(published, divided)) {
+		if (lazy)
+			RenderStats::local().nodes_split++;
+		leave(divided);
+		return divided;
 	}
+	leave(published);
+	if (divided != &undivided) {
+		for (int i = 0; i < 8; i++)
+			delete divided->children[i];
+		delete divided;
+	}
+	return published;
+}
+
+void Node::leave(const Split *published) const {
+	// the last thread out frees the faces, unless a newcomer claims that first
+	unsigned none = 0;
+	if (dividing.fetch_sub(1) == 1 && published->children[0] != nullptr &&
+		dividing.compare_exchange_strong(none, RELEASED))
+		vector<Face *>().swap(const_cast<vector<Face *> &>(faceptrs));
 }
 
 Node::~OctreeNode() {
-	faceptrs.clear();
-	if (children != nullptr) {
+	const Split *s = split.load();
+	if (s != nullptr && s != &undivided) {
 		for (int i = 0; i < 8; i++)
-			delete children[i];
-		delete children;
+			delete s->children[i];
+		delete s;
 	}
 }
 
 bool Node::isLeaf() const {
-	return children == nullptr;
+	const Split *s = split.load(memory_order_acquire);
+	return s == nullptr || s->children[0] == nullptr;
 }
 
 bool Node::isRoot() const {
@@ -130,33 +359,49 @@ bool Node::isRoot() const {
 }
 
 bool Node::isEmpty() const {
-	return faceptrs.size() == 0;
+	return lowest[X] > highest[X];
 }
 
 int Node::getSize() const {
-	return faceptrs.size();
+	return getFaces().size();
+}
+
+const vector<Face *> &Node::getFaces() const {
+	// an undivided lazy node's faces go once any thread divides it
+	const Split *s = expand(true);
+	return s->children[0] != nullptr ? s->faceptrs : faceptrs;
 }
 
 Node *Node::getChild(byte idx) const {
 	assert(!isLeaf());
-	return children[idx];
+	return split.load(memory_order_acquire)->children[idx];
 }
 
-bool Node::nearestIntersect(const Ray &ray, Face &ret_face, double &ret_r) const {
-	Face candidate_f;
+bool Node::nearestIntersect(const Ray &ray, const Face *&ret_face, double &ret_r, const OctreeNode *&ret_node) const {
+	// a lazy node is divided by the first ray to enter it
+	const Split *s = expand(true);
+	OctreeNode *const *children = s->children;
+	const vector<Face *> &faceptrs = children[0] != nullptr ? s->faceptrs : this->faceptrs;
+	RenderStats &stats = RenderStats::local();
+	stats.nodes_visited++;
+	stats.triangle_tests += faceptrs.size();
+
+	const Face *candidate_f = nullptr;
+	const OctreeNode *candidate_node = this;
 	double min_r = INFTY;
 	for (vector<Face *>::const_iterator it = faceptrs.begin(); it != faceptrs.end(); ++it) {
 		double candidate_r = intersect_face(ray, **it);
 		if (candidate_r != -1 && candidate_r < min_r) {
-			candidate_f = **it;
+			candidate_f = *it;
 			min_r = candidate_r;
 		}
 	}
 
-	if (isLeaf()) {
+	if (children[0] == nullptr) {
 		if (min_r != INFTY) {
 			ret_face = candidate_f;
 			ret_r = min_r;
+			ret_node = candidate_node;
 			return true;
 		}
 		else
@@ -166,12 +411,14 @@ bool Node::nearestIntersect(const Ray &ray, Face &ret_face, double &ret_r) const
 	// Iterate on the children
 	for (int i = 0; i < 8; i++) {
 		if (children[i]->penetratedBy(ray)) {
-			Face r_face;
+			const Face *r_face;
 			double r_r;
-			if (children[i]->nearestIntersect(ray, r_face, r_r) &&
+			const OctreeNode *r_node;
+			if (children[i]->nearestIntersect(ray, r_face, r_r, r_node) &&
 				r_r < min_r) {
 				min_r = r_r;
 				candidate_f = r_face;
+				candidate_node = r_node;
 			}
 		}
 	}
@@ -179,13 +426,40 @@ bool Node::nearestIntersect(const Ray &ray, Face &ret_face, double &ret_r) const
 	if (min_r != INFTY) {
 		ret_face = candidate_f;
 		ret_r = min_r;
+		ret_node = candidate_node;
 		return true;
 	}
 	else
 		return false;
 }
 
+void Node::divide() const {
+	const Split *s = expand(false);
+	if (s->children[0] != nullptr) {
+		for (int i = 0; i < 8; i++)
+			s->children[i]->divide();
+	}
+}
+
+size_t Node::getBytes() const {
+	size_t bytes = sizeof(OctreeNode);
+	const Split *s = split.load(memory_order_acquire);
+	if (s != nullptr && s != &undivided)
+		bytes += sizeof(Split) + s->faceptrs.capacity() * sizeof(Face *);
+	else
+		bytes += faceptrs.capacity() * sizeof(Face *);		// still held: freed only once divided
+	return bytes;
+}
+
 bool Node::penetratedBy(const Ray &ray) const {
+	return penetrates(lowest, highest, ray);
+}
+
+
+
+
+/* Helper functions */
+static bool penetrates(const Vec3d &lowest, const Vec3d &highest, const Ray &ray) {
 	Vec3d o = ray.getOrigin();
 	Vec3d d = ray.getDirection();
 
@@ -210,17 +484,12 @@ bool Node::penetratedBy(const Ray &ray) const {
 	return r_far > r_near;
 }
 
-
-
-
-/* Helper functions */
 static const Vec3d findLowest(const vector<Face *> &_fptrs) {
 	Vec3d lowest(INFTY);
 	for (int i = 0; i < _fptrs.size(); i++) {
-		for (int j = 0; j < 3; j++) {
-			Vec3d v = *(_fptrs[i]->vertices[j]);
-			lowest = min(lowest, v);
-		}
+		Vec3d low, high;
+		face_bounds(*_fptrs[i], low, high);
+		lowest = min(lowest, low);
 	}
 	return lowest;
 }
@@ -228,10 +497,9 @@ static const Vec3d findLowest(const vector<Face *> &_fptrs) {
 static const Vec3d findHighest(const vector<Face *> &_fptrs) {
 	Vec3d highest(-INFTY);
 	for (int i = 0; i < _fptrs.size(); i++) {
-		for (int j = 0; j < 3; j++) {
-			Vec3d v = *(_fptrs[i]->vertices[j]);
-			highest = max(highest, v);
-		}
+		Vec3d low, high;
+		face_bounds(*_fptrs[i], low, high);
+		highest = max(highest, high);
 	}
 	return highest;
 }
@@ -275,34 +543,45 @@ static const Vec3d findDividingCenter(vector<Face *> facePtrs) {
 static byte findChild(const Face &f, const Vec3d &cubeLow, const Vec3d &cubeMid, const Vec3d &cubeHigh) {
 	byte xxyyzz = 0b111111; // +x -x +y -y +z -z
 
-	for (int i = 0; i < 3; i++) {
+	// a primitive by the corners of its bounding box
+	Vec3d box[2];
+	const Vec3d *points[3] = { f.vertices[0], f.vertices[1], f.vertices[2] };
+	int n_points = 3;
+	if (f.primitive != nullptr) {
+		face_bounds(f, box[0], box[1]);
+		points[0] = &box[0];
+		points[1] = &box[1];
+		n_points = 2;
+	}
+
+	for (int i = 0; i < n_points; i++) {
 		// +z
-		if ((*f.vertices[i])[Z] > cubeMid[Z] && (*f.vertices[i])[Z] < cubeHigh[Z]) {
+		if ((*points[i])[Z] > cubeMid[Z] && (*points[i])[Z] < cubeHigh[Z]) {
 			xxyyzz = xxyyzz & 0b111110;
 		}
 
 		// -z
-		if ((*f.vertices[i])[Z] < cubeMid[Z] && (*f.vertices[i])[Z] > cubeLow[Z]) {
+		if ((*points[i])[Z] < cubeMid[Z] && (*points[i])[Z] > cubeLow[Z]) {
 			xxyyzz = xxyyzz & 0b111101;
 		}
 
 		// +y
-		if ((*f.vertices[i])[Y] > cubeMid[Y] && (*f.vertices[i])[Y] < cubeHigh[Y]) {
+		if ((*points[i])[Y] > cubeMid[Y] && (*points[i])[Y] < cubeHigh[Y]) {
 			xxyyzz = xxyyzz & 0b111011;
 		}
 
 		// -y
-		if ((*f.vertices[i])[Y] < cubeMid[Y] && (*f.vertices[i])[Y] > cubeLow[Y]) {
+		if ((*points[i])[Y] < cubeMid[Y] && (*points[i])[Y] > cubeLow[Y]) {
 			xxyyzz = xxyyzz & 0b110111;
 		}
 
 		// +x
-		if ((*f.vertices[i])[X] > cubeMid[X] && (*f.vertices[i])[X] < cubeHigh[X]) {
+		if ((*points[i])[X] > cubeMid[X] && (*points[i])[X] < cubeHigh[X]) {
 			xxyyzz = xxyyzz & 0b101111;
 		}
 
 		// -x
-		if ((*f.vertices[i])[X] < cubeMid[X] && (*f.vertices[i])[X] > cubeLow[X]) {
+		if ((*points[i])[X] < cubeMid[X] && (*points[i])[X] > cubeLow[X]) {
 			xxyyzz = xxyyzz & 0b011111;
 		}
 	}
@@ -316,9 +595,13 @@ static byte findChild(const Face &f, const Vec3d &cubeLow, const Vec3d &cubeMid,
 	return ((xxyyzz & 0b100000) >> 3) | ((xxyyzz & 0b001000) >> 2) | ((xxyyzz & 0b000010) >> 1);
 }
 
-static double intersect_face(const Ray &ray, const Face &face) {
-	Vec3d n = face.normal;
+double intersect_face(const Ray &ray, const Face &face) {
+	if (face.primitive != nullptr)
+		return face.primitive->intersect(ray);
+	return intersect_triangle(ray, *face.vertices[0], *face.vertices[1], *face.vertices[2], face.normal);
+}
 
+double intersect_triangle(const Ray &ray, const Vec3d &v0, const Vec3d &v1, const Vec3d &v2, const Vec3d &n) {
 	// parallel test
 	// It does not consider when the ray is INSIDE the face plane
 	double r = n.dot(ray.getDirection());
@@ -326,7 +609,6 @@ static double intersect_face(const Ray &ray, const Face &face) {
 		return -1;
 	}
 
-	Vec3d v0 = *face.vertices[0];
 	Vec3d p0 = ray.getOrigin();
 	r = (n.dot(v0 - p0)) / r;
 
@@ -337,8 +619,8 @@ static double intersect_face(const Ray &ray, const Face &face) {
 
 	Vec3d p_i = p0 + r * ray.getDirection();
 
-	Vec3d u = *face.vertices[1] - *face.vertices[0];
-	Vec3d v = *face.vertices[2] - *face.vertices[0];
+	Vec3d u = v1 - v0;
+	Vec3d v = v2 - v0;
 	Vec3d w = p_i - v0;
 
 	double uv = u.dot(v);	double wv = w.dot(v);
@@ -6,9 +6,13 @@
 #include "definitions.h"
 
 #include <vector>
+#include <unordered_map>
+#include <atomic>
 
 typedef unsigned char byte;
 
+class CompressedGeometry;
+
 constexpr int MAX_CHILDREN_PER_NODE = 10;
 constexpr byte MASK_X = 0b0001;
 constexpr byte MASK_Y = 0b0010;
@@ -19,38 +23,139 @@ class Octree {
 public:
 	class OctreeNode {
 	private:
-		vector<Face *> faceptrs;	// faces are passed by pointers for mem eff
+		/* The node divided among its children, published once by expand() */
+		struct Split {
+			vector<Face *> faceptrs;	// faces kept in the node: they cross the dividing planes
+			Vec3d dividing_center;		// child-dividing center
+			OctreeNode *children[8];	// all nullptr if the node can't be divided
+		};
+		static const Split undivided;	// the split of every leaf
+
+		vector<Face *> faceptrs;	// faces are passed by pointers for mem eff; all of the subtree's until divided
 		Vec3d lowest;				// lowX lowY lowZ coord
 		Vec3d highest;				// highX highY highZ coord
-		Vec3d dividing_center;		// child-dividing center
 		OctreeNode *parent;			// parent pointer
-		OctreeNode **children;		// 8 dynamic child pointers
+		mutable atomic<const Split *> split;	// nullptr until expanded
+		mutable atomic<unsigned> dividing;		// threads in expand(), RELEASED once faceptrs is freed
 		byte index;					// of which side it resides in its parent
 									// 3 bits XYZ represents sign
 
+		/* Divides the node unless that was done; the node's children are
+		 * lazy too if lazy. Threads may race to divide a node: the first
+		 * split published wins, the others are dropped. The faces of a divided
+		 * node have moved to the split and its children, and are freed by the
+		 * last thread to leave.
+		 * return value: the published split */
+		const Split *expand(bool lazy) const;
+		void leave(const Split *published) const;		// leaves expand()
+
 	public:
 		OctreeNode();
-		OctreeNode(const vector<Face *> &_faceptrs, OctreeNode *_parent, byte _index);
+		/* lazy: divided on the first nearestIntersect() to enter it, else at once with the whole subtree */
+		OctreeNode(const vector<Face *> &_faceptrs, OctreeNode *_parent, byte _index, bool lazy = false);
 		~OctreeNode();
 
 		bool isLeaf() const;				// is this node leaf? (no children)
 		bool isRoot() const;				// is this node root? (no parent)
-		bool isEmpty() const;				// is this node empty?
+		bool isEmpty() const;				// is this node's subtree empty?
 		
 		int getSize() const;						// get number of faces
+		const Vec3d &getLowest() const { return lowest; }		// bounding box
+		const Vec3d &getHighest() const { return highest; }
 		OctreeNode *getChild(byte idx) const;		// get a child
+		/* Faces stored in this node. A lazy node is divided first, as the faces
+		 * of an undivided one are freed when a tracing thread divides it; the
+		 * reference stays valid for the octree's life. */
+		const vector<Face *> &getFaces() const;
 		bool nearestIntersect(const Ray &ray,		// nearest intersection for the ray
-			Face &ret_face, double &ret_r) const;
+			const Face *&ret_face, double &ret_r, const OctreeNode *&ret_node) const;
 		bool penetratedBy(const Ray &ray) const;	// does the ray pass through?
+		void divide() const;						// divides the whole subtree, as built eagerly
+		size_t getBytes() const;					// memory of the node and its split, not its children;
+													// not while rays may divide a lazy node
+	};
+
+	/* Traversal copy of a node, one cache line: the boxes of its 8 children
+	 * quantized to 8 bits per axis within its own box as decoded from its
+	 * parent's record, rounded outwards so that no hit is lost, and its faces
+	 * as a range of packed_ids. The 8 children are stored next to each
+	 * other; an empty child has low > high. */
+	struct PackedNode {
+		unsigned char child_low[8][3];
+		unsigned char child_high[8][3];
+		unsigned children;			// index of the first child, 0 for a leaf
+		unsigned first_face;		// into packed_ids
+		unsigned n_faces;
+		unsigned char pad[4];		// to 64 bytes
 	};
 private:
-	OctreeNode *root;
+	OctreeNode *root;						// nullptr once an eager octree is packed
+	bool lazy;								// traverse the node tree, dividing nodes on the first entry
+	vector<PackedNode> packed;				// depth first from the root, which is packed[0]
+	vector<unsigned> packed_ids;			// faces per node, in the order of packed, as indices of faces
+	vector<const Face *> faces;				// as given to the constructor, none over geometry
+	const CompressedGeometry *geometry;		// leaf tests and hit faces on it if not null, else the faces
+	Vec3d root_low, root_high;
+
+	void pack(const OctreeNode *node, unsigned k, const Vec3d &low, const Vec3d &high,
+		const unordered_map<const Face *, unsigned> &ids);
+	bool nearest(const Ray &ray, unsigned k, const Vec3d &low, const Vec3d &high,
+		unsigned &ret_id, double &ret_r, unsigned &ret_node) const;
 	
 public:
-	Octree(Face **_faceptrs, int len);
+	/* geometry, if not null, has the faces in the same order and must
+	 * outlive the octree; rays are then tested against it, and the faces
+	 * need only live through the constructor.
+	 * lazy: only the root is built, and every node is divided the first time
+	 * a ray enters it, by whichever thread gets there first. Rays then
+	 * traverse the node tree rather than packed nodes, so geometry, which
+	 * needs those, leaves the octree eager. Walks of the node tree, which may
+	 * run while rays are traced, see nodes not yet divided as leaves, and
+	 * divide the ones whose faces they read (see getFaces()).
+	 * An eager octree frees its node tree once packed; the walks over it go
+	 * through the packed nodes. */
+	Octree(Face **_faceptrs, int len, const CompressedGeometry *_geometry = nullptr, bool _lazy = false);
 	~Octree();
 
 	// Traverse
+	const OctreeNode *getRoot() const { return root; }		// lazy octrees only, else nullptr
+	/* Builds what a lazy octree has not built yet and packs it for the walks
+	 * below; rays still traverse its node tree. Not while another thread
+	 * walks the packed nodes. */
+	void divide();
 	void showAll(OctreeNode *ptr = nullptr) const;
 	bool getNearestIntersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const;
-};
\ No newline at end of file
+
+	/* Walks over the packed nodes, packed[0] being the root: those of an
+	 * eager octree, or of a lazy one once divided */
+	const Vec3d &getLowest() const { return root_low; }		// bounding box of every face
+	const Vec3d &getHighest() const { return root_high; }
+	unsigned getChildren(unsigned k) const { return packed[k].children; }	// the first of 8, 0 for a leaf
+	unsigned getFaceCount(unsigned k) const { return packed[k].n_faces; }
+	unsigned getFaceId(unsigned k, unsigned i) const { return packed_ids[packed[k].first_face + i]; }	// in the given order
+	const Face *getFace(unsigned k, unsigned i) const { return faces[getFaceId(k, i)]; }	// not over compressed geometry
+	/* Box of child i of node k, whose box is low-high, as decoded for the
+	 * traversal: rounded outwards. An empty child has neither faces nor children. */
+	void getChildBox(unsigned k, int i, const Vec3d &low, const Vec3d &high, Vec3d &ret_low, Vec3d &ret_high) const;
+
+	/* Memory of the node tree, none once freed, and of the packed nodes
+	 * (records, face indices, the face list). getNodeBytes() must not run
+	 * while rays are traced through a lazy octree. */
+	size_t getNodeBytes() const;
+	size_t getPackedBytes() const;
+
+	/* Nearest face hit by the ray with its ray parameter and the packed
+	 * node storing it, (unsigned)-1 if the ray traversed a lazy octree's node
+	 * tree. Traverses the packed nodes, with the same result as the node
+	 * tree, or the node tree itself if lazy.
+	 * return value: the face, nullptr if the ray hits nothing; over
+	 *               compressed geometry it is built in buffer */
+	const Face *getNearestFace(const Ray &ray, double &ret_r, Face &buffer, unsigned *ret_node = nullptr) const;
+};
+
+/* Ray-triangle intersection used by the octree leaves.
+ * return value: ray parameter of the hit point, -1 if the ray misses the face */
+double intersect_face(const Ray &ray, const Face &face);
+
+/* intersect_face() of the triangle v0 v1 v2 with unit normal n */
+double intersect_triangle(const Ray &ray, const Vec3d &v0, const Vec3d &v1, const Vec3d &v2, const Vec3d &n);
\ No newline at end of file
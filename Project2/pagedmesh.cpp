@@ -0,0 +1,457 @@
+#include "pagedmesh.h"
+#include "octree.h"
+#include "stats.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+constexpr unsigned long long PAGED_ALIGNMENT = 4096;	// blocks start on page boundaries
+static const char PAGED_MAGIC[8] = { 'P', 'A', 'G', 'E', 'D', 'M', 'S', '2' };	// bumped whenever the layout changes
+
+/* Start of the file */
+struct PagedHeader {
+	char magic[8];
+	unsigned long long key;
+	unsigned long long n_triangles;
+	unsigned n_blocks;
+	unsigned pad;
+};
+
+static unsigned long long align(unsigned long long offset) {
+	return (offset + PAGED_ALIGNMENT - 1) / PAGED_ALIGNMENT * PAGED_ALIGNMENT;
+}
+
+static void fnv(unsigned long long &hash, const void *data, size_t size) {
+	for (size_t i = 0; i < size; i++) {
+		hash ^= ((const unsigned char *)data)[i];
+		hash *= 1099511628211ull;
+	}
+}
+
+/* Ray parameter where the ray enters the box, false if it misses it or
+ * enters past max_r */
+static bool box_entry(const float *low, const float *high, const Vec3d &o, const Vec3d &inv, double max_r,
+	double &ret_r) {
+	double r_near = 0, r_far = max_r;
+	for (int a = 0; a < 3; a++) {
+		double r1 = (low[a] - o[a]) * inv[a], r2 = (high[a] - o[a]) * inv[a];
+		if (r1 > r2)
+			swap(r1, r2);
+		r_near = r1 > r_near ? r1 : r_near;
+		r_far = r2 < r_far ? r2 : r_far;
+		if (r_near > r_far)
+			return false;
+	}
+	ret_r = r_near;
+	return true;
+}
+
+static Vec3d inverse(const Vec3d &d) {
+	return Vec3d(1 / d[X], 1 / d[Y], 1 / d[Z]);
+}
+
+bool PagedMesh::write(Mesh &mesh, const char *path, unsigned long long key) {
+	if (mesh.is_analytic())
+		return false;
+	ofstream file(path, ios::out | ios::binary);
+	if (!file.is_open())
+		return false;
+
+	const Face *faces = mesh.get_const_faces();
+	unsigned n_faces = mesh.get_size();
+	PagedHeader header = {};
+	memcpy(header.magic, PAGED_MAGIC, sizeof PAGED_MAGIC);
+	header.key = key;
+	header.n_triangles = n_faces;
+	header.n_blocks = (n_faces + PAGED_BLOCK_TRIANGLES - 1) / PAGED_BLOCK_TRIANGLES;
+
+	// the blocks' data: group bounds, then the corners
+	vector<Block> table(header.n_blocks);
+	vector<vector<float> > data(header.n_blocks);
+	unsigned long long offset = align(sizeof header + header.n_blocks * sizeof(Block));
+	for (unsigned b = 0; b < header.n_blocks; b++) {
+		unsigned first = b * PAGED_BLOCK_TRIANGLES;
+		unsigned n = min(PAGED_BLOCK_TRIANGLES, n_faces - first);
+		unsigned n_groups = (n + PAGED_GROUP_TRIANGLES - 1) / PAGED_GROUP_TRIANGLES;
+		Block &block = table[b];
+		for (int a = 0; a < 3; a++) {
+			block.low[a] = INFINITY;
+			block.high[a] = -INFINITY;
+		}
+		vector<float> &d = data[b];
+		d.assign(6 * n_groups, 0.f);
+		for (unsigned g = 0; g < n_groups; g++) {
+			float bounds[6];
+			for (int a = 0; a < 3; a++) {
+				bounds[a] = INFINITY;
+				bounds[3 + a] = -INFINITY;
+			}
+			for (unsigned t = g * PAGED_GROUP_TRIANGLES; t < min(n, (g + 1) * PAGED_GROUP_TRIANGLES); t++) {
+				for (int j = 0; j < 3; j++) {
+					const Vec3d &v = *faces[first + t].vertices[j];
+					for (int a = 0; a < 3; a++) {
+						// the float corners, and bounds holding them
+						float c = (float)v[a];
+						d.push_back(c);
+						bounds[a] = fmin(bounds[a], c);
+						bounds[3 + a] = fmax(bounds[3 + a], c);
+					}
+				}
+			}
+			copy(bounds, bounds + 6, d.begin() + 6 * g);
+			for (int a = 0; a < 3; a++) {
+				block.low[a] = fmin(block.low[a], bounds[a]);
+				block.high[a] = fmax(block.high[a], bounds[3 + a]);
+			}
+		}
+		block.offset = offset;
+		block.n_triangles = n;
+		block.bytes = d.size() * sizeof(float);
+		offset = align(offset + block.bytes);
+	}
+
+	file.write((const char *)&header, sizeof header);
+	file.write((const char *)table.data(), table.size() * sizeof(Block));
+	for (unsigned b = 0; b < header.n_blocks; b++) {
+		file.seekp(table[b].offset);
+		file.write((const char *)data[b].data(), table[b].bytes);
+	}
+	// pad the last block to a whole page
+	if (offset > 0) {
+		file.seekp(offset - 1);
+		file.put(0);
+	}
+	return (bool)file;
+}
+
+unsigned long long PagedMesh::key(const char *filename, const Mat4d &model, double dim) {
+	unsigned long long hash = 14695981039346656037ull;
+	ifstream file(filename, ios::in | ios::binary | ios::ate);
+	long long size = file.is_open() ? (long long)file.tellg() : -1;
+	fnv(hash, &size, sizeof size);
+	for (int i = 0; i < 4; i++) {
+		for (int j = 0; j < 4; j++) {
+			double e = model.get_ij(i, j);
+			fnv(hash, &e, sizeof e);
+		}
+	}
+	fnv(hash, &dim, sizeof dim);
+	return hash;
+}
+
+PagedMesh::PagedMesh(const char *path, const Material &mat, size_t _budget, unsigned long long _key)
+	: material(mat), fd(-1), mapping(nullptr), mapping_handle(nullptr), mapping_size(0), n_triangles(0), leaves(1),
+	budget(_budget), resident_bytes(0), hand(0), faults(0), evictions(0) {
+	// map the whole file; blocks are paged in by the rays
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	mapping_size = (size_t)size.QuadPart;
+	mapping_handle = mapping_size >= sizeof(PagedHeader) ? CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr) : nullptr;
+	CloseHandle(file);
+	if (mapping_handle == nullptr)
+		return;
+	mapping = MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0);
+#else
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PagedHeader))
+		return;
+	mapping_size = st.st_size;
+	mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED)
+		mapping = nullptr;
+#endif
+	if (mapping == nullptr)
+		return;
+
+	// the header and the block bounds stay in memory
+	const PagedHeader &header = *(const PagedHeader *)mapping;
+	bool valid = memcmp(header.magic, PAGED_MAGIC, sizeof PAGED_MAGIC) == 0 && (_key == 0 || header.key == _key) &&
+		sizeof header + header.n_blocks * sizeof(Block) <= mapping_size;
+	if (valid) {
+		const Block *table = (const Block *)((const char *)mapping + sizeof header);
+		blocks.assign(table, table + header.n_blocks);
+		for (size_t b = 0; b < blocks.size(); b++)
+			valid &= blocks[b].offset + blocks[b].bytes <= mapping_size;
+	}
+	if (!valid) {
+		blocks.clear();
+#ifdef _WIN32
+		UnmapViewOfFile(mapping);
+#else
+		munmap(mapping, mapping_size);
+#endif
+		mapping = nullptr;
+		return;
+	}
+	n_triangles = header.n_triangles;
+
+	// boxes over the blocks: leaves + b is block b's, k the union of 2k and 2k + 1
+	while (leaves < (int)blocks.size())
+		leaves *= 2;
+	tree.assign(12 * leaves, 0.f);
+	for (int k = 0; k < 2 * leaves; k++) {
+		for (int a = 0; a < 3; a++) {
+			tree[6 * k + a] = INFINITY;
+			tree[6 * k + 3 + a] = -INFINITY;
+		}
+	}
+	for (size_t b = 0; b < blocks.size(); b++) {
+		for (int a = 0; a < 3; a++) {
+			tree[6 * (leaves + b) + a] = blocks[b].low[a];
+			tree[6 * (leaves + b) + 3 + a] = blocks[b].high[a];
+		}
+	}
+	for (int k = leaves - 1; k >= 1; k--) {
+		for (int a = 0; a < 3; a++) {
+			tree[6 * k + a] = fmin(tree[12 * k + a], tree[12 * k + 6 + a]);
+			tree[6 * k + 3 + a] = fmax(tree[12 * k + 3 + a], tree[12 * k + 9 + a]);
+		}
+	}
+
+	resident.reset(new atomic<unsigned char>[blocks.size()]);
+	referenced.reset(new atomic<unsigned char>[blocks.size()]);
+	pins.reset(new atomic<unsigned>[blocks.size()]);
+	for (size_t b = 0; b < blocks.size(); b++) {
+		resident[b] = 0;
+		referenced[b] = 0;
+		pins[b] = 0;
+	}
+}
+
+PagedMesh::~PagedMesh() {
+#ifdef _WIN32
+	if (mapping != nullptr)
+		UnmapViewOfFile(mapping);
+	if (mapping_handle != nullptr)
+		CloseHandle(mapping_handle);
+#else
+	if (mapping != nullptr)
+		munmap(mapping, mapping_size);
+	if (fd >= 0)
+		close(fd);
+#endif
+}
+
+const float *PagedMesh::block_data(unsigned b) const {
+	return (const float *)((const char *)mapping + blocks[b].offset);
+}
+
+void PagedMesh::pin(unsigned b) const {
+	// pinned before the residency check, which eviction clears before the pin check
+	pins[b].fetch_add(1);
+	if (!resident[b].load())
+		fault(b);
+	referenced[b].store(1, memory_order_relaxed);
+}
+
+void PagedMesh::unpin(unsigned b) const {
+	pins[b].fetch_sub(1, memory_order_release);
+}
+
+void PagedMesh::fault(unsigned b) const {
+	lock_guard<mutex> lock(paging);
+	if (resident[b])
+		return;
+	faults++;
+	const char *data = (const char *)block_data(b);
+	size_t bytes = align(blocks[b].bytes);
+#ifndef _WIN32
+	madvise((void *)data, bytes, MADV_WILLNEED);
+#endif
+
+	// CLOCK: evict the first resident block not used since the hand passed it
+	size_t passed = 0;
+	while (resident_bytes + bytes > budget && resident_bytes > 0 && passed < 2 * blocks.size()) {
+		size_t h = hand;
+		hand = (hand + 1) % blocks.size();
+		passed++;
+		if (!resident[h])
+			continue;
+		if (referenced[h]) {
+			referenced[h] = 0;
+			continue;
+		}
+		// a ray pinning the block after this sees it gone and waits to page it in again
+		resident[h].store(0);
+		if (pins[h].load() > 0) {
+			resident[h].store(1);
+			continue;
+		}
+		void *start = (void *)block_data(h);
+		size_t size = align(blocks[h].bytes);
+#ifdef _WIN32
+		VirtualUnlock(start, size);		// out of the working set
+#else
+		madvise(start, size, MADV_DONTNEED);	// dropped, read again from the file on use
+#endif
+		resident_bytes -= size;
+		evictions++;
+	}
+	resident_bytes += bytes;
+	resident[b].store(1, memory_order_release);
+}
+
+size_t PagedMesh::getResidentBytes() const {
+	lock_guard<mutex> lock(paging);
+	return resident_bytes;
+}
+
+/* Calls visit(block, max_r) for the blocks the ray enters before max_r,
+ * nearest box first; visit may lower max_r */
+template <typename F>
+void PagedMesh::traverse(const Ray &ray, double &max_r, F visit) const {
+	if (blocks.empty())
+		return;
+	Vec3d o = ray.getOrigin(), inv = inverse(ray.getDirection());
+	int stack[64];
+	int top = 0;
+	stack[top++] = 1;
+	while (top > 0) {
+		int k = stack[--top];
+		double r;
+		if (!box_entry(&tree[6 * k], &tree[6 * k + 3], o, inv, max_r, r))
+			continue;
+		if (k >= leaves) {
+			if (k - leaves < (int)blocks.size())		// not a padding leaf, whose empty box inverts
+				visit(k - leaves, max_r);
+			continue;
+		}
+		// the nearer child on top
+		double r_left, r_right;
+		bool left = box_entry(&tree[12 * k], &tree[12 * k + 3], o, inv, max_r, r_left);
+		bool right = box_entry(&tree[12 * k + 6], &tree[12 * k + 9], o, inv, max_r, r_right);
+		if (left && right) {
+			stack[top++] = r_left < r_right ? 2 * k + 1 : 2 * k;
+			stack[top++] = r_left < r_right ? 2 * k : 2 * k + 1;
+		}
+		else if (left || right)
+			stack[top++] = left ? 2 * k : 2 * k + 1;
+	}
+}
+
+double PagedMesh::intersect_block(const Ray &ray, unsigned b, double max_r, unsigned &ret_triangle, bool any) const {
+	pin(b);
+	const Block &block = blocks[b];
+	const float *data = block_data(b);
+	unsigned n_groups = (block.n_triangles + PAGED_GROUP_TRIANGLES - 1) / PAGED_GROUP_TRIANGLES;
+	const float *corners = data + 6 * n_groups;
+	Vec3d o = ray.getOrigin(), inv = inverse(ray.getDirection());
+	RenderStats &stats = RenderStats::local();
+	for (unsigned g = 0; g < n_groups; g++) {
+		double r;
+		if (!box_entry(data + 6 * g, data + 6 * g + 3, o, inv, max_r, r))
+			continue;
+		unsigned end = min(block.n_triangles, (g + 1) * PAGED_GROUP_TRIANGLES);
+		stats.triangle_tests += end - g * PAGED_GROUP_TRIANGLES;
+		for (unsigned t = g * PAGED_GROUP_TRIANGLES; t < end; t++) {
+			const float *c = corners + 9 * t;
+			Vec3d v0(c[0], c[1], c[2]), v1(c[3], c[4], c[5]), v2(c[6], c[7], c[8]);
+			Vec3d n = (v1 - v0).cross(v2 - v0);
+			n.normalize();
+			r = intersect_triangle(ray, v0, v1, v2, n);
+			if (r != -1 && r < max_r) {
+				max_r = r;
+				ret_triangle = t;
+				if (any) {
+					unpin(b);
+					return r;
+				}
+			}
+		}
+	}
+	unpin(b);
+	return max_r;
+}
+
+Face PagedMesh::face_of(unsigned b, unsigned triangle) const {
+	pin(b);
+	const Block &block = blocks[b];
+	unsigned n_groups = (block.n_triangles + PAGED_GROUP_TRIANGLES - 1) / PAGED_GROUP_TRIANGLES;
+	const float *c = block_data(b) + 6 * n_groups + 9 * triangle;
+	Vec3d v0(c[0], c[1], c[2]), v1(c[3], c[4], c[5]), v2(c[6], c[7], c[8]);
+	Face face;
+	face.vertices[0] = face.vertices[1] = face.vertices[2] = nullptr;
+	unpin(b);
+	face.normal = (v1 - v0).cross(v2 - v0);
+	face.normal.normalize();
+	face.material = const_cast<Material *>(&material);	// read only, as every face's
+	return face;
+}
+
+bool PagedMesh::intersect(const Ray &ray, double max_r, double &ret_r, Face &ret_face) const {
+	unsigned hit_block = 0, hit_triangle = 0;
+	bool hit = false;
+	traverse(ray, max_r, [&](unsigned b, double &r) {
+		unsigned t;
+		double block_r = intersect_block(ray, b, r, t, false);
+		if (block_r < r) {
+			r = block_r;
+			hit_block = b;
+			hit_triangle = t;
+			hit = true;
+		}
+	});
+	if (!hit)
+		return false;
+	ret_r = max_r;
+	ret_face = face_of(hit_block, hit_triangle);
+	return true;
+}
+
+bool PagedMesh::occluded(const Ray &ray, double dist) const {
+	bool hit = false;
+	traverse(ray, dist, [&](unsigned b, double &r) {
+		unsigned t;
+		if (!hit && intersect_block(ray, b, r, t, true) < r) {
+			hit = true;
+			r = -1;		// ends the traversal
+		}
+	});
+	return hit;
+}
+
+void PagedMesh::intersect(const vector<Ray> &rays, vector<double> &ret_r, vector<Face> &ret_faces) const {
+	// the blocks every ray reaches, grouped by block
+	vector<pair<unsigned, unsigned> > pairs;
+	for (size_t i = 0; i < rays.size(); i++) {
+		double max_r = INFTY;
+		traverse(rays[i], max_r, [&](unsigned b, double &) { pairs.push_back(make_pair(b, (unsigned)i)); });
+	}
+	sort(pairs.begin(), pairs.end());
+
+	ret_r.assign(rays.size(), INFTY);
+	vector<pair<unsigned, unsigned> > hits(rays.size(), make_pair(0u, 0u));
+	for (size_t p = 0; p < pairs.size(); p++) {
+		unsigned b = pairs[p].first, i = pairs[p].second, t;
+		double r = intersect_block(rays[i], b, ret_r[i], t, false);
+		if (r < ret_r[i]) {
+			ret_r[i] = r;
+			hits[i] = make_pair(b, t);
+		}
+	}
+
+	ret_faces.assign(rays.size(), Face());
+	for (size_t i = 0; i < rays.size(); i++) {
+		if (ret_r[i] < INFTY)
+			ret_faces[i] = face_of(hits[i].first, hits[i].second);
+	}
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "vec.h"
+#include "ray.h"
+#include "mesh.h"
+#include "material.h"
+#include "definitions.h"
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+constexpr unsigned PAGED_BLOCK_TRIANGLES = 256;	// faces per block
+constexpr unsigned PAGED_GROUP_TRIANGLES = 16;	// faces per bounded group within a block
+
+/* PagedMesh renders a triangle mesh out of core. The mesh is preprocessed
+ * once into a file of blocks (write()): runs of PAGED_BLOCK_TRIANGLES faces
+ * in the mesh's Morton order, each page aligned and holding the bounds of
+ * its groups of PAGED_GROUP_TRIANGLES faces, then the faces' corners as
+ * floats. The file is memory mapped; only the header, the block bounds and
+ * a tree of boxes over the blocks stay in memory, and a block is paged in
+ * by the first ray that reaches it.
+ * The resident blocks are kept within a budget of bytes: a block paged in
+ * past the budget evicts others by the CLOCK policy (blocks used since the
+ * hand last passed get a second chance), and an evicted block is paged in
+ * again from the file when needed. A block is pinned while a ray reads it
+ * and never evicted then, so the budget may be exceeded by the blocks rays
+ * are inside of, at most one per thread. Lookups of resident blocks take
+ * no lock. Eviction drops the pages from the process (madvise DONTNEED); on
+ * Windows it only trims them from the working set, which the system may
+ * keep, so the budget is advisory there.
+ * Rays are traced one at a time (intersect(), occluded()), or in batches
+ * grouped by the blocks they reach, every block paged in once per batch.
+ * Hit faces stand for triangles of the file: they have a normal and the
+ * mesh's material, but no vertices. */
+class PagedMesh {
+public:
+	/* Block header in the file, and the block bounds kept in memory */
+	struct Block {
+		float low[3], high[3];
+		unsigned long long offset;		// of the block's data in the file
+		unsigned n_triangles;
+		unsigned bytes;					// of the block's data
+	};
+
+private:
+	Material material;
+	int fd;						// the mapped file, -1 if none
+	void *mapping;
+	void *mapping_handle;		// Windows: the file mapping object
+	size_t mapping_size;
+	vector<Block> blocks;
+	unsigned long long n_triangles;
+	int leaves;						// power of 2 >= number of blocks
+	vector<float> tree;			// box over the blocks per node of an implicit binary tree, 6 floats each
+
+	size_t budget;				// bytes of blocks kept resident
+	mutable mutex paging;		// paging blocks in and evicting them
+	mutable unique_ptr<atomic<unsigned char>[]> resident;
+	mutable unique_ptr<atomic<unsigned char>[]> referenced;	// used since the clock hand passed
+	mutable unique_ptr<atomic<unsigned>[]> pins;			// rays reading the block, not evicted then
+	mutable size_t resident_bytes;
+	mutable size_t hand;
+	mutable atomic<unsigned long long> faults, evictions;
+
+	const float *block_data(unsigned b) const;
+	void pin(unsigned b) const;			// pages the block in if needed, and keeps it until unpin()
+	void unpin(unsigned b) const;
+	void fault(unsigned b) const;
+	template <typename F> void traverse(const Ray &ray, double &max_r, F visit) const;
+	double intersect_block(const Ray &ray, unsigned b, double max_r, unsigned &ret_triangle, bool any) const;
+	Face face_of(unsigned b, unsigned triangle) const;
+
+public:
+	/* Preprocesses the faces of a loaded mesh, in their order, into a file
+	 * tagged with key. return value: false if the file can't be written */
+	static bool write(Mesh &mesh, const char *path, unsigned long long key);
+
+	/* Key of a mesh file loaded with a model matrix and size (see Mesh),
+	 * from the file's size rather than its contents to stay cheap */
+	static unsigned long long key(const char *filename, const Mat4d &model, double dim);
+
+	/* Maps a preprocessed file. isOpen() is false if it is missing or its
+	 * key differs (if key is not 0). budget: bytes of blocks kept resident */
+	PagedMesh(const char *path, const Material &mat, size_t budget, unsigned long long key = 0);
+	~PagedMesh();
+	PagedMesh(const PagedMesh &) = delete;
+	PagedMesh &operator= (const PagedMesh &) = delete;
+
+	/* Nearest hit closer than max_r: the ray parameter and the face, false if none */
+	bool intersect(const Ray &ray, double max_r, double &ret_r, Face &ret_face) const;
+	bool occluded(const Ray &ray, double dist) const;		// any hit closer than dist?
+
+	/* Nearest hits of a batch of rays, INFTY where they miss. The pairs of
+	 * ray and block to test are sorted by block, so every block is paged in
+	 * once for all the rays reaching it. */
+	void intersect(const vector<Ray> &rays, vector<double> &ret_r, vector<Face> &ret_faces) const;
+
+	// Getters
+	bool isOpen() const { return mapping != nullptr; }
+	const Material *get_material() const { return &material; }
+	int getBlocks() const { return blocks.size(); }
+	unsigned long long getTriangles() const { return n_triangles; }
+	size_t getResidentBytes() const;
+	unsigned long long getFaults() const { return faults; }
+	unsigned long long getEvictions() const { return evictions; }
+
+	// Setters
+	void set_material(const Material &mat) { material = mat; }
+};
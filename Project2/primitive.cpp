@@ -0,0 +1,117 @@
+#include "primitive.h"
+
+#include <cmath>
+
+void Primitive::set(Kind _kind, const Vec3d &_center, const Vec3d &u, const Vec3d &v, const Vec3d &w) {
+	kind = _kind;
+	center = _center;
+	axes[0] = u;
+	axes[1] = v;
+	axes[2] = kind == QUAD ? u.cross(v) : w;
+	if (kind == QUAD)
+		axes[2].normalize();
+
+	// inverse of the matrix whose columns are the axes
+	double det = axes[0].dot(axes[1].cross(axes[2]));
+	rows[0] = axes[1].cross(axes[2]) / det;
+	rows[1] = axes[2].cross(axes[0]) / det;
+	rows[2] = axes[0].cross(axes[1]) / det;
+}
+
+double Primitive::intersect(const Ray &ray) const {
+	// the ray in the shape's frame, with the same parameter
+	Vec3d d = ray.getDirection(), p = ray.getOrigin() - center;
+	Vec3d o(rows[0].dot(p), rows[1].dot(p), rows[2].dot(p));
+	Vec3d dir(rows[0].dot(d), rows[1].dot(d), rows[2].dot(d));
+
+	switch (kind) {
+	case SPHERE: {
+		double a = dir.dot(dir), b = o.dot(dir), c = o.dot(o) - 1;
+		double disc = b * b - a * c;
+		if (disc < 0)
+			return -1;
+		double root = sqrt(disc);
+		double r = (-b - root) / a;
+		if (r < FLT_EPSILON)
+			r = (-b + root) / a;
+		return r < FLT_EPSILON ? -1 : r;
+	}
+	case QUAD: {
+		if (fabs(dir[Z]) < FLT_EPSILON)
+			return -1;
+		double r = -o[Z] / dir[Z];
+		if (r < FLT_EPSILON)
+			return -1;
+		double x = o[X] + r * dir[X], y = o[Y] + r * dir[Y];
+		return fabs(x) > 1 + FLT_EPSILON || fabs(y) > 1 + FLT_EPSILON ? -1 : r;
+	}
+	case BOX: {
+		double r_near = -INFINITY, r_far = INFINITY;
+		for (int a = 0; a < 3; a++) {
+			if (dir[a] == 0) {
+				if (fabs(o[a]) > 1)
+					return -1;
+				continue;
+			}
+			double r1 = (-1 - o[a]) / dir[a], r2 = (1 - o[a]) / dir[a];
+			r_near = fmax(r_near, fmin(r1, r2));
+			r_far = fmin(r_far, fmax(r1, r2));
+		}
+		if (r_near > r_far)
+			return -1;
+		if (r_near >= FLT_EPSILON)
+			return r_near;
+		return r_far >= FLT_EPSILON ? r_far : -1;
+	}
+	}
+	return -1;
+}
+
+Vec3d Primitive::normal(const Vec3d &pos) const {
+	Vec3d p = pos - center;
+	Vec3d q(rows[0].dot(p), rows[1].dot(p), rows[2].dot(p));
+	Vec3d n;
+	switch (kind) {
+	case SPHERE:
+		// the gradient of |q|^2
+		n = q[X] * rows[0] + q[Y] * rows[1] + q[Z] * rows[2];
+		break;
+	case QUAD:
+		return axes[2];
+	case BOX: {
+		// the slab the point is on
+		int a = fabs(q[X]) > fabs(q[Y]) ? (fabs(q[X]) > fabs(q[Z]) ? X : Z) : (fabs(q[Y]) > fabs(q[Z]) ? Y : Z);
+		n = q[a] < 0 ? -rows[a] : rows[a];
+		break;
+	}
+	}
+	n.normalize();
+	return n;
+}
+
+void Primitive::bounds(Vec3d &low, Vec3d &high) const {
+	for (int i = 0; i < 3; i++) {
+		double half;
+		if (kind == SPHERE)
+			half = sqrt(axes[0][i] * axes[0][i] + axes[1][i] * axes[1][i] + axes[2][i] * axes[2][i]);
+		else if (kind == QUAD)
+			half = fabs(axes[0][i]) + fabs(axes[1][i]);
+		else
+			half = fabs(axes[0][i]) + fabs(axes[1][i]) + fabs(axes[2][i]);
+		// past the FLT_EPSILON that intersect() lets quad hits stray over the edges
+		half *= 1 + 2 * FLT_EPSILON;
+		low[i] = center[i] - half;
+		high[i] = center[i] + half;
+	}
+}
+
+void face_bounds(const Face &face, Vec3d &low, Vec3d &high) {
+	if (face.primitive != nullptr) {
+		face.primitive->bounds(low, high);
+		return;
+	}
+	for (int a = 0; a < 3; a++) {
+		low[a] = fmin((*face.vertices[0])[a], fmin((*face.vertices[1])[a], (*face.vertices[2])[a]));
+		high[a] = fmax((*face.vertices[0])[a], fmax((*face.vertices[1])[a], (*face.vertices[2])[a]));
+	}
+}
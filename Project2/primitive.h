@@ -0,0 +1,39 @@
+#pragma once
+
+#include "vec.h"
+#include "ray.h"
+#include "definitions.h"
+
+/* Primitive is an analytic shape standing in for the triangles of a mesh:
+ * a sphere, a quad or a box, spanned by a centre and three half axes. In the
+ * frame of the half axes it is the unit sphere, the square [-1,1]^2 at z = 0
+ * or the cube [-1,1]^3, so scaled shapes become ellipsoids, parallelograms
+ * and parallelepipeds. Rays are intersected in that frame, in closed form.
+ * A mesh made of a primitive has a single face pointing to it (see Face); the
+ * face's vertices are the centre and the ends of the first two half axes. */
+struct Primitive {
+	enum Kind {
+		SPHERE,
+		QUAD,
+		BOX
+	};
+
+	Kind kind;
+	Vec3d center;
+	Vec3d axes[3];		// half axes; a quad's third is its unit normal, u x v
+	Vec3d rows[3];		// rows of the inverse of [axes]: world to the shape's frame
+
+	/* Sets the shape; w is ignored by quads */
+	void set(Kind kind, const Vec3d &center, const Vec3d &u, const Vec3d &v, const Vec3d &w);
+
+	/* return value: ray parameter of the nearest hit in front of the ray, -1 if it misses */
+	double intersect(const Ray &ray) const;
+
+	/* Unit normal at a point on the surface: outward, or u x v on quads */
+	Vec3d normal(const Vec3d &pos) const;
+
+	void bounds(Vec3d &low, Vec3d &high) const;		// axis-aligned bounding box of every hit of intersect()
+};
+
+/* Bounding box of a face, triangle or primitive */
+void face_bounds(const Face &face, Vec3d &low, Vec3d &high);
@@ -0,0 +1,174 @@
+#include "raster.h"
+#include "octree.h"
+#include "primitive.h"
+
+#include <cmath>
+#include <cfloat>
+
+constexpr int RASTER_TILE = 32;		// tile size of the binning, in pixels
+
+/* Pixel rectangle a face may cover, rows i0..i1 and columns j0..j1 */
+struct Rect {
+	int i0, i1, j0, j1;
+};
+
+VisibilityBuffer::VisibilityBuffer(Mesh *meshes, int n_meshes, const Camera &camera,
+	const function<Ray(int, int)> &primary_ray, WorkerPool &pool)
+	: height(camera.height), width(camera.height * camera.aspect_ratio),
+	z_near(camera.zNear), z_far(camera.zFar), tests(0) {
+	hits.assign(height * width, PrimaryHit{ nullptr, INFTY });
+
+	// Camera frame and image plane, as the primary rays are made
+	forward = camera.position - camera.center;
+	forward.normalize();
+	Vec3d left = camera.up.cross(forward);
+	left.normalize();
+	Vec3d up = forward.cross(left);
+	up.normalize();
+	double h_max = camera.zNear * tan(camera.fovy / 2);
+	double w_max = h_max * camera.aspect_ratio;
+
+	// Project every face to its pixel rectangle
+	vector<const Face *> faces;
+	vector<Rect> rects;
+	for (int m = 0; m < n_meshes; m++) {
+		const Face *mesh_faces = meshes[m].get_const_faces();
+		for (int f = 0; f < meshes[m].get_size(); f++) {
+			const Face &face = mesh_faces[f];
+			// a triangle's vertices, or the corners of a primitive's bounding box
+			Vec3d points[8];
+			int n_points = 3;
+			for (int k = 0; k < 3; k++)
+				points[k] = *face.vertices[k];
+			if (face.primitive != nullptr) {
+				Vec3d low, high;
+				face_bounds(face, low, high);
+				for (int c = 0; c < 8; c++)
+					points[c] = Vec3d(c & 1 ? high[X] : low[X], c & 2 ? high[Y] : low[Y], c & 4 ? high[Z] : low[Z]);
+				n_points = 8;
+			}
+			// depths along the view direction; cull what lies outside the clip planes
+			double s[8];
+			bool past_near = false, before_far = false;
+			for (int k = 0; k < n_points; k++) {
+				s[k] = -(points[k] - camera.position).dot(forward);
+				past_near |= s[k] >= camera.zNear;
+				before_far |= s[k] <= camera.zFar;
+			}
+			if (!past_near || !before_far)
+				continue;
+			// The points in front of the near plane, and where the segments between
+			// them and the points behind cross it: the hull of the points clipped
+			// at the near plane, which projects to a bounded rectangle
+			Vec3d clipped[8 + 16];
+			int n_clipped = 0;
+			for (int k = 0; k < n_points; k++) {
+				if (s[k] < camera.zNear)
+					continue;
+				clipped[n_clipped++] = points[k];
+				for (int l = 0; l < n_points; l++) {
+					if (s[l] < camera.zNear)
+						clipped[n_clipped++] = points[k] + (s[k] - camera.zNear) / (s[k] - s[l]) * (points[l] - points[k]);
+				}
+			}
+			double i_lo = INFTY, i_hi = -INFTY, j_lo = INFTY, j_hi = -INFTY;
+			for (int k = 0; k < n_clipped; k++) {
+				Vec3d d = clipped[k] - camera.position;
+				double depth = fmax(-d.dot(forward), camera.zNear);
+				double i = (d.dot(up) / depth / h_max + 1) * camera.height / 2;
+				double j = (d.dot(left) / depth / w_max + 1) * camera.height * camera.aspect_ratio / 2;
+				i_lo = fmin(i_lo, i);	i_hi = fmax(i_hi, i);
+				j_lo = fmin(j_lo, j);	j_hi = fmax(j_hi, j);
+			}
+			// one pixel of slack for rounding
+			if (i_hi < -1 || i_lo > height || j_hi < -1 || j_lo > width)
+				continue;
+			Rect rect;
+			rect.i0 = (int)fmax(0., ceil(i_lo) - 1);
+			rect.i1 = (int)fmin(height - 1., floor(i_hi) + 1);
+			rect.j0 = (int)fmax(0., ceil(j_lo) - 1);
+			rect.j1 = (int)fmin(width - 1., floor(j_hi) + 1);
+			faces.push_back(&face);
+			rects.push_back(rect);
+		}
+	}
+
+	// Bin the faces into tiles
+	int tile_rows = (height + RASTER_TILE - 1) / RASTER_TILE;
+	int tile_cols = (width + RASTER_TILE - 1) / RASTER_TILE;
+	vector<vector<int> > bins(tile_rows * tile_cols);
+	for (size_t f = 0; f < faces.size(); f++) {
+		const Rect &rect = rects[f];
+		for (int ti = rect.i0 / RASTER_TILE; ti <= rect.i1 / RASTER_TILE; ti++) {
+			for (int tj = rect.j0 / RASTER_TILE; tj <= rect.j1 / RASTER_TILE; tj++)
+				bins[ti * tile_cols + tj].push_back(f);
+		}
+	}
+
+	// Fill the tiles: the nearest face of every pixel's primary ray
+	vector<unsigned long long> tile_tests(bins.size(), 0);
+	pool.run(bins.size(), [&](int t) {
+		int i0 = t / tile_cols * RASTER_TILE, j0 = t % tile_cols * RASTER_TILE;
+		int i1 = i0 + RASTER_TILE < height ? i0 + RASTER_TILE : height;
+		int j1 = j0 + RASTER_TILE < width ? j0 + RASTER_TILE : width;
+		vector<Ray> rays;
+		for (int i = i0; i < i1; i++) {
+			for (int j = j0; j < j1; j++)
+				rays.push_back(primary_ray(i, j));
+		}
+		for (size_t b = 0; b < bins[t].size(); b++) {
+			int f = bins[t][b];
+			const Rect &rect = rects[f];
+			for (int i = rect.i0 > i0 ? rect.i0 : i0; i <= rect.i1 && i < i1; i++) {
+				for (int j = rect.j0 > j0 ? rect.j0 : j0; j <= rect.j1 && j < j1; j++) {
+					const Ray &ray = rays[(i - i0) * (j1 - j0) + j - j0];
+					double r = intersect_face(ray, *faces[f]);
+					PrimaryHit &hit = hits[i * width + j];
+					if (r != -1 && r < hit.r && between_planes(ray, r)) {
+						hit.face = faces[f];
+						hit.r = r;
+					}
+				}
+			}
+			tile_tests[t] += (rect.i1 - rect.i0 + 1) * (rect.j1 - rect.j0 + 1);
+		}
+	});
+	for (size_t t = 0; t < tile_tests.size(); t++)
+		tests += tile_tests[t];
+}
+
+bool VisibilityBuffer::between_planes(const Ray &ray, double r) const {
+	double depth = -r * ray.getDirection().dot(forward);
+	return depth >= z_near && depth <= z_far;
+}
+
+void VisibilityBuffer::addPaged(const PagedMesh &mesh, const function<Ray(int, int)> &primary_ray, WorkerPool &pool) {
+	if (paged_faces.empty())
+		paged_faces.resize(height * width);		// never again: hits point into it
+	int tile_rows = (height + RASTER_TILE - 1) / RASTER_TILE;
+	int tile_cols = (width + RASTER_TILE - 1) / RASTER_TILE;
+	pool.run(tile_rows * tile_cols, [&](int t) {
+		int i0 = t / tile_cols * RASTER_TILE, j0 = t % tile_cols * RASTER_TILE;
+		int i1 = i0 + RASTER_TILE < height ? i0 + RASTER_TILE : height;
+		int j1 = j0 + RASTER_TILE < width ? j0 + RASTER_TILE : width;
+		vector<Ray> rays;
+		for (int i = i0; i < i1; i++) {
+			for (int j = j0; j < j1; j++)
+				rays.push_back(primary_ray(i, j));
+		}
+		vector<double> r;
+		vector<Face> faces;
+		mesh.intersect(rays, r, faces);
+		for (int i = i0; i < i1; i++) {
+			for (int j = j0; j < j1; j++) {
+				int k = (i - i0) * (j1 - j0) + j - j0;
+				PrimaryHit &hit = hits[i * width + j];
+				if (r[k] < hit.r && between_planes(rays[k], r[k])) {
+					paged_faces[i * width + j] = faces[k];
+					hit.face = &paged_faces[i * width + j];
+					hit.r = r[k];
+				}
+			}
+		}
+	});
+}
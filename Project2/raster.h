@@ -0,0 +1,62 @@
+#pragma once
+
+#include "vec.h"
+#include "mesh.h"
+#include "ray.h"
+#include "workerpool.h"
+#include "pagedmesh.h"
+#include "definitions.h"
+
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+/* Nearest hit of a primary ray between the camera's clip planes: the face and
+ * the ray parameter, nullptr if there is none there */
+struct PrimaryHit {
+	const Face *face;
+	double r;
+};
+
+/* VisibilityBuffer holds the primary visibility of a camera: the nearest face
+ * and its distance along the primary ray through every pixel, found by
+ * rasterizing every face instead of traversing the octree per pixel.
+ * The faces are projected with the camera's perspective and binned into
+ * screen tiles, and the workers fill the tiles in parallel. Within a face's
+ * bounding rectangle the coverage and depth of a pixel are the ray-triangle
+ * test of the pixel's own primary ray, so the buffer holds the same hits as
+ * the octree, up to faces tied at the same distance.
+ * Only the depths between camera.zNear and camera.zFar are rasterized, as
+ * OpenGL would clip them: faces wholly in front of the near plane (or behind
+ * the eye) or past the far plane are culled, and the rectangle of a face
+ * crossing the near plane is that of its part beyond it. A pixel with no hit
+ * in that range is left empty, and the tracer traverses the octree for it. */
+class VisibilityBuffer {
+private:
+	int height, width;
+	Vec3d forward;				// camera frame: the view direction is -forward
+	double z_near, z_far;		// clip planes, as depths along -forward
+	vector<PrimaryHit> hits;	// row-major
+	vector<Face> paged_faces;	// per pixel, the out-of-core face hit, if any
+	unsigned long long tests;	// ray-triangle tests done
+
+	/* Whether the hit at r along a primary ray lies between the clip planes */
+	bool between_planes(const Ray &ray, double r) const;
+
+public:
+	/* params: meshes, n_meshes - the faces to be rasterized
+	 *         camera           - projection, the image is camera.height rows high
+	 *         primary_ray      - the primary ray through pixel (row, column)
+	 *         pool             - the workers rasterizing the tiles */
+	VisibilityBuffer(Mesh *meshes, int n_meshes, const Camera &camera,
+		const function<Ray(int, int)> &primary_ray, WorkerPool &pool);
+
+	/* Adds the hits on an out-of-core mesh where they are nearer. Every
+	 * worker takes a tile's primary rays as one batch (PagedMesh::intersect()). */
+	void addPaged(const PagedMesh &mesh, const function<Ray(int, int)> &primary_ray, WorkerPool &pool);
+
+	// Getters
+	const PrimaryHit &at(int i, int j) const { return hits[i * width + j]; }
+	unsigned long long getTests() const { return tests; }
+};
@@ -47,11 +47,15 @@ void Ray::attenuate(const Vec3d& to_pos) {
 	double distance = this->getOrigin().distance(to_pos);
 
 	double temp = this->getIntensity();
-	temp /= 1.0 + 0.005 * pow(distance, 2) + 0.005 * distance;
+	temp *= falloff(distance);
 
 	this->setIntensity(temp);
 }
 
+double Ray::falloff(double distance) {
+	return 1.0 / (1.0 + 0.005 * pow(distance, 2) + 0.005 * distance);
+}
+
 Ray Ray::reflect(const Face& face, const Vec3d &intersection_pos) const {
 	Vec3d new_direction;
 	double temp;
@@ -40,6 +40,7 @@ public:
 
 	// Attenuation
 	void attenuate(const Vec3d& to_pos);
+	static double falloff(double distance);	// intensity factor after travelling distance
 
 	// Generating a refected ray
 	Ray reflect(const Face& face, const Vec3d &intersection_pos) const;
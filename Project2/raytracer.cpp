@@ -6,215 +6,1490 @@
 #include <cassert>
 
 #include <thread>
+#include <mutex>
+#include <functional>
+#include <random>
+#include <atomic>
+#include <algorithm>
 
-static const Ray find_primary_ray(int h, int w, const Camera &camera);
-static bool intersect_face(const Ray &ray, const Face &face, Vec3d &ret_vec);
+static const Ray find_primary_ray(double h, double w, const Camera &camera);
 static Vec3d colorRGBItoRGB(const Vec4d &rgbi);
 static Vec4d setFinalColor(const Vec4d *c, int num);
 
-static Vec3d **pixels;
-static thread *threads;
+static mutex stats_mutex;		// guards the frame statistics and costs of every RayTracer
+static atomic<unsigned> light_seed(1);	// seeds the per-thread light samplers
+
+static atomic<unsigned> tracer_ids(0);
+
+/* Last occluder per light, kept by every worker thread */
+struct OccluderCache {
+	struct Entry {
+		const Face *face;
+		unsigned node;		// packed octree node holding it, (unsigned)-1 for none
+	};
+	unsigned owner = (unsigned)-1;	// id of the RayTracer the entries belong to
+	vector<Entry> entries;		// per light
+};
+
+static OccluderCache::Entry &local_occluder(unsigned owner, int n_lights, int light) {
+	thread_local OccluderCache cache;
+	if (cache.owner != owner) {
+		cache.owner = owner;
+		cache.entries.assign(n_lights, OccluderCache::Entry{ nullptr, (unsigned)-1 });
+	}
+	return cache.entries[light];
+}
+
+/* Random generator of the calling thread */
+static mt19937 &local_rng() {
+	thread_local mt19937 gen(light_seed++);
+	return gen;
+}
 
 constexpr int MAX_RAY_DEPTH = 5;
+constexpr int MIXED_MESHES = -2;	// hit mesh of a pixel whose samples saw different meshes
+constexpr int PROGRESSIVE_BLOCK = 8;	// block size of the coarsest progressive pass
+constexpr int RELIGHT_MEMO_LIGHTS = 64;	// relight() keeps the visibility of up to this many lights
+
+/* One node of a recorded ray tree: what a cast() call saw */
+struct PathNode {
+	enum Kind {
+		TERMINATED,			// depth or intensity limit, no ray cast
+		MISS,
+		HIT
+	};
+	Kind kind;
+	Face face;
+	Vec3d pos;				// intersection point
+	Vec3d direction;		// of the incident ray
+	int reflected, refracted;	// child nodes, -1 for none
+	int memo;				// offset of the per-light visibility in PixelPaths::visibility, -1 for none
+};
+
+/* Ray trees of one pixel's samples */
+struct PixelPaths {
+	vector<PathNode> nodes;
+	vector<int> roots;			// one per sample
+	vector<float> visibility;	// per hit node and light, -1 if not known
+};
+
+constexpr int TILE_SIZE = 16;		// tile cache: tile width and height in pixels
+constexpr int TILE_GRID_RES = 16;	// tile cache: cells per axis of the grid ray paths are recorded in
+constexpr double RAY_REACH = 1e6;	// recorded length of rays that hit nothing
+
+/* What the rays of a tile touched */
+struct TileDeps {
+	vector<char> meshes;		// meshes hit, or blocking a shadow ray
+	vector<char> lights;		// lights considered for shading
+	vector<unsigned> cells;		// bitset of the grid cells the rays crossed
+
+	TileDeps(int n_meshes = 0, int n_lights = 0)
+		: meshes(n_meshes, 0), lights(n_lights, 0), cells((TILE_GRID_RES * TILE_GRID_RES * TILE_GRID_RES + 31) / 32, 0) {}
+
+	void merge(const TileDeps &other) {
+		for (size_t k = 0; k < meshes.size(); k++)
+			meshes[k] |= other.meshes[k];
+		for (size_t k = 0; k < lights.size(); k++)
+			lights[k] |= other.lights[k];
+		for (size_t k = 0; k < cells.size(); k++)
+			cells[k] |= other.cells[k];
+	}
+};
+
+/* Where the calling thread records the dependencies of its rays */
+struct TileRecorder {
+	TileDeps *deps = nullptr;	// nullptr: not recording
+	Vec3d low, high;		// bounds of the cell grid
+};
+
+static TileRecorder &local_recorder() {
+	thread_local TileRecorder recorder;
+	return recorder;
+}
 
-struct FaceVec3 {
-	Face  f;
-	Vec3d v;
+/* Finished tiles of the last frame and the scene as it was rendered */
+struct TileCache {
+	Camera camera;
+	vector<double> settings;	// render settings that change pixels
+	int height, width;
+	vector<Vec3d> pixels;
+	vector<int> hit_meshes;
+	vector<TileDeps> tiles;		// row-major, ceil(width / TILE_SIZE) per row
+	vector<Material> materials;	// per mesh
+	vector<Light> lights;
+	Vec3d low, high;			// bounds of the cell grid
+	TileDeps moved;				// meshes moved since, and the cells they left or entered
+	bool moved_outside;			// a mesh moved (partly) outside the grid
 };
 
-RayTracer::RayTracer(Mesh *_meshes, int _n_meshes, Light *_lights, int _n_lights, const Camera &_camera)
-	: meshes(_meshes), lights(_lights), n_meshes(_n_meshes), n_lights(_n_lights), camera(_camera) {
+/* Ray trees of the last frame, kept for relight() */
+struct RelightCache {
+	int height, width;
+	vector<PixelPaths> pixels;
+	vector<Light> lights;		// the lights as the visibility was computed
+};
+
+/* Marks the cells of the grid between low and high that the segment from-to crosses */
+static void mark_segment(vector<unsigned> &cells, const Vec3d &low, const Vec3d &high, const Vec3d &from, const Vec3d &to) {
+	// clip to the grid
+	Vec3d d = to - from;
+	double t0 = 0, t1 = 1;
+	for (int a = 0; a < 3; a++) {
+		if (d[a] == 0) {
+			if (from[a] < low[a] || from[a] > high[a])
+				return;
+			continue;
+		}
+		double ta = (low[a] - from[a]) / d[a], tb = (high[a] - from[a]) / d[a];
+		t0 = fmax(t0, fmin(ta, tb));
+		t1 = fmin(t1, fmax(ta, tb));
+	}
+	if (t0 > t1)
+		return;
+
+	// walk the cells (Amanatides & Woo)
+	int c[3], step[3];
+	double t_max[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		double size = (high[a] - low[a]) / TILE_GRID_RES;
+		c[a] = size > 0 ? (int)((from[a] + t0 * d[a] - low[a]) / size) : 0;
+		c[a] = c[a] < 0 ? 0 : (c[a] >= TILE_GRID_RES ? TILE_GRID_RES - 1 : c[a]);
+		if (d[a] > 0) {
+			step[a] = 1;
+			t_max[a] = (low[a] + (c[a] + 1) * size - from[a]) / d[a];
+			t_delta[a] = size / d[a];
+		}
+		else if (d[a] < 0) {
+			step[a] = -1;
+			t_max[a] = (low[a] + c[a] * size - from[a]) / d[a];
+			t_delta[a] = -size / d[a];
+		}
+		else {
+			step[a] = 0;
+			t_max[a] = t_delta[a] = INFTY;
+		}
+	}
+	while (true) {
+		int k = (c[0] * TILE_GRID_RES + c[1]) * TILE_GRID_RES + c[2];
+		cells[k / 32] |= 1u << (k % 32);
+		int a = t_max[0] < t_max[1] ? (t_max[0] < t_max[2] ? 0 : 2) : (t_max[1] < t_max[2] ? 1 : 2);
+		if (t_max[a] > t1)
+			break;
+		c[a] += step[a];
+		if (c[a] < 0 || c[a] >= TILE_GRID_RES)
+			break;
+		t_max[a] += t_delta[a];
+	}
+}
+
+/* Marks the cells of the grid between low and high overlapping the box box_low-box_high.
+ * Returns false if the box reaches outside the grid. */
+static bool mark_box(vector<unsigned> &cells, const Vec3d &low, const Vec3d &high, const Vec3d &box_low, const Vec3d &box_high) {
+	int lo[3], hi[3];
+	bool inside = true;
+	for (int a = 0; a < 3; a++) {
+		double size = (high[a] - low[a]) / TILE_GRID_RES;
+		inside &= box_low[a] >= low[a] && box_high[a] <= high[a];
+		lo[a] = size > 0 ? (int)floor((box_low[a] - low[a]) / size) : 0;
+		hi[a] = size > 0 ? (int)floor((box_high[a] - low[a]) / size) : 0;
+		lo[a] = lo[a] < 0 ? 0 : (lo[a] >= TILE_GRID_RES ? TILE_GRID_RES - 1 : lo[a]);
+		hi[a] = hi[a] < 0 ? 0 : (hi[a] >= TILE_GRID_RES ? TILE_GRID_RES - 1 : hi[a]);
+	}
+	for (int x = lo[0]; x <= hi[0]; x++) {
+		for (int y = lo[1]; y <= hi[1]; y++) {
+			for (int z = lo[2]; z <= hi[2]; z++) {
+				int k = (x * TILE_GRID_RES + y) * TILE_GRID_RES + z;
+				cells[k / 32] |= 1u << (k % 32);
+			}
+		}
+	}
+	return inside;
+}
+
+/* Bounding box and a checksum of the vertex positions of a mesh */
+static RayTracer::MeshState mesh_state(Mesh &mesh) {
+	RayTracer::MeshState ret = { 0, Vec3d(INFTY), Vec3d(-INFTY) };
+	const Face *faces = mesh.get_const_faces();
+	for (int i = 0; i < mesh.get_size(); i++) {
+		Vec3d low, high;
+		face_bounds(faces[i], low, high);
+		for (int a = 0; a < 3; a++) {
+			ret.low[a] = fmin(ret.low[a], low[a]);
+			ret.high[a] = fmax(ret.high[a], high[a]);
+		}
+		for (int j = 0; j < 3; j++) {
+			const Vec3d &v = *faces[i].vertices[j];
+			ret.checksum += (i * 3 + j + 1) * (v[X] + 3 * v[Y] + 7 * v[Z]);
+		}
+		// a primitive's third half axis is in no vertex of its face
+		if (faces[i].primitive != nullptr) {
+			const Vec3d &w = faces[i].primitive->axes[2];
+			ret.checksum += w[X] + 3 * w[Y] + 7 * w[Z];
+		}
+	}
+	return ret;
+}
+
+RayTracer::RayTracer(Mesh *_meshes, int _n_meshes, Light *_lights, int _n_lights, const Camera &_camera, bool lazy_octree)
+	: meshes(_meshes), lights(_lights), camera(_camera), n_meshes(_n_meshes), n_lights(_n_lights),
+	heatmap_mode(HEATMAP_NONE), light_grid(nullptr), light_cull(0), light_samples(0),
+	soft_min_strata(2), soft_max_strata(6), occluder_cache(true),
+	aa_min_strata(0), aa_max_strata(0), aa_contrast(0.1), progressive(false), budget(0),
+	relight_enabled(false), relight_cache(nullptr),
+	tile_cache_enabled(false), tile_cache(nullptr), rasterize(false), shadow_map_res(0),
+	leaf_classes(false), leaf_visibility(nullptr), irradiance_radius(0), irradiance_cache(nullptr), lod_bias(0),
+	compressed(false), lazy(lazy_octree), tile_order(TILE_ORDER_HILBERT), tile_size(16), id(tracer_ids++) {
+	Timer timer;
+	octree = nullptr;
+	geometry = nullptr;
+	reference = nullptr;
+	build();
+	pool = new WorkerPool();
+	stats.seconds[RenderStats::BUILDING] = timer.seconds();
+}
+
+void RayTracer::build() {
 	Face **allFaces;
 	int n_allFaces = 0;
-	for (int i = 0; i < _n_meshes; i++) {
-		n_allFaces += _meshes[i].get_size();
+	for (int i = 0; i < n_meshes; i++) {
+		n_allFaces += meshes[i].get_size();
 	}
 	allFaces = new Face*[n_allFaces];
 
 	int idx = 0;
-	for (int i = 0; i < _n_meshes; i++) {
-		Face *faces = _meshes[i].get_faces();
-		for (int j = 0; j < _meshes[i].get_size(); j++) {
+	for (int i = 0; i < n_meshes; i++) {
+		Face *faces = meshes[i].get_faces();
+		for (int j = 0; j < meshes[i].get_size(); j++) {
 			allFaces[idx++] = &(faces[j]);
 		}
 	}
 
-	octree = new Octree(allFaces, n_allFaces);
+	delete octree;
+	delete geometry;
+	delete reference;
+	geometry = compressed ? new CompressedGeometry(meshes, n_meshes) : nullptr;
+	octree = new Octree(allFaces, n_allFaces, geometry, lazy);
+	reference = compressed ? nullptr : new BruteForce(meshes, n_meshes);
+
+	mesh_states.clear();
+	for (int i = 0; i < n_meshes; i++)
+		mesh_states.push_back(mesh_state(meshes[i]));
 
-	delete allFaces;
+	delete[] allFaces;
+	// the compressed geometry stands in for the meshes' faces from now on
+	if (compressed) {
+		for (int i = 0; i < n_meshes; i++)
+			meshes[i].release();
+	}
 }
 
-bool RayTracer::intersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const {
-	return octree->getNearestIntersect(ray, ret_face, ret_vec);
+void RayTracer::updateGeometry() {
+	if (geometry != nullptr)
+		return;		// the meshes' faces are gone, the compressed copy stays
+	Timer timer;
+	// the tile cache learns which meshes moved, and where from and to
+	for (int i = 0; i < n_meshes; i++) {
+		MeshState now = mesh_state(meshes[i]);
+		const MeshState &was = mesh_states[i];
+		if (tile_cache == nullptr || (now.checksum == was.checksum && now.low == was.low && now.high == was.high))
+			continue;
+		TileCache &cache = *tile_cache;
+		cache.moved.meshes[i] = 1;
+		if (!mark_box(cache.moved.cells, cache.low, cache.high, was.low, was.high) ||
+			!mark_box(cache.moved.cells, cache.low, cache.high, now.low, now.high))
+			cache.moved_outside = true;
+	}
+
+	build();
+	if (light_grid != nullptr)
+		setLightCulling(light_cull);
+	setShadowMaps(shadow_map_res);
+	setLeafClassification(leaf_classes);
+	setIrradianceCache(irradiance_radius);
+	// the per-thread occluder caches point into the old octree
+	id = tracer_ids++;
+	stats.seconds[RenderStats::BUILDING] += timer.seconds();
 }
 
-bool RayTracer::intersect_slow(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const {
-	// Search whole space, find candidates
-	vector<FaceVec3> candidates;
-	for (int i = 0; i < meshes->get_size(); i++) {
-		Face face = (meshes->get_faces())[i];
-		Vec3d cand_vec;
-		// face-wise searching helper function
-		bool is_intersect = intersect_face(ray, face, cand_vec);
-		if (is_intersect) {
-			FaceVec3 candidate = { face, cand_vec };
-			candidates.push_back(candidate);
+void RayTracer::selectLevels(const Camera &view_camera) {
+	bool changed = false;
+	double pixels_per_unit = view_camera.height / 2 / tan(view_camera.fovy / 2);	// at distance 1
+	for (int i = 0; i < n_meshes; i++) {
+		Mesh &mesh = meshes[i];
+		int lod = 0;
+		if (lod_bias > 0 && mesh.get_levels() > 1) {
+			// the active level's bounding sphere, close enough for the others
+			const MeshState &state = mesh_states[i];
+			Vec3d center = (state.low + state.high) / 2;
+			double radius = (state.high - state.low).norm() / 2;
+			double dist = (center - view_camera.position).norm();
+			if (dist > radius) {
+				double r = radius / dist * pixels_per_unit;
+				double wanted = lod_bias * M_PI * r * r;
+				for (int k = mesh.get_levels() - 1; k > 0 && lod == 0; k--) {
+					if (mesh.get_size(k) >= wanted)
+						lod = k;
+				}
+			}
+		}
+		if (mesh.get_level() != lod) {
+			mesh.set_level(lod);
+			changed = true;
 		}
 	}
+	if (changed)
+		updateGeometry();
+}
 
-	// no candidates
-	if (candidates.empty())
-		return false;
+void RayTracer::setCompressedGeometry(bool enabled) {
+	if (!enabled || compressed)
+		return;		// for good: the meshes' faces are freed
+	compressed = true;
+	updateGeometry();
+}
 
-	// find some candidates: get the nearest candidate
-	double mind = 1000000;
-	FaceVec3 nearest;
-	for (int i = 0; i < candidates.size(); i++) {
-		FaceVec3 candidate = candidates[i];
-		Vec3d v_o = candidate.v - ray.getOrigin();
-		double dist2 = v_o.dot(v_o);
-		if (dist2 < mind) {
-			mind = dist2;
-			nearest = candidate;
+int RayTracer::mesh_of(const Face &face) const {
+	// every mesh owns its material; the out-of-core ones follow the others
+	for (int i = 0; i < n_meshes; i++) {
+		if (meshes[i].get_material() == face.material)
+			return i;
+	}
+	for (size_t p = 0; p < paged.size(); p++) {
+		if (paged[p]->get_material() == face.material)
+			return n_meshes + p;
+	}
+	return -1;
+}
+
+RayTracer::~RayTracer() {
+	delete pool;
+	for (size_t v = 0; v < costs.size(); v++) {
+		for (int i = 0; i < cost_sizes[v].first; i++)
+			delete[] costs[v][i];
+		delete[] costs[v];
+	}
+	delete relight_cache;
+	delete tile_cache;
+	for (size_t l = 0; l < shadow_maps.size(); l++)
+		delete shadow_maps[l];
+	delete leaf_visibility;
+	delete irradiance_cache;
+	delete light_grid;
+	delete reference;
+	delete octree;
+	delete geometry;
+}
+
+bool RayTracer::intersect(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const {
+	bool hit = octree->getNearestIntersect(ray, ret_face, ret_vec);
+	if (!paged.empty()) {
+		double max_r = hit ? ret_vec.distance(ray.getOrigin()) : INFTY, r;
+		for (size_t p = 0; p < paged.size(); p++) {
+			if (paged[p]->intersect(ray, max_r, r, ret_face)) {
+				max_r = r;
+				hit = true;
+				ret_vec = ray.getOrigin() + r * ray.getDirection();
+			}
 		}
 	}
+	RenderStats &local = RenderStats::local();
+	if (hit)
+		local.hits++;
+	else
+		local.misses++;
+	return hit;
+}
+
+void RayTracer::mergeStats(const RenderStats &local) const {
+	lock_guard<mutex> lock(stats_mutex);
+	stats.merge(local);
+}
 
-	ret_face = nearest.f;	// intersection face
-	ret_vec = nearest.v;	// intersection point
-	return true;
+bool RayTracer::intersect_slow(const Ray &ray, Face &ret_face, Vec3d &ret_vec) const {
+	// Search whole space: every face of every mesh, or the octree once they are compressed
+	if (reference == nullptr)
+		return octree->getNearestIntersect(ray, ret_face, ret_vec);
+	return reference->getNearestIntersect(ray, ret_face, ret_vec);
 }
 
 /* Return value: RGB + light intensity */
-const Vec4d RayTracer::cast(const Ray &ray, int depth) const {
+const Vec4d RayTracer::cast(const Ray &ray, int depth, int *hit_mesh, PixelPaths *paths, const PrimaryHit *primary) const {
+	int k = -1;		// node of this ray in the recorded tree
+	if (paths != nullptr) {
+		k = paths->nodes.size();
+		paths->nodes.push_back({ PathNode::TERMINATED, Face(), Vec3d(), ray.getDirection(), -1, -1, -1 });
+	}
 	// Early termination
 	if (depth > MAX_RAY_DEPTH || ray.getIntensity() == 0)
 		return { 0,0,0,0 };	// Transparent (no color)
+	RenderStats &local = RenderStats::local();
+	local.depth_histogram[depth < STATS_DEPTH_BINS ? depth : STATS_DEPTH_BINS - 1]++;
 	// Get nearest intersection
 	Face face;
 	Vec3d pos;
-	if (!intersect(ray, face, pos)) {
+	bool hit;
+	if (primary != nullptr && primary->face != nullptr) {
+		// found by the rasterization pre-pass
+		local.raster_rays++;
+		hit = true;
+		face = *primary->face;
+		pos = ray.getOrigin() + primary->r * ray.getDirection();
+	}
+	else	// nothing between the clip planes: traverse the octree
+		hit = intersect(ray, face, pos);
+	if (!hit) {
+		if (hit_mesh != nullptr)
+			*hit_mesh = -1;
+		if (paths != nullptr)
+			paths->nodes[k].kind = PathNode::MISS;
+		TileRecorder &recorder = local_recorder();
+		if (recorder.deps != nullptr)
+			mark_segment(recorder.deps->cells, recorder.low, recorder.high, ray.getOrigin(), ray.getOrigin() + RAY_REACH * ray.getDirection());
 		return { 0,0,0,1 }; // return black for non-intersecting ray
 	}
+	// analytic primitives: the normal at the hit
+	if (face.primitive != nullptr)
+		face.normal = face.primitive->normal(pos);
+	if (hit_mesh != nullptr)
+		*hit_mesh = mesh_of(face);
+	TileRecorder &recorder = local_recorder();
+	if (recorder.deps != nullptr) {
+		int m = mesh_of(face);
+		if (m >= 0 && m < n_meshes)
+			recorder.deps->meshes[m] = 1;
+		mark_segment(recorder.deps->cells, recorder.low, recorder.high, ray.getOrigin(), pos);
+	}
 
+	// Recording: the hit, and where the children and the light visibility go
+	if (paths != nullptr) {
+		PathNode &node = paths->nodes[k];
+		node.kind = PathNode::HIT;
+		node.face = face;
+		node.pos = pos;
+		if (n_lights <= RELIGHT_MEMO_LIGHTS) {
+			node.memo = paths->visibility.size();
+			paths->visibility.resize(paths->visibility.size() + n_lights, -1.f);
+		}
+	}
+	auto branch = [&](const Ray &next, int PathNode::*child) {
+		if (paths != nullptr)
+			paths->nodes[k].*child = paths->nodes.size();
+		return cast(next, depth + 1, nullptr, paths);
+	};
+	// the children are done before the shadow ray, and may have grown the memo
+	auto visibility_memo = [&]() -> float * {
+		if (paths == nullptr || paths->nodes[k].memo < 0)
+			return nullptr;
+		return &paths->visibility[paths->nodes[k].memo];
+	};
 	
 	// Generating second rays
 	if (face.material->getopacity() < 1 - FLT_EPSILON) {
+		local.refraction_rays++;
 		if (face.material->getmirror() > FLT_EPSILON) {
+			local.reflection_rays++;
 			Vec4d colors[] =
 			{
-				cast(ray.reflect(face, pos), depth + 1),		// reflecting ray
-				cast(ray.refract(face, pos), depth + 1),		// refracting ray
-				shadow(ray, face, pos)							// shadow ray
+				branch(ray.reflect(face, pos), &PathNode::reflected),		// reflecting ray
+				branch(ray.refract(face, pos), &PathNode::refracted),		// refracting ray
+				shadow(ray, face, pos, visibility_memo())				// shadow ray
 			};
 			return setFinalColor(colors, 3);
 		}
 		else {
 			Vec4d colors[] =
 			{
-				cast(ray.refract(face, pos), depth + 1),		// refracting ray
-				shadow(ray, face, pos)							// shadow ray
+				branch(ray.refract(face, pos), &PathNode::refracted),		// refracting ray
+				shadow(ray, face, pos, visibility_memo())				// shadow ray
 			};
 			return setFinalColor(colors, 2);
 		}
 	}
 	else {
 		if (face.material->getmirror() > FLT_EPSILON) {
+			local.reflection_rays++;
 			Vec4d colors[] =
 			{
-				cast(ray.reflect(face, pos), depth + 1),		// reflecting ray
-				shadow(ray, face, pos)							// shadow ray
+				branch(ray.reflect(face, pos), &PathNode::reflected),		// reflecting ray
+				shadow(ray, face, pos, visibility_memo())				// shadow ray
 			};
 			return setFinalColor(colors, 2);
 		}
 		else {
-			return shadow(ray, face, pos);
+			return shadow(ray, face, pos, visibility_memo());
+		}
+	}
+}
+
+/* One view of a render() call, with its own framebuffer */
+struct View {
+	Camera camera;
+	int height, width;
+	Vec3d **pixels;			// RGB pixel container
+	double **costs;			// per-pixel cost for the heatmap, nullptr without
+	vector<int> hit_meshes;	// mesh seen by each pixel's first-pass samples
+	vector<char> refine;	// pixels taking anti-aliasing samples
+	vector<PixelPaths> paths;	// ray trees per pixel for relight(), empty if not recorded
+	vector<int> work;		// work tiles in the order they are issued, row-major
+	int first_item;			// index of the view's first work tile among all views' tiles
+	int work_height, work_width;	// pixels per work tile
+	int work_cols;			// work tiles per row
+	int tile_cols;			// tiles per row
+	VisibilityBuffer *visibility;	// primary hits, nullptr if not rasterized
+	vector<char> reused;	// per tile: taken from the tile cache, empty if none is
+	vector<TileDeps> deps;	// per row and tile column, empty if not recorded
+	Vec3d grid_low, grid_high;	// bounds of the cell grid of deps
+
+	bool isReused(int i, int j) const {
+		return !reused.empty() && reused[(i / TILE_SIZE) * tile_cols + j / TILE_SIZE];
+	}
+};
+
+/* Adds the colour of strata^2 primary rays through pixel (i, j) to the view's pixels.
+ * With strata 0 a single ray goes through the pixel corner, otherwise the rays
+ * are jittered over the strata of the pixel area centred on the corner.
+ * hit_mesh is set to the mesh every ray hit, MIXED_MESHES if they disagree. */
+static void render_helper(int i, int j, int strata, View &view, const RayTracer &inst, int &hit_mesh) {
+	RenderStats &local = RenderStats::local();
+	unsigned long long nodes_before = local.nodes_visited;
+	unsigned long long tests_before = local.triangle_tests;
+	Timer timer;
+	PixelPaths *paths = view.paths.empty() ? nullptr : &view.paths[i * view.width + j];
+	TileRecorder &recorder = local_recorder();
+	if (!view.deps.empty()) {
+		recorder.deps = &view.deps[i * view.tile_cols + j / TILE_SIZE];
+		recorder.low = view.grid_low;
+		recorder.high = view.grid_high;
+	}
+
+	if (strata == 0) {
+		// find primary ray for each pixel
+		Ray primary_ray = find_primary_ray(i, j, view.camera);
+		// cast the primary ray to space, collecting pixel colors
+		local.primary_rays++;
+		if (paths != nullptr)
+			paths->roots.push_back(paths->nodes.size());
+		const PrimaryHit *primary = view.visibility != nullptr ? &view.visibility->at(i, j) : nullptr;
+		view.pixels[i][j] += colorRGBItoRGB(inst.cast(primary_ray, 0, &hit_mesh, paths, primary));
+	}
+	else {
+		mt19937 &gen = local_rng();
+		uniform_real_distribution<double> jitter(0., 1.);
+		for (int s = 0; s < strata; s++) {
+			for (int t = 0; t < strata; t++) {
+				double y = i - 0.5 + (s + jitter(gen)) / strata;
+				double x = j - 0.5 + (t + jitter(gen)) / strata;
+				int mesh;
+				local.primary_rays++;
+				if (paths != nullptr)
+					paths->roots.push_back(paths->nodes.size());
+				view.pixels[i][j] += colorRGBItoRGB(inst.cast(find_primary_ray(y, x, view.camera), 0, &mesh, paths));
+				hit_mesh = (s == 0 && t == 0) || mesh == hit_mesh ? mesh : MIXED_MESHES;
+			}
+		}
+	}
+
+	recorder.deps = nullptr;
+
+	// cost of this pixel's ray trees
+	switch (inst.getHeatmapMode()) {
+	case HEATMAP_NODES:
+		view.costs[i][j] += local.nodes_visited - nodes_before;
+		break;
+	case HEATMAP_TRIANGLES:
+		view.costs[i][j] += local.triangle_tests - tests_before;
+		break;
+	case HEATMAP_TIME:
+		view.costs[i][j] += timer.seconds() * 1e6;
+		break;
+	default:
+		;
+	}
+}
+
+/* Runs the task on every pixel of every view, one work tile per pool item in
+ * the views' work order and row by row inside the tile, and waits for it.
+ * The workers keep their thread-local state (occluder cache) across tiles,
+ * passes and views; their counters are handed over after every tile. */
+static void run_pass(WorkerPool &pool, vector<View> &views, const function<void(View &, int, int)> &task,
+	const RayTracer &inst, bool progress) {
+	int n_items = 0;
+	for (size_t v = 0; v < views.size(); v++)
+		n_items += views[v].work.size();
+
+	pool.run(n_items, [&](int item) {
+		size_t v = 0;
+		while (item >= views[v].first_item + (int)views[v].work.size())
+			v++;
+		View &view = views[v];
+		int t = view.work[item - view.first_item];
+		int top = t / view.work_cols * view.work_height;
+		int left = t % view.work_cols * view.work_width;
+
+		RenderStats::local().reset();
+		for (int i = top; i < view.height && i < top + view.work_height; i++) {
+			for (int j = left; j < view.width && j < left + view.work_width; j++)
+				task(view, i, j);
 		}
+		if (progress && item % ((n_items >= 100) ? (n_items / 100) : (1)) == 0)
+			cout << "#";
+		inst.mergeStats(RenderStats::local());
+	});
+}
+
+/* Does colour a differ from colour b in any channel by more than contrast? */
+static bool contrasts(const Vec3d &a, const Vec3d &b, double contrast) {
+	for (int k = 0; k < 3; k++) {
+		if (fabs(a[k] - b[k]) > contrast)
+			return true;
 	}
+	return false;
 }
 
-void render_helper(int i, int j, const Camera &cam, const RayTracer &inst) {
-	// find primary ray for each pixel
-	Ray primary_ray = find_primary_ray(i, j, cam);
-	// cast the primary ray to space, collecting pixel colors
-	Vec4d rgbi = inst.cast(primary_ray, 0);
-	pixels[i][j] = colorRGBItoRGB(rgbi);
+/* Do `rays` more primary rays, at the rate of the `traced` ones so far, end within the budget? */
+static bool fits_budget(double elapsed, double traced, double rays, double budget) {
+	double per_ray = traced > 0 ? elapsed / traced : 0;
+	return elapsed + rays * per_ray <= budget;
 }
 
 Vec3d ** RayTracer::render() const {
+	return render(vector<Camera>(1, camera))[0];
+}
+
+Vec3d ** RayTracer::render(const Camera &view_camera) const {
+	return render(vector<Camera>(1, view_camera))[0];
+}
+
+vector<Vec3d **> RayTracer::render(const vector<Camera> &cameras) const {
 	// init local vars
-	int height = camera.height;
-	int width = camera.height * camera.aspect_ratio;
-	pixels = new Vec3d*[height];	// RGB pixel container
-	for (int i = 0; i < height; i++)
-		pixels[i] = new Vec3d[width];
+	Timer timer;
+	{
+		lock_guard<mutex> lock(stats_mutex);
+		stats.resetCounters();
+		// culling radii of the lights moved or edited since the last frame
+		if (light_grid != nullptr)
+			update_light_grid();
+	}
+	unsigned long long faults = 0, evictions = 0;	// of the out-of-core meshes before the frame
+	for (size_t p = 0; p < paged.size(); p++) {
+		faults += paged[p]->getFaults();
+		evictions += paged[p]->getEvictions();
+	}
+	// Work tiles: while the tile cache records, the dependencies of a cache
+	// tile's row must come from a single thread
+	bool tiling = tile_cache_enabled && cameras.size() == 1;
+	int work_size = tiling ? (tile_size + TILE_SIZE - 1) / TILE_SIZE * TILE_SIZE : tile_size;
+	vector<View> views(cameras.size());
+	int n_items = 0;
+	for (size_t v = 0; v < views.size(); v++) {
+		View &view = views[v];
+		view.camera = cameras[v];
+		view.height = view.camera.height;
+		view.width = view.camera.height * view.camera.aspect_ratio;
+		view.pixels = new Vec3d*[view.height];
+		for (int i = 0; i < view.height; i++)
+			view.pixels[i] = new Vec3d[view.width];
+		view.costs = nullptr;
+		if (heatmap_mode != HEATMAP_NONE) {
+			view.costs = new double*[view.height];
+			for (int i = 0; i < view.height; i++)
+				view.costs[i] = new double[view.width]();
+		}
+		view.hit_meshes.resize(view.height * view.width);
+		view.refine.resize(view.height * view.width);
+		if (relight_enabled && cameras.size() == 1)
+			view.paths.resize(view.height * view.width);
+		view.tile_cols = (view.width + TILE_SIZE - 1) / TILE_SIZE;
+		view.work_height = tile_order == TILE_ORDER_SCANLINE ? 1 : work_size;
+		view.work_width = tile_order == TILE_ORDER_SCANLINE ? view.width : work_size;
+		view.work_cols = (view.width + view.work_width - 1) / view.work_width;
+		view.work = order_tiles(tile_order, (view.height + view.work_height - 1) / view.work_height, view.work_cols);
+		view.first_item = n_items;
+		n_items += view.work.size();
+	}
+
+	// Tile cache: reuse the tiles no edit reached, record what the others touch
+	int n_tiles = 0, n_reused = 0;
+	if (tiling) {
+		View &view = views[0];
+		lock_guard<mutex> lock(stats_mutex);
+		view.reused = reusable_tiles(view.camera, view.height, view.width);
+		n_tiles = view.reused.size();
+		for (int t = 0; t < n_tiles; t++)
+			n_reused += view.reused[t];
+		if (n_reused > 0) {
+			// the cached tiles were recorded in the cached grid
+			view.grid_low = tile_cache->low;
+			view.grid_high = tile_cache->high;
+			for (int i = 0; i < view.height; i++) {
+				for (int j = 0; j < view.width; j++) {
+					if (!view.isReused(i, j))
+						continue;
+					view.pixels[i][j] = tile_cache->pixels[i * view.width + j];
+					view.hit_meshes[i * view.width + j] = tile_cache->hit_meshes[i * view.width + j];
+				}
+			}
+		}
+		else {
+			view.grid_low = octree->getLowest();
+			view.grid_high = octree->getHighest();
+		}
+		view.deps.assign(view.height * view.tile_cols, TileDeps(n_meshes, n_lights));
+	}
+
+	// Shadow maps and leaf classes of the lights moved or added since the last frame
+	if (shadow_map_res > 0 && geometry == nullptr) {
+		lock_guard<mutex> lock(build_mutex);
+		update_shadow_maps();
+	}
+	double classify_seconds = 0;	// counted as building, not rendering
+	if (leaf_classes && geometry == nullptr) {
+		Timer classifying;
+		{
+			lock_guard<mutex> lock(build_mutex);
+			if (leaf_visibility == nullptr) {
+				octree->divide();		// the leaves of a lazy octree are classified as they would be built
+				leaf_visibility = new LeafVisibility(octree);
+			}
+			leaf_visibility->update(lights, n_lights, *pool);
+		}
+		classify_seconds = classifying.seconds();
+		lock_guard<mutex> lock(stats_mutex);
+		stats.seconds[RenderStats::BUILDING] += classify_seconds;
+	}
+	if (irradiance_radius > 0) {
+		lock_guard<mutex> lock(stats_mutex);
+		if (irradiance_cache == nullptr)
+			irradiance_cache = new IrradianceCache(lights, n_lights, irradiance_radius);
+		irradiance_cache->update(lights);
+	}
+
+	// Rasterization pre-pass: the primary hits of the pixel-corner rays
+	if (rasterize && aa_min_strata == 0 && geometry == nullptr) {
+		for (size_t v = 0; v < views.size(); v++) {
+			const Camera &view_camera = views[v].camera;
+			views[v].visibility = new VisibilityBuffer(meshes, n_meshes, view_camera,
+				[&view_camera](int i, int j) { return find_primary_ray(i, j, view_camera); }, *pool);
+			for (size_t p = 0; p < paged.size(); p++) {
+				views[v].visibility->addPaged(*paged[p],
+					[&view_camera](int i, int j) { return find_primary_ray(i, j, view_camera); }, *pool);
+			}
+			lock_guard<mutex> lock(stats_mutex);
+			stats.raster_tests += views[v].visibility->getTests();
+		}
+	}
+
+	int n_first = aa_min_strata > 0 ? aa_min_strata * aa_min_strata : 1;
+	int n_second = aa_max_strata * aa_max_strata;
+	double traced = 0;		// primary rays so far
+	int pass = 0;
+
+	// Progressive: one pixel per block, halving the block size every pass;
+	// otherwise a single pass over every pixel
+	vector<int> blocks;
+	for (int b = progressive ? PROGRESSIVE_BLOCK : 1; b >= 1; b /= 2)
+		blocks.push_back(b);
 
-	threads = new thread[width];
-	
 	// Main behavior
 	cout << "Complete:";
-	for (int i = 0; i < height; i++) {
-		for (int j = 0; j < width; j++) {
-			threads[j] = thread(render_helper, i, j, camera, *this);
-			//render_helper(i, j, camera, *this);
+	bool complete = true;
+	for (size_t p = 0; p < blocks.size(); p++) {
+		int b = blocks[p];
+		bool coarsest = p == 0;
+		// pixels of this pass: block corners not traced by a coarser pass
+		auto in_pass = [b, coarsest](int i, int j) {
+			return i % b == 0 && j % b == 0 && (coarsest || i % (2 * b) != 0 || j % (2 * b) != 0);
+		};
+
+		long long n_pixels = 0;
+		for (size_t v = 0; v < views.size(); v++) {
+			for (int i = 0; i < views[v].height; i += b) {
+				for (int j = 0; j < views[v].width; j += b)
+					n_pixels += in_pass(i, j);
+			}
 		}
-		for (int j = 0; j < width; j++) {
-			threads[j].join();
+		if (!coarsest && budget > 0 && !fits_budget(timer.seconds(), traced, (double)n_pixels * n_first, budget)) {
+			complete = false;
+			break;
+		}
+
+		run_pass(*pool, views, [&](View &view, int i, int j) {
+			if (!in_pass(i, j) || view.isReused(i, j))
+				return;
+			view.pixels[i][j] = Vec3d();
+			render_helper(i, j, aa_min_strata, view, *this, view.hit_meshes[i * view.width + j]);
+			view.pixels[i][j] /= n_first;
+		}, *this, b == 1);
+		traced += (double)n_pixels * n_first;
+
+		for (size_t v = 0; v < views.size(); v++) {
+			View &view = views[v];
+			// preview: untraced pixels take the colour of their block's corner
+			if (b > 1) {
+				for (int i = 0; i < view.height; i++) {
+					for (int j = 0; j < view.width; j++) {
+						if (!view.isReused(i, j))
+							view.pixels[i][j] = view.pixels[i - i % b][j - j % b];
+					}
+				}
+			}
+			if (snapshot)
+				snapshot(view.pixels, v, pass, timer.seconds());
+		}
+		pass++;
+	}
+
+	if (complete && aa_min_strata > 0 && n_second > 0) {
+		// Edges: pixels whose samples disagree, and both pixels of a pair of
+		// neighbours that differ in hit mesh or colour
+		long long n_refine = 0;
+		for (size_t v = 0; v < views.size(); v++) {
+			View &view = views[v];
+			const vector<int> &hit_meshes = view.hit_meshes;
+			vector<char> &refine = view.refine;
+			Vec3d **pixels = view.pixels;
+			int height = view.height, width = view.width;
+			for (int i = 0; i < height; i++) {
+				for (int j = 0; j < width; j++) {
+					int k = i * width + j;
+					if (hit_meshes[k] == MIXED_MESHES)
+						refine[k] = 1;
+					if (i + 1 < height && (hit_meshes[k] != hit_meshes[k + width] ||
+						contrasts(pixels[i][j], pixels[i + 1][j], aa_contrast)))
+						refine[k] = refine[k + width] = 1;
+					if (j + 1 < width && (hit_meshes[k] != hit_meshes[k + 1] ||
+						contrasts(pixels[i][j], pixels[i][j + 1], aa_contrast)))
+						refine[k] = refine[k + 1] = 1;
+					n_refine += refine[k];
+				}
+			}
+		}
+
+		// Second pass: more samples on the edges only
+		if (budget <= 0 || fits_budget(timer.seconds(), traced, (double)n_refine * n_second, budget)) {
+			run_pass(*pool, views, [&](View &view, int i, int j) {
+				if (!view.refine[i * view.width + j] || view.isReused(i, j))
+					return;
+				int mesh;
+				view.pixels[i][j] *= n_first;
+				render_helper(i, j, aa_max_strata, view, *this, mesh);
+				view.pixels[i][j] /= n_first + n_second;
+				RenderStats::local().pixels_refined++;
+			}, *this, false);
+			for (size_t v = 0; v < views.size(); v++) {
+				if (snapshot)
+					snapshot(views[v].pixels, v, pass, timer.seconds());
+			}
 		}
-		if (i % ((height >= 100) ? (height / 100) : (1)) == 0)
-			cout << "#";
 	}
 
-	delete[] threads;
+	vector<Vec3d **> ret;
+	vector<double **> frame_costs;
+	for (size_t v = 0; v < views.size(); v++) {
+		ret.push_back(views[v].pixels);
+		frame_costs.push_back(views[v].costs);
+		delete views[v].visibility;
+	}
+	lock_guard<mutex> lock(stats_mutex);
+	stats.seconds[RenderStats::RENDERING] = timer.seconds() - classify_seconds;
+	for (size_t p = 0; p < paged.size(); p++) {
+		stats.paged_faults += paged[p]->getFaults();
+		stats.paged_evictions += paged[p]->getEvictions();
+	}
+	stats.paged_faults -= faults;
+	stats.paged_evictions -= evictions;
+	stats.tile_order = tile_order;
+	stats.tile_size = tile_order == TILE_ORDER_SCANLINE ? 0 : work_size;
+	if (heatmap_mode != HEATMAP_NONE) {
+		// keep the costs for heatmap(), dropping the previous render's
+		for (size_t v = 0; v < costs.size(); v++) {
+			for (int i = 0; i < cost_sizes[v].first; i++)
+				delete[] costs[v][i];
+			delete[] costs[v];
+		}
+		costs = frame_costs;
+		cost_sizes.clear();
+		for (size_t v = 0; v < views.size(); v++)
+			cost_sizes.push_back(make_pair(views[v].height, views[v].width));
+	}
+	if (tiling) {
+		// the finished tiles replace the previous ones
+		View &view = views[0];
+		TileCache *cache = nullptr;
+		if (complete) {
+			cache = new TileCache();
+			cache->camera = view.camera;
+			cache->settings = tile_settings();
+			cache->height = view.height;
+			cache->width = view.width;
+			for (int i = 0; i < view.height; i++)
+				cache->pixels.insert(cache->pixels.end(), view.pixels[i], view.pixels[i] + view.width);
+			cache->hit_meshes = view.hit_meshes;
+			for (int t = 0; t < n_tiles; t++) {
+				if (view.reused[t]) {
+					cache->tiles.push_back(tile_cache->tiles[t]);
+					continue;
+				}
+				TileDeps deps(n_meshes, n_lights);
+				int ti = t / view.tile_cols, tj = t % view.tile_cols;
+				for (int i = ti * TILE_SIZE; i < view.height && i < (ti + 1) * TILE_SIZE; i++)
+					deps.merge(view.deps[i * view.tile_cols + tj]);
+				cache->tiles.push_back(deps);
+			}
+			for (int m = 0; m < n_meshes; m++)
+				cache->materials.push_back(*meshes[m].get_material());
+			cache->lights.assign(lights, lights + n_lights);
+			cache->low = view.grid_low;
+			cache->high = view.grid_high;
+			cache->moved = TileDeps(n_meshes, n_lights);
+			cache->moved_outside = false;
+		}
+		delete tile_cache;
+		tile_cache = cache;
+		stats.tiles_reused = n_reused;
+		stats.tiles_rendered = n_tiles - n_reused;
+	}
+	if (relight_enabled) {
+		// the ray trees of a complete single-view frame replace the previous ones
+		delete relight_cache;
+		relight_cache = nullptr;
+		if (complete && n_reused == 0 && !views[0].paths.empty()) {
+			relight_cache = new RelightCache();
+			relight_cache->height = views[0].height;
+			relight_cache->width = views[0].width;
+			relight_cache->pixels.swap(views[0].paths);
+			relight_cache->lights.assign(lights, lights + n_lights);
+		}
+	}
 	
 	// Now you have colored whole pixels
+	return ret;
+}
+
+/* Are the cameras the same? */
+static bool same_camera(const Camera &a, const Camera &b) {
+	return a.position == b.position && a.center == b.center && a.up == b.up && a.height == b.height &&
+		a.fovy == b.fovy && a.aspect_ratio == b.aspect_ratio && a.zNear == b.zNear && a.zFar == b.zFar;
+}
+
+/* Are the lights the same? */
+static bool same_light(const Light &a, const Light &b) {
+	return a.position == b.position && a.color == b.color && a.shape == b.shape &&
+		a.edge_u == b.edge_u && a.edge_v == b.edge_v && a.radius == b.radius;
+}
+
+/* Are the materials the same? */
+static bool same_material(Material a, Material b) {
+	return a.getcolor() == b.getcolor() && a.getopacity() == b.getopacity() &&
+		a.getrefraction_index() == b.getrefraction_index() && a.getmirror() == b.getmirror();
+}
+
+vector<double> RayTracer::tile_settings() const {
+	double settings[] = {
+		(double)heatmap_mode, (double)shadow_map_res, irradiance_radius, light_cull, (double)light_samples, (double)soft_min_strata, (double)soft_max_strata,
+		(double)aa_min_strata, (double)aa_max_strata, aa_contrast, (double)compressed
+	};
+	return vector<double>(settings, settings + sizeof settings / sizeof settings[0]);
+}
+
+vector<char> RayTracer::reusable_tiles(const Camera &view_camera, int height, int width) const {
+	int tile_cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+	int tile_rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+	vector<char> ret(tile_rows * tile_cols, 0);
+	const TileCache *cache = tile_cache;
+	if (cache == nullptr || !same_camera(cache->camera, view_camera) || cache->height != height ||
+		cache->width != width || cache->settings != tile_settings() || cache->moved_outside)
+		return ret;
+
+	// What changed since: materials, lights, and moved meshes
+	vector<char> meshes_changed = cache->moved.meshes;
+	for (int m = 0; m < n_meshes; m++)
+		meshes_changed[m] |= !same_material(cache->materials[m], *meshes[m].get_material());
+	vector<char> lights_changed(n_lights, 0);
+	bool any_light = false;
+	for (int l = 0; l < n_lights; l++) {
+		lights_changed[l] = !same_light(cache->lights[l], lights[l]);
+		any_light |= lights_changed[l];
+	}
+	// culling decides the candidate lights by position and intensity
+	if (light_grid != nullptr && any_light)
+		return ret;
+
+	for (size_t t = 0; t < ret.size(); t++) {
+		const TileDeps &deps = cache->tiles[t];
+		bool dirty = false;
+		for (int m = 0; m < n_meshes && !dirty; m++)
+			dirty = deps.meshes[m] && meshes_changed[m];
+		for (int l = 0; l < n_lights && !dirty; l++)
+			dirty = deps.lights[l] && lights_changed[l];
+		for (size_t k = 0; k < deps.cells.size() && !dirty; k++)
+			dirty = (deps.cells[k] & cache->moved.cells[k]) != 0;
+		ret[t] = !dirty;
+	}
+	return ret;
+}
+
+void RayTracer::setTileCache(bool enabled) {
+	tile_cache_enabled = enabled;
+	if (!enabled) {
+		delete tile_cache;
+		tile_cache = nullptr;
+	}
+}
+
+/* Does light a have the position and shape of light b? */
+static bool same_geometry(const Light &a, const Light &b) {
+	return a.shape == b.shape && a.position.distance(b.position) == 0 && a.radius == b.radius &&
+		a.edge_u.distance(b.edge_u) == 0 && a.edge_v.distance(b.edge_v) == 0;
+}
+
+Vec3d ** RayTracer::relight() {
+	assert(relight_cache != nullptr);
+	Timer timer;
+	{
+		lock_guard<mutex> lock(stats_mutex);
+		stats.resetCounters();
+	}
+	RelightCache &cache = *relight_cache;
+	int height = cache.height, width = cache.width;
+
+	// Lights that moved need new shadow rays
+	vector<int> moved;
+	for (int l = 0; l < n_lights; l++) {
+		if (!same_geometry(cache.lights[l], lights[l]))
+			moved.push_back(l);
+		cache.lights[l] = lights[l];
+	}
+	// the culling radii follow the light positions and intensities
+	if (light_grid != nullptr) {
+		lock_guard<mutex> lock(stats_mutex);
+		update_light_grid();
+	}
+
+	Vec3d **pixels = new Vec3d*[height];
+	for (int i = 0; i < height; i++)
+		pixels[i] = new Vec3d[width];
+
+	pool->run(height, [&](int i) {
+		RenderStats::local().reset();
+		for (int j = 0; j < width; j++) {
+			PixelPaths &paths = cache.pixels[i * width + j];
+			for (size_t n = 0; n < paths.nodes.size(); n++) {
+				if (paths.nodes[n].memo < 0)
+					continue;
+				for (size_t l = 0; l < moved.size(); l++)
+					paths.visibility[paths.nodes[n].memo + moved[l]] = -1.f;
+			}
+			for (size_t r = 0; r < paths.roots.size(); r++)
+				pixels[i][j] += colorRGBItoRGB(replay(paths, paths.roots[r]));
+			if (!paths.roots.empty())
+				pixels[i][j] /= paths.roots.size();
+		}
+		mergeStats(RenderStats::local());
+	});
+
+	lock_guard<mutex> lock(stats_mutex);
+	stats.seconds[RenderStats::RENDERING] = timer.seconds();
 	return pixels;
 }
 
+const Vec4d RayTracer::replay(PixelPaths &paths, int k) const {
+	const PathNode &node = paths.nodes[k];
+	if (node.kind == PathNode::TERMINATED)
+		return { 0,0,0,0 };
+	if (node.kind == PathNode::MISS)
+		return { 0,0,0,1 };
+
+	Vec4d colors[3];
+	int n = 0;
+	if (node.reflected >= 0)
+		colors[n++] = replay(paths, node.reflected);
+	if (node.refracted >= 0)
+		colors[n++] = replay(paths, node.refracted);
+	colors[n++] = shadow(Ray(node.pos, node.direction, 1), node.face, node.pos,
+		node.memo >= 0 ? &paths.visibility[node.memo] : nullptr);
+	return n == 1 ? colors[0] : setFinalColor(colors, n);
+}
+
+void RayTracer::setLeafClassification(bool enabled) {
+	leaf_classes = enabled;
+	delete leaf_visibility;
+	leaf_visibility = nullptr;
+}
+
+void RayTracer::setIrradianceCache(double radius) {
+	irradiance_radius = radius;
+	delete irradiance_cache;
+	irradiance_cache = nullptr;
+}
+
+void RayTracer::setShadowMaps(int resolution) {
+	shadow_map_res = resolution;
+	for (size_t l = 0; l < shadow_maps.size(); l++)
+		delete shadow_maps[l];
+	shadow_maps.clear();
+}
+
+void RayTracer::update_shadow_maps() const {
+	shadow_maps.resize(n_lights, nullptr);
+	for (int l = 0; l < n_lights; l++) {
+		ShadowMap *&map = shadow_maps[l];
+		if (map != nullptr && (lights[l].shape != Light::POINT || !(map->getPosition() == lights[l].position))) {
+			delete map;
+			map = nullptr;
+		}
+		if (map == nullptr && lights[l].shape == Light::POINT)
+			map = new ShadowMap(lights[l].position, meshes, n_meshes, shadow_map_res, *pool);
+	}
+}
+
+void RayTracer::setRelightCache(bool enabled) {
+	relight_enabled = enabled;
+	if (!enabled) {
+		delete relight_cache;
+		relight_cache = nullptr;
+	}
+}
+
+void RayTracer::setProgressive(bool enabled, double _budget) {
+	progressive = enabled;
+	budget = _budget;
+}
+
+Vec3d ** RayTracer::heatmap(int view) const {
+	lock_guard<mutex> lock(stats_mutex);
+	assert(view < (int)costs.size());
+	return ::heatmap(costs[view], cost_sizes[view].first, cost_sizes[view].second);
+}
+
 Vec4d RayTracer::shadow(const Ray &incident, const Face& face, const Vec3d &intersection_pos) const {
+	return shadow(incident, face, intersection_pos, nullptr);
+}
+
+Vec4d RayTracer::shadow(const Ray &incident, const Face& face, const Vec3d &intersection_pos, float *memo) const {
+	RenderStats &local = RenderStats::local();
 	Vec3d view = -(incident.getDirection());
 	view.normalize();
-	Vec4d *results = new Vec4d[n_lights];
-	for (int i = 0; i < n_lights; i++) {
-		Vec3d shad_dir = lights[i].position - intersection_pos;
-		shad_dir.normalize();
-		Ray shad (intersection_pos, shad_dir, 1.0f);
-		Face destf;	Vec3d destv;
-		if (intersect(shad, destf, destv)
-			&& intersection_pos.distance(destv) < intersection_pos.distance(lights[i].position)) {
-			results[i] = { 0, 0, 0, face.material->getopacity() };
-			continue;
+
+	// Candidate lights: the ones above the culling threshold
+	thread_local vector<int> candidates;
+	candidates.clear();
+	if (light_grid != nullptr)
+		light_grid->query(intersection_pos, candidates);
+	else {
+		for (int i = 0; i < n_lights; i++)
+			candidates.push_back(i);
+	}
+	local.lights_culled += n_lights - candidates.size();
+	TileRecorder &recorder = local_recorder();
+	if (recorder.deps != nullptr) {
+		for (size_t i = 0; i < candidates.size(); i++)
+			recorder.deps->lights[candidates[i]] = 1;
+	}
+
+	// primary hits may look up the shadow maps
+	bool mapped = shadow_map_res > 0 && incident.getCollisions() == 0;
+
+	int n_results = candidates.size();
+	if (light_samples > 0 && light_samples < n_results)
+		n_results = light_samples;
+	if (n_results == 0)
+		return { 0,0,0,0 };
+
+	// Irradiance cache: the visibility the records around agree on, used as if memoized
+	thread_local vector<float> cached, own_memo;
+	bool covered = true;
+	if (irradiance_cache != nullptr) {
+		cached.assign(n_lights, -1.f);
+		covered = irradiance_cache->lookup(intersection_pos, face.normal, cached.data());
+		if (memo == nullptr) {
+			own_memo.assign(n_lights, -1.f);
+			memo = own_memo.data();
+		}
+		for (size_t i = 0; i < candidates.size(); i++) {
+			int l = candidates[i];
+			if (memo[l] >= 0 || cached[l] < 0)
+				continue;
+			memo[l] = cached[l];
+			local.irradiance_interpolated++;
+			if (recorder.deps != nullptr)
+				mark_segment(recorder.deps->cells, recorder.low, recorder.high, intersection_pos, lights[l].position);
 		}
+	}
 
-		shad.attenuate(lights[i].position);
-		double att = shad.getIntensity();
-		Vec3d refl_dir = intersection_pos - lights[i].position;
-		refl_dir.normalize();
-		Ray refl = Ray(lights[i].position, refl_dir).reflect(face, intersection_pos);
-
-		Vec4d diffuse, specular;
-		diffuse = lights[i].color *
-			face.material->getcolor() *
-			fmax(shad_dir.dot(face.normal), 0);
-		diffuse[3] = 1;
-
-		double shininess = face.material->getmirror() < 0.95 ?
-			1 / (1 - face.material->getmirror()) * 10:
-			200.;
-		specular = lights[i].color *
-			pow(fmax(view.dot(refl.getDirection()), 0), shininess);
-		specular[3] = 1;
-		results[i] = diffuse + specular;
-		for (int j = 0; j < 3; j++)
-			results[i][j] = results[i][j] > 1.f ? 1.f : results[i][j];
-		results[i][A] = att * lights[i].color[A] * face.material->getopacity();
+	Vec4d *results = new Vec4d[n_results];
+
+	if (n_results == (int)candidates.size()) {
+		for (int i = 0; i < n_results; i++)
+			results[i] = shade_light(view, face, intersection_pos, lights[candidates[i]],
+				memo != nullptr ? memo + candidates[i] : nullptr, mapped);
+	}
+	else {
+		// Importance sampling by estimated contribution, intensity * falloff.
+		// The final colour is the weight-normalized sum, so every sample is
+		// weighted by 1 / pdf; the common factor is divided out below.
+		mt19937 &gen = local_rng();
+		thread_local vector<double> cdf;
+		cdf.clear();
+		double total = 0;
+		for (size_t i = 0; i < candidates.size(); i++) {
+			const Light &light = lights[candidates[i]];
+			total += light.color[A] * Ray::falloff(light.position.distance(intersection_pos));
+			cdf.push_back(total);
+		}
+		if (total <= 0) {
+			delete[] results;
+			return { 0,0,0,0 };
+		}
+
+		uniform_real_distribution<double> uniform(0., total);
+		double max_weight = 0;
+		for (int s = 0; s < n_results; s++) {
+			size_t k = upper_bound(cdf.begin(), cdf.end(), uniform(gen)) - cdf.begin();
+			k = k < cdf.size() ? k : cdf.size() - 1;
+			double pdf = (cdf[k] - (k > 0 ? cdf[k - 1] : 0)) / total;
+			results[s] = shade_light(view, face, intersection_pos, lights[candidates[k]],
+				memo != nullptr ? memo + candidates[k] : nullptr, mapped);
+			results[s][A] /= pdf;
+			max_weight = fmax(max_weight, results[s][A]);
+		}
+		for (int s = 0; s < n_results; s++)
+			results[s][A] = max_weight > 0 ? results[s][A] / max_weight : 0;
+		local.lights_sampled += n_results;
 	}
 
-	Vec4d ret = setFinalColor(results, n_lights);
+	Vec4d ret = setFinalColor(results, n_results);
 	delete[] results;
+
+	// a new record where the records around were too few, with the visibility computed here
+	if (!covered) {
+		for (int l = 0; l < n_lights; l++)
+			cached[l] = cached[l] >= 0 ? -1.f : memo[l];
+		irradiance_cache->insert(intersection_pos, face.normal, cached.data());
+		local.irradiance_records++;
+	}
 	return ret;
 }
 
-static const Ray find_primary_ray(int h, int w, const Camera &camera) {
+Vec4d RayTracer::shade_light(const Vec3d &view, const Face &face, const Vec3d &intersection_pos, const Light &light,
+	float *memo, bool mapped) const {
+	double vis = memo != nullptr && *memo >= 0 ? *memo : visibility(intersection_pos, light, &face, mapped);
+	if (memo != nullptr)
+		*memo = vis;
+	if (vis == 0) {
+		return { 0, 0, 0, face.material->getopacity() };
+	}
+
+	Vec3d shad_dir = light.position - intersection_pos;
+	shad_dir.normalize();
+	Ray shad (intersection_pos, shad_dir, 1.0f);
+
+	shad.attenuate(light.position);
+	double att = shad.getIntensity();
+	Vec3d refl_dir = intersection_pos - light.position;
+	refl_dir.normalize();
+	Ray refl = Ray(light.position, refl_dir).reflect(face, intersection_pos);
+
+	Vec4d diffuse, specular;
+	diffuse = light.color *
+		face.material->getcolor() *
+		fmax(shad_dir.dot(face.normal), 0);
+	diffuse[3] = 1;
+
+	double shininess = face.material->getmirror() < 0.95 ?
+		1 / (1 - face.material->getmirror()) * 10:
+		200.;
+	specular = light.color *
+		pow(fmax(view.dot(refl.getDirection()), 0), shininess);
+	specular[3] = 1;
+	Vec4d result = diffuse + specular;
+	for (int j = 0; j < 3; j++)
+		result[j] = result[j] > 1.f ? 1.f : result[j];
+	result[A] = att * light.color[A] * face.material->getopacity();
+
+	// penumbra: blend the lit part with the shadowed part
+	if (vis < 1) {
+		double lit = result[A] * vis;
+		double dark = face.material->getopacity() * (1 - vis);
+		for (int j = 0; j < 3; j++)
+			result[j] = lit + dark > 0 ? result[j] * lit / (lit + dark) : 0;
+		result[A] = lit + dark;
+	}
+	return result;
+}
+
+double RayTracer::visibility(const Vec3d &pos, const Light &light, const Face *face, bool mapped) const {
+	if (light.shape == Light::POINT) {
+		int l = &light - lights;
+		RenderStats &local = RenderStats::local();
+		TileRecorder &recorder = local_recorder();
+		// the face's leaf may be known to be lit or shadowed as a whole
+		if (face != nullptr && leaf_visibility != nullptr && paged.empty()) {
+			LeafVisibility::Class cls = leaf_visibility->lookup(*face, pos, l);
+			if (cls != LeafVisibility::MIXED) {
+				(cls == LeafVisibility::LIT ? local.leaves_lit : local.leaves_shadowed)++;
+				if (recorder.deps != nullptr)
+					mark_segment(recorder.deps->cells, recorder.low, recorder.high, pos, light.position);
+				return cls == LeafVisibility::LIT ? 1. : 0.;
+			}
+		}
+		if (face != nullptr && mapped && paged.empty() && l < (int)shadow_maps.size() && shadow_maps[l] != nullptr) {
+			// the map decides unless its texels disagree
+			local.shadow_map_lookups++;
+			double lit = shadow_maps[l]->lookup(pos, face->normal);
+			if (lit == 0 || lit == 1) {
+				if (recorder.deps != nullptr)
+					mark_segment(recorder.deps->cells, recorder.low, recorder.high, pos, light.position);
+				return lit;
+			}
+			local.shadow_map_fallbacks++;
+		}
+		return occluded(pos, light.position, l) ? 0. : 1.;
+	}
+
+	int n = soft_min_strata * soft_min_strata;
+	int visible = sample_visibility(pos, light, soft_min_strata);
+	if ((visible == 0 || visible == n) || soft_max_strata <= soft_min_strata)
+		return (double)visible / n;
+
+	// the samples disagree: refine the penumbra
+	RenderStats::local().penumbra_refinements++;
+	visible += sample_visibility(pos, light, soft_max_strata);
+	n += soft_max_strata * soft_max_strata;
+	return (double)visible / n;
+}
+
+int RayTracer::sample_visibility(const Vec3d &pos, const Light &light, int strata) const {
+	mt19937 &gen = local_rng();
+	uniform_real_distribution<double> jitter(0., 1.);
+	int visible = 0;
+	for (int i = 0; i < strata; i++) {
+		for (int j = 0; j < strata; j++) {
+			double s = (i + jitter(gen)) / strata;
+			double t = (j + jitter(gen)) / strata;
+			Vec3d sample;
+			if (light.shape == Light::QUAD)
+				sample = light.position + (s - 0.5) * light.edge_u + (t - 0.5) * light.edge_v;
+			else {
+				// stratified in (z, phi), folded onto the hemisphere facing pos
+				double z = 1 - 2 * s;
+				double phi = 2 * M_PI * t;
+				double rxy = sqrt(fmax(0., 1 - z * z));
+				Vec3d dir(rxy * cos(phi), rxy * sin(phi), z);
+				if (dir.dot(pos - light.position) < 0)
+					dir = -dir;
+				sample = light.position + light.radius * dir;
+			}
+			visible += !occluded(pos, sample, &light - lights);
+		}
+	}
+	return visible;
+}
+
+bool RayTracer::occluded(const Vec3d &from, const Vec3d &to, int light) const {
+	RenderStats &local = RenderStats::local();
+	local.shadow_rays++;
+	Vec3d shad_dir = to - from;
+	shad_dir.normalize();
+	Ray shad(from, shad_dir, 1.0f);
+	double dist = from.distance(to);
+	TileRecorder &recorder = local_recorder();
+	if (recorder.deps != nullptr)
+		mark_segment(recorder.deps->cells, recorder.low, recorder.high, from, to);
+	// the tile depends on the blocking face's mesh
+	auto blocked_by = [&](const Face *face) {
+		if (recorder.deps != nullptr) {
+			int m = mesh_of(*face);
+			if (m >= 0 && m < n_meshes)
+				recorder.deps->meshes[m] = 1;
+		}
+		return true;
+	};
+
+	// Any blocking face will do: try the cached occluder and its node first
+	OccluderCache::Entry *cached = nullptr;
+	if (occluder_cache && geometry == nullptr) {
+		cached = &local_occluder(id, n_lights, light);
+		local.occluder_lookups++;
+		if (cached->face != nullptr) {
+			double r = intersect_face(shad, *cached->face);
+			local.triangle_tests++;
+			if (r != -1 && r < dist) {
+				local.occluder_hits++;
+				return blocked_by(cached->face);
+			}
+
+			unsigned n_faces = cached->node != (unsigned)-1 ? octree->getFaceCount(cached->node) : 0;
+			local.triangle_tests += n_faces;
+			for (unsigned i = 0; i < n_faces; i++) {
+				const Face *face = octree->getFace(cached->node, i);
+				r = intersect_face(shad, *face);
+				if (r != -1 && r < dist) {
+					cached->face = face;
+					local.occluder_node_hits++;
+					return blocked_by(face);
+				}
+			}
+		}
+	}
+
+	double r;
+	unsigned node;
+	Face built;
+	const Face *face = octree->getNearestFace(shad, r, built, &node);
+	if (face != nullptr)
+		local.hits++;
+	else
+		local.misses++;
+
+	bool blocked = face != nullptr && r < dist;
+	if (blocked && cached != nullptr) {
+		cached->face = face;
+		cached->node = node;
+	}
+	if (blocked)
+		return blocked_by(face);
+	for (size_t p = 0; p < paged.size(); p++) {
+		if (paged[p]->occluded(shad, dist))
+			return true;
+	}
+	return false;
+}
+
+void RayTracer::setSoftShadowSamples(int min_samples, int max_samples) {
+	soft_min_strata = (int)sqrt((double)min_samples);
+	soft_max_strata = (int)sqrt((double)max_samples);
+	soft_min_strata = soft_min_strata < 1 ? 1 : soft_min_strata;
+}
+
+void RayTracer::setAntialiasing(int min_samples, int max_samples, double contrast) {
+	aa_min_strata = min_samples > 0 ? (int)sqrt((double)min_samples) : 0;
+	aa_max_strata = max_samples > 0 ? (int)sqrt((double)max_samples) : 0;
+	aa_contrast = contrast;
+}
+
+void RayTracer::setLightCulling(double threshold) {
+	light_cull = threshold;
+	delete light_grid;
+	light_grid = nullptr;
+	if (threshold > 0) {
+		light_grid = new LightGrid(lights, n_lights, threshold, octree->getLowest(), octree->getHighest());
+		grid_lights.assign(lights, lights + n_lights);
+	}
+}
+
+void RayTracer::update_light_grid() const {
+	for (int l = 0; l < n_lights; l++) {
+		if (same_light(grid_lights[l], lights[l]))
+			continue;
+		delete light_grid;
+		light_grid = new LightGrid(lights, n_lights, light_cull, octree->getLowest(), octree->getHighest());
+		grid_lights.assign(lights, lights + n_lights);
+		return;
+	}
+}
+
+static const Ray find_primary_ray(double h, double w, const Camera &camera) {
 	// init vars
 	Vec3d origin = camera.position;
 	double h_max = camera.zNear * tan(camera.fovy / 2);
@@ -254,52 +1529,6 @@ static const Ray find_primary_ray(int h, int w, const Camera &camera) {
 	return Ray(origin, ray_dir, 1);
 }
 
-static bool intersect_face(const Ray &ray, const Face &face, Vec3d &ret_vec) {
-	Vec3d n = face.normal;
-
-	// parallel test
-	// It does not consider when the ray is INSIDE the face plane
-	double r = n.dot(ray.getDirection());
-	if (abs(r) < 2 * FLT_EPSILON)
-		return false;
-
-	Vec3d v0 = *face.vertices[0];
-	Vec3d p0 = ray.getOrigin();
-	r = (n.dot(v0 - p0)) / r;
-
-	// direction test
-	if (r < 16 * FLT_EPSILON) {
-		return false;
-	}
-
-	Vec3d p_i = p0 + r * ray.getDirection();
-
-	Vec3d u = *face.vertices[1] - *face.vertices[0];
-	Vec3d v = *face.vertices[2] - *face.vertices[0];
-	Vec3d w = p_i - v0;
-
-	double uv = u.dot(v);	double wv = w.dot(v);
-	double vv = v.dot(v);	double wu = w.dot(u);
-	double uu = u.dot(u);
-	double uv2_uuvv = uv * uv - uu * vv;
-
-	if (uv2_uuvv == 0.f)
-		return false;
-
-	double s = (uv * wv - vv * wu) / uv2_uuvv;
-	double t = (uv * wu - uu * wv) / uv2_uuvv;
-
-	// s, t range test
-	if (s < -0.f || t < -0.f || s + t > 1) {
-		return false;
-	}
-
-	// Now we know that the ray intersects with the face
-	ret_vec = v0 + s * u + t * v;
-	assert(ret_vec.distance(ray.getOrigin()) > 10*FLT_EPSILON);
-	return true;
-}
-
 static Vec3d colorRGBItoRGB(const Vec4d &rgbi) {
 	// verifying
 	for (int i = 0; i < 3; i++)
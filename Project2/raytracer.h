@@ -5,22 +5,105 @@
 #include "mesh.h"
 #include "ray.h"
 #include "octree.h"
+#include "bruteforce.h"
+#include "lightgrid.h"
+#include "stats.h"
+#include "heatmap.h"
+#include "workerpool.h"
+#include "raster.h"
+#include "shadowmap.h"
+#include "leafvisibility.h"
+#include "irradiancecache.h"
+#include "compressedgeometry.h"
+#include "pagedmesh.h"
+#include "tileorder.h"
 #include "definitions.h"
 
+#include <functional>
+#include <vector>
+#include <utility>
+#include <mutex>
+
+struct PixelPaths;
+struct RelightCache;
+struct TileCache;
+
 /* RayTracer enables rendering based on more realistic optically modelled technique
- * It uses back-propagating rays from eye(camera) to the lights. */
+ * It uses back-propagating rays from eye(camera) to the lights.
+ * The scene (meshes, lights, octree) is fixed at construction. render() keeps
+ * no state outside its call but the statistics, so several cameras can be
+ * rendered in one call or from several threads at once; they share the worker
+ * pool and the per-thread caches. */
 class RayTracer {
+public:
+	/* Geometry of a mesh as the octree was built from it */
+	struct MeshState {
+		double checksum;		// of the vertex positions
+		Vec3d low, high;		// bounding box
+	};
+
+	/* Called by render() after every pass with the framebuffer of every view,
+	 * the view index, the pass number (from 0) and the seconds spent so far. */
+	typedef function<void(Vec3d **pixels, int view, int pass, double seconds)> SnapshotHook;
+
 private:
 	Octree   *octree;
+	CompressedGeometry *geometry;	// the octree's leaf geometry, nullptr for the meshes' faces
+	BruteForce *reference;	// brute-force intersector behind intersect_slow(), nullptr if compressed
 	Mesh     *meshes;
+	vector<PagedMesh *> paged;	// out-of-core meshes, traced beside the octree
 	Light    *lights;
 	Camera    camera;
 
 	int n_meshes;
 	int n_lights;
 
+	WorkerPool *pool;			// render threads, shared by all render() calls
+	mutable RenderStats stats;	// counters of the last frame, merged from the worker threads
+	mutable vector<double **> costs;	// per-pixel costs of the last frame, per view
+	mutable vector<pair<int, int> > cost_sizes;	// height, width of costs
+	HeatmapMode heatmap_mode;	// per-pixel cost recorded by render()
+	mutable LightGrid *light_grid;	// light culling, nullptr shades with every light
+	mutable vector<Light> grid_lights;	// the lights as light_grid was built for
+	double light_cull;			// light culling threshold
+	int light_samples;			// lights sampled per hit, 0 shades with every candidate
+	int soft_min_strata;		// area lights: strata per axis of the first shadow-ray pass
+	int soft_max_strata;		// area lights: strata per axis in the penumbra
+	bool occluder_cache;		// test the last occluder per light before traversal
+	int aa_min_strata;			// anti-aliasing: strata per axis of every pixel, 0 disables it
+	int aa_max_strata;			// anti-aliasing: strata per axis added on edges
+	double aa_contrast;			// anti-aliasing: colour difference that marks an edge
+	bool progressive;			// coarse-to-fine passes
+	double budget;				// render() time budget in seconds, 0 for none
+	SnapshotHook snapshot;		// called after every pass, may be empty
+	bool relight_enabled;		// record the ray trees of every frame
+	mutable RelightCache *relight_cache;	// ray trees of the last frame, nullptr if none
+	bool tile_cache_enabled;	// keep finished tiles and their dependencies
+	mutable TileCache *tile_cache;	// tiles of the last frame, nullptr if none
+	vector<MeshState> mesh_states;	// per mesh, as of the last build()
+	bool rasterize;				// primary hits from a rasterization pre-pass
+	int shadow_map_res;			// texels per cube face side of the shadow maps, 0 for none
+	mutable vector<ShadowMap *> shadow_maps;	// per light, nullptr for area lights; built by render()
+	mutable mutex build_mutex;	// guards the shadow maps and leaf classes render() builds on the pool,
+								// as the workers take stats_mutex after every tile of another render()
+	bool leaf_classes;			// skip shadow rays in leaves lit or shadowed as a whole
+	mutable LeafVisibility *leaf_visibility;	// built by render(), nullptr if none
+	double irradiance_radius;	// validity radius of the irradiance cache records, 0 for no cache
+	mutable IrradianceCache *irradiance_cache;	// filled by render(), nullptr if none
+	double lod_bias;			// faces wanted per covered pixel by selectLevels(), 0 for full meshes
+	bool compressed;			// the octree tests compressed geometry
+	bool lazy;					// octree nodes are divided by the first ray to enter them
+	TileOrder tile_order;		// order render() issues the work tiles in
+	int tile_size;				// work tile side in pixels, unless scanline
+	unsigned id;				// tells this instance's per-thread caches apart
+
 public:
-	RayTracer(Mesh *_meshes, int n_meshes, Light *_lights, int n_lights, const Camera &_camera); // initializer
+	/* lazy_octree: build only the octree's root, and every node as rays
+	 * first enter it while rendering (see Octree); unseen parts of the scene
+	 * are never built. The image is the same either way. */
+	RayTracer(Mesh *_meshes, int n_meshes, Light *_lights, int n_lights, const Camera &_camera,
+		bool lazy_octree = false); // initializer
+	~RayTracer();
 
 	/* intersection() gives whether the ray intersects with faces in the space.
 	 * params: ray      - the ray casted
@@ -35,11 +118,28 @@ public:
 	 * params: ray       - the ray that will be casted
 	 *					 - the last ray casted recursively
 	 *         prev_face - the face that ray origin resides
+	 *         hit_mesh  - if not null, set to the index of the mesh hit, -1 for none
+	 *         paths     - if not null, the ray tree is appended to it (relight cache)
+	 *         primary   - if not null, the ray's nearest hit, found by rasterization;
+	 *                     the ray is traced if it has no face
 	 * return value: RGB color of the ray casted           */
-	const Vec4d cast(const Ray &ray, int depth) const;
+	const Vec4d cast(const Ray &ray, int depth, int *hit_mesh = nullptr, PixelPaths *paths = nullptr,
+		const PrimaryHit *primary = nullptr) const;
 
-	/* render() triggers the whole rendering process. It returns pixels. */
+	/* render() triggers the whole rendering process. It returns pixels,
+	 * [height][width], allocated with new[]. Without a camera it renders the
+	 * one given at construction; with several it renders all of them in one
+	 * batch, every pass over all views, and returns the pixels per view. */
 	Vec3d **render() const;
+	Vec3d **render(const Camera &view_camera) const;
+	vector<Vec3d **> render(const vector<Camera> &cameras) const;
+
+	/* Traversal-cost heatmap. With a mode other than HEATMAP_NONE, render() also
+	 * records the chosen cost of every pixel's ray tree; heatmap() turns the costs
+	 * of a view of the last render into an image with a legend. */
+	void setHeatmapMode(HeatmapMode mode) { heatmap_mode = mode; }
+	HeatmapMode getHeatmapMode() const { return heatmap_mode; }
+	Vec3d **heatmap(int view = 0) const;
 
 	/* params:
 	 *   (Ray)incident : incident ray
@@ -48,4 +148,168 @@ public:
 	 * return:
 	 *   (Vec4f) Color vector + intensity (RGBI)         */
 	Vec4d shadow(const Ray &incident, const Face& face, const Vec3d &intersection_pos) const;
+
+	/* Many-light shading.
+	 * setLightCulling(): lights whose intensity * falloff at the hit point stays below
+	 *   threshold are skipped, neither shaded nor shadow-tested. 0 disables culling.
+	 * setLightSampling(): instead of every remaining light, shade `samples` lights per
+	 *   hit, drawn in proportion to their intensity * falloff. 0 disables sampling. */
+	void setLightCulling(double threshold);
+	void setLightSampling(int samples) { light_samples = samples; }
+
+	/* Soft shadows of area lights. Every hit first takes min_samples stratified
+	 * shadow rays over the light; only where they disagree (the penumbra) it
+	 * takes max_samples more. Both are rounded down to square numbers. */
+	void setSoftShadowSamples(int min_samples, int max_samples);
+
+	/* Adaptive anti-aliasing. Every pixel first takes min_samples jittered,
+	 * stratified primary rays. Only pixels on an edge take max_samples more: the
+	 * ones whose samples hit different meshes, or whose colour or hit mesh differs
+	 * from a neighbour's (any channel by more than contrast). Both are rounded
+	 * down to square numbers. min_samples 0, the default, traces one ray through
+	 * every pixel corner. */
+	void setAntialiasing(int min_samples, int max_samples, double contrast = 0.1);
+
+	/* Progressive rendering. render() first traces one pixel per 8x8 block, then
+	 * refines with 4x4 and 2x2 blocks down to single pixels, and finally takes the
+	 * anti-aliasing samples. After every pass untraced pixels show the colour of
+	 * their block, and the complete image is the same as without progressive
+	 * rendering. With a budget > 0 seconds render() skips every pass not
+	 * expected to end in time (the coarsest one always runs), so it may return
+	 * a coarser image. The budget applies to non-progressive anti-aliasing too. */
+	void setProgressive(bool enabled, double budget = 0);
+	void setSnapshotHook(const SnapshotHook &hook) { snapshot = hook; }
+
+	/* Relighting cache for light and material edits. When enabled, render() of
+	 * a single camera also keeps every pixel's ray trees: the faces and points
+	 * hit by the primary, mirror and refraction rays, and the visibility of each
+	 * light from the hit points. relight() shades the last frame again with the
+	 * current light colours and positions and material colours, without
+	 * casting a ray. Only moved lights take new shadow rays. Edits that change
+	 * geometry, mirror or opacity need a new render(). The number of lights
+	 * must stay the same. */
+	void setRelightCache(bool enabled);
+	Vec3d **relight();
+
+	/* Tile cache for iterative scene edits. When enabled, render() of a single
+	 * camera keeps the finished 16x16 tiles, with the meshes and lights their
+	 * rays touched and the cells of a coarse grid over the scene that the rays
+	 * crossed. The next render() re-traces only tiles that touched an edited
+	 * material or light, or crossed the space a moved mesh left or entered, and
+	 * reuses the others. Camera and setting changes invalidate every tile.
+	 * getStats() reports the reused tiles. */
+	void setTileCache(bool enabled);
+
+	/* Rebuilds the octree after meshes were moved (Mesh::transform()); not
+	 * over compressed geometry, which has freed them */
+	void updateGeometry();
+
+	/* Hybrid primary visibility. When enabled, render() first rasterizes every
+	 * face into a visibility buffer per view (see VisibilityBuffer), and the
+	 * primary rays start from its hits instead of traversing the octree; only
+	 * shadow, mirror and refraction rays, and the primary rays with no hit
+	 * between the clip planes, are traced. Anti-aliasing with
+	 * min_samples > 0 jitters the primary rays, so it traces them as usual. */
+	void setRasterization(bool enabled) { rasterize = enabled; }
+
+	/* Approximate shadows from shadow maps. With a resolution > 0, render()
+	 * rasterizes a cube shadow map of that many texels per side around every
+	 * point light, again whenever the light moved. Primary hits look up their
+	 * point lights' shadows there, filtered over 3x3 texels; where the texels
+	 * disagree, and on mirror and refraction paths, shadow rays decide as
+	 * usual. Area lights always use shadow rays. 0 disables the maps. */
+	void setShadowMaps(int resolution);
+
+	/* Leaf visibility classes for static scenes. When enabled, render()
+	 * classifies the octree leaves per point light as lit, shadowed or mixed
+	 * (see LeafVisibility), and hits in lit or shadowed leaves take no shadow
+	 * ray. The result is the same as without. The classes are kept with the
+	 * octree and redone only for moved lights, or after updateGeometry(). */
+	void setLeafClassification(bool enabled);
+
+	/* Irradiance cache. With a radius > 0, hits keep their light visibility
+	 * as records valid within the radius (see IrradianceCache), and later
+	 * hits on the same flat surface interpolate it from the records around
+	 * them wherever those agree, instead of tracing shadow rays. The records
+	 * are kept across frames until a light moves, or updateGeometry().
+	 * An approximation: small shadows between records may be missed. 0
+	 * disables the cache. */
+	void setIrradianceCache(double radius);
+
+	/* Levels of detail of meshes loaded with them (see Mesh). selectLevels()
+	 * gives every such mesh the coarsest level with at least bias faces per
+	 * pixel its bounding sphere covers in the view, and the full mesh when the
+	 * camera is inside the sphere, then rebuilds the octree if a level
+	 * changed. It applies to every later render(), so call it again when the
+	 * camera moves. Bias 0, the default, selects the full meshes. */
+	void setLevelOfDetail(double bias) { lod_bias = bias; }
+	void selectLevels(const Camera &view_camera);
+
+	/* Compressed geometry. When enabled, the octree is rebuilt over a
+	 * quantized copy of the triangles (see CompressedGeometry), which then
+	 * owns the geometry: the meshes' faces and vertices are freed, and a
+	 * face is built from the copy for every hit, with the decoded normal.
+	 * Hits move by at most 1/131070 of a mesh's extent. This is for good: the geometry can no
+	 * longer be updated, and what reads the meshes' faces is off (shadow
+	 * maps, leaf classes, the rasterization pre-pass, the occluder cache). */
+	void setCompressedGeometry(bool enabled);
+	size_t getGeometryBytes() const { return geometry != nullptr ? geometry->getBytes() : 0; }
+
+	/* Out-of-core meshes (see PagedMesh), not owned. Rays test them after
+	 * the octree, up to its hit; the rasterization pre-pass traces their
+	 * primary rays in batches per tile. Leaf classes and shadow maps only
+	 * know the octree's meshes, so shadow rays decide while there are any.
+	 * Tiles of the tile cache don't depend on them. */
+	void setPagedMeshes(const vector<PagedMesh *> &meshes) { paged = meshes; }
+
+	/* Shadow occluder cache: every worker thread remembers per light the face
+	 * that last blocked a shadow ray, and the octree node storing it. Shadow
+	 * rays test that face, then the rest of its node, before a full traversal.
+	 * Through a lazy octree only the face is kept, its nodes being unpacked.
+	 * On by default; the result is the same either way. */
+	void setOccluderCache(bool enabled) { occluder_cache = enabled; }
+
+	/* Work schedule. render() hands the worker threads square tiles of size
+	 * pixels in the order's curve (see order_tiles()), or one row of pixels
+	 * at a time with TILE_ORDER_SCANLINE; a thread traces its tile row by
+	 * row. Tiles traced one after another are neighbours, so their rays find
+	 * the same octree nodes and faces in the caches. While the tile cache
+	 * records, tiles are rounded up to whole cache tiles. Hilbert order and
+	 * 16 pixels by default. Anti-aliasing jitter and irradiance cache
+	 * records follow the order pixels are traced in; the image is otherwise
+	 * the same. */
+	void setTileOrder(TileOrder order, int size = 16) { tile_order = order; tile_size = size > 0 ? size : 1; }
+	TileOrder getTileOrder() const { return tile_order; }
+
+	/* Per-frame statistics. Counters are reset at the start of render(), phase
+	 * timings are kept. Concurrent render() calls add to the same counters. Phases outside the ray tracer (loading, encoding) are
+	 * added by the caller with recordPhase(). */
+	const RenderStats &getStats() const { return stats; }
+	void recordPhase(RenderStats::Phase phase, double seconds) { stats.seconds[phase] += seconds; }
+	void mergeStats(const RenderStats &local) const;
+
+private:
+	/* shadow() reading and filling memo, the visibility per light, if not null */
+	Vec4d shadow(const Ray &incident, const Face& face, const Vec3d &intersection_pos, float *memo) const;
+
+	/* Colour and weight of one light at the intersection, shadow ray included
+	 * unless the light's visibility is in memo (not null and >= 0) */
+	Vec4d shade_light(const Vec3d &view, const Face &face, const Vec3d &intersection_pos, const Light &light,
+		float *memo, bool mapped = false) const;
+
+	/* Visible fraction of the light from pos, in [0,1]. face, if not null, is
+	 * the face at pos, for the leaf classes and, if mapped, the shadow maps. */
+	double visibility(const Vec3d &pos, const Light &light, const Face *face = nullptr, bool mapped = false) const;
+	int sample_visibility(const Vec3d &pos, const Light &light, int strata) const;	// visible samples of strata^2
+
+	/* Colour of node k of a recorded ray tree with the current lights and materials */
+	const Vec4d replay(PixelPaths &paths, int k) const;
+
+	void build();									// octree and reference intersector of the meshes
+	int mesh_of(const Face &face) const;			// index of the face's mesh, -1 if none
+	vector<double> tile_settings() const;			// settings a cached tile was rendered with
+	void update_shadow_maps() const;				// (re)builds the maps of new or moved point lights, needs build_mutex
+	void update_light_grid() const;					// rebuilds light_grid if a light changed, needs stats_mutex
+	vector<char> reusable_tiles(const Camera &view_camera, int height, int width) const;	// per tile, needs stats_mutex
+	bool occluded(const Vec3d &from, const Vec3d &to, int light) const;		// is `to` on light blocked?
 };
\ No newline at end of file
@@ -0,0 +1,163 @@
+#include "scene.h"
+#include "definitions.h"
+
+#include <string>
+#include <map>
+#include <future>
+#include <new>
+#include <exception>
+
+constexpr int NUM_OBJS_TO_BE_RENDERED = 10;
+constexpr int NUM_LIGHTS = 2;
+
+/* What a mesh of the scene is loaded from: a file, or an analytic shape if file is nullptr */
+struct Part {
+	const char *file;
+	Mesh::Shape shape;
+	int material, model;
+	double dim;
+	bool pageable;		// out of core when the scene has a budget for it
+};
+
+static const Part parts[NUM_OBJS_TO_BE_RENDERED] = {
+	{ "bunny.off", Mesh::TRIANGLE, 0, 0, 1, true },
+	{ nullptr, Mesh::SQUARE, 1, 1, 10, false },		//mirror floor
+	{ nullptr, Mesh::SQUARE, 3, 3, 10, false },		//sky blue back board
+	{ nullptr, Mesh::SPHERE, 2, 2, 0.7, false },
+	{ "bunny.off", Mesh::TRIANGLE, 4, 4, 1, true },	// Transparent
+	{ nullptr, Mesh::SPHERE, 5, 5, 1, false },
+	{ nullptr, Mesh::SQUARE, 3, 6, 10, false },		// left wall
+	{ nullptr, Mesh::SQUARE, 3, 7, 10, false },		// right wall
+	{ nullptr, Mesh::SQUARE, 3, 8, 10, false },		// back wall
+	{ nullptr, Mesh::SQUARE, 3, 9, 10, false },		// ceiling
+};
+
+Scene::Scene(double img_height, size_t paged_budget)
+	: n_lights(NUM_LIGHTS) {
+	Material material[NUM_OBJS_TO_BE_RENDERED];
+	Mat4d models[NUM_OBJS_TO_BE_RENDERED];
+
+	material[0] = Material(Vec4d(1., 1., 1., 1), 100.0, 0.);   // Material property
+	material[1] = Material(Vec4d(0.9, 0.9, 0.9, 1), 100.0, 1.);
+	material[2] = Material(Vec4d(1., 0., 0., 1), 100.0, 0.0);
+	material[3] = Material(Vec4d(0.663, 0.875, 0.929, 1), 100.0, 0.0);
+	material[4] = Material(Vec4d(1., 1.0, 1.0, 0.), 1.4, 0.0);
+	material[5] = Material(Vec4d(0., 1., 0., 1), 100.0, 0.0);
+
+	models[0] = translate(Vec3d(0, 0., 0));   // Model transform matrix
+	models[1] = translate(Vec3d(0, -0.5, 0));
+	models[2] = translate(Vec3d(-0.3, 1., 0.3)) * rotate(M_PI / 4, Vec3d(0, 1, 0));
+	models[3] = translate(Vec3d(0, 0, -2.5)) * rotate(M_PI / 2, Vec3d(1, 0, 0));
+	models[4] = translate(Vec3d(0.15, 0.25, 3.5));
+	models[5] = translate(Vec3d(0.3, 0.1, 1.));
+	models[6] = translate(Vec3d(-10, 0, 0)) * rotate(M_PI / 2, Vec3d(0,0,-1));
+	models[7] = translate(Vec3d(10, 0, 0)) * rotate(M_PI / 2, Vec3d(0,0,1));
+	models[8] = translate(Vec3d(0, 0, 10)) * rotate(M_PI / 2, Vec3d(1,0,0));
+	models[9] = translate(Vec3d(0, 10, 0)) * rotate(M_PI, Vec3d(1,0,0));
+
+	// Every file is read once, on a thread of its own, and every mesh built
+	// on another as soon as its file is read. Out-of-core meshes read their
+	// file only if it must be preprocessed again: the first of them to need it
+	// reads it on its own thread. Every task waits on a copy of the file's
+	// future, as one shared_future must not be used by several threads.
+	map<string, shared_future<MeshFile> > files;
+	for (int i = 0; i < NUM_OBJS_TO_BE_RENDERED; i++) {
+		const char *file = parts[i].file;
+		bool lod = paged_budget == 0 || !parts[i].pageable;		// in memory
+		if (file != nullptr && files.count(file) == 0)
+			files[file] = async(lod ? launch::async : launch::deferred,
+				[file, lod]() { return MeshFile(file, lod); }).share();
+	}
+
+	vector<int> in_memory, out_of_core;
+	for (int i = 0; i < NUM_OBJS_TO_BE_RENDERED; i++)
+		(paged_budget > 0 && parts[i].pageable ? out_of_core : in_memory).push_back(i);
+
+	vector<future<void> > loading;
+	paged.assign(out_of_core.size(), nullptr);
+	for (size_t p = 0; p < out_of_core.size(); p++) {
+		// the paged file, preprocessed again when the mesh file changed
+		shared_future<MeshFile> file = files.at(parts[out_of_core[p]].file);
+		loading.push_back(async(launch::async, [&, p, file]() {
+			const Part &part = parts[out_of_core[p]];
+			const Material &mat = material[part.material];
+			const Mat4d &model = models[part.model];
+			string path = string(part.file) + "." + to_string(p) + ".paged";
+			unsigned long long key = PagedMesh::key(part.file, model, part.dim);
+			PagedMesh *mesh = new PagedMesh(path.c_str(), mat, paged_budget, key);
+			if (!mesh->isOpen()) {
+				delete mesh;
+				Mesh full(file.get(), mat, model, part.dim);
+				PagedMesh::write(full, path.c_str(), key);
+				mesh = new PagedMesh(path.c_str(), mat, paged_budget, key);
+			}
+			paged[p] = mesh;
+		}));
+	}
+
+	n_meshes = in_memory.size();
+	meshes = static_cast<Mesh *>(::operator new(n_meshes * sizeof(Mesh)));	// built in place by the loading threads
+	vector<char> built(n_meshes, 0);
+	for (int m = 0; m < n_meshes; m++) {
+		const char *name = parts[in_memory[m]].file;
+		shared_future<MeshFile> file = name != nullptr ? files.at(name) : shared_future<MeshFile>();
+		loading.push_back(async(launch::async, [&, m, file]() {
+			const Part &part = parts[in_memory[m]];
+			const Material &mat = material[part.material];
+			const Mat4d &model = models[part.model];
+			if (part.file != nullptr)
+				new (&meshes[m]) Mesh(file.get(), mat, model, part.dim);
+			else
+				new (&meshes[m]) Mesh(part.shape, mat, model, part.dim, true);
+			built[m] = 1;
+		}));
+	}
+
+	// every task is waited for, then what was loaded goes if one failed
+	exception_ptr error;
+	for (size_t t = 0; t < loading.size(); t++) {
+		try {
+			loading[t].get();
+		}
+		catch (...) {
+			if (error == nullptr)
+				error = current_exception();
+		}
+	}
+	if (error != nullptr) {
+		for (int m = 0; m < n_meshes; m++) {
+			if (built[m])
+				meshes[m].~Mesh();
+		}
+		::operator delete(meshes);
+		for (size_t p = 0; p < paged.size(); p++)
+			delete paged[p];
+		rethrow_exception(error);
+	}
+
+	// Configure lights
+	lights = new Light[NUM_LIGHTS] {
+		Light(1, 6, 6, 1., 1., 1., 1),
+		Light(-1, 6, 6, 1., 1., 1., 1)
+	};
+
+	// Configure camera
+	camera = Camera(
+		0, 0, 9,	// eye
+		0, 0, 0,	// center
+		0, 1, 0,	// up
+		img_height,	// img height
+		60,			// fovy
+		1.,			// aspect
+		0.5, 10		// zNear, zFar
+	);
+}
+
+Scene::~Scene() {
+	for (int i = 0; i < n_meshes; i++)
+		meshes[i].~Mesh();
+	::operator delete(meshes);
+	delete[] lights;
+	for (size_t p = 0; p < paged.size(); p++)
+		delete paged[p];
+}
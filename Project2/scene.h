@@ -0,0 +1,31 @@
+#pragma once
+
+#include "vec.h"
+#include "material.h"
+#include "mesh.h"
+#include "pagedmesh.h"
+#include "definitions.h"
+
+/* Scene holds the meshes, lights and camera of the demo scene rendered by main.cpp:
+ * two bunnies and two spheres in a sky blue room with a mirror floor. The
+ * spheres, walls and floor are analytic primitives, the bunnies triangles
+ * with levels of detail. With a budget for out-of-core meshes, the bunnies
+ * are PagedMeshes instead, preprocessed into bunny.off.<i>.paged on first use.
+ * The benchmark loads the very same scene through it. Mesh files are looked up
+ * in the working directory. Loading is parallel: every file is read once, on
+ * a thread of its own (see MeshFile), and every mesh is built from it on
+ * another as soon as it is read, so loading takes as long as the slowest
+ * mesh rather than all of them. */
+struct Scene {
+	Mesh   *meshes;
+	int     n_meshes;
+	Light  *lights;
+	int     n_lights;
+	Camera  camera;
+	vector<PagedMesh *> paged;	// out-of-core meshes, none without a budget
+
+	// Loads the demo scene; img_height sets the camera's projected image height,
+	// paged_budget the bytes of the bunnies kept resident, 0 loads them as Meshes
+	Scene(double img_height = 360, size_t paged_budget = 0);
+	~Scene();
+};
@@ -0,0 +1,182 @@
+#include "shadowmap.h"
+
+#include <cmath>
+#include <cfloat>
+
+constexpr double SHADOW_MAP_NEAR = 1e-4;	// near plane of the cube faces
+constexpr double SHADOW_MAP_BIAS = 1.5;		// depth bias in texels, per unit of 1 + slope
+constexpr double SHADOW_MAP_MAX_SLOPE = 10.;
+
+ShadowMap::ShadowMap(const Vec3d &_position, Mesh *meshes, int n_meshes, int resolution, WorkerPool &pool)
+	: position(_position), res(resolution), depths(6 * resolution * resolution, FLT_MAX) {
+	vector<const Face *> faces;
+	for (int m = 0; m < n_meshes; m++) {
+		const Face *mesh_faces = meshes[m].get_const_faces();
+		for (int f = 0; f < meshes[m].get_size(); f++)
+			faces.push_back(mesh_faces + f);
+	}
+
+	// one cube face per worker
+	pool.run(6, [&](int side) {
+		int a = side / 2;
+		double s = side % 2 ? -1 : 1;
+		for (size_t f = 0; f < faces.size(); f++) {
+			if (faces[f]->primitive != nullptr) {
+				trace(side, *faces[f]->primitive);
+				continue;
+			}
+			Vec3d d[3];
+			double z[3];
+			int n_front = 0;
+			for (int k = 0; k < 3; k++) {
+				d[k] = *faces[f]->vertices[k] - position;
+				z[k] = s * d[k][a];
+				n_front += z[k] >= SHADOW_MAP_NEAR;
+			}
+			if (n_front == 0)
+				continue;
+			if (n_front == 3) {
+				rasterize(side, d, z);
+				continue;
+			}
+
+			// clip against the near plane, leaving 3 or 4 vertices
+			Vec3d poly[4];
+			double poly_z[4];
+			int n = 0;
+			for (int k = 0; k < 3; k++) {
+				int next = (k + 1) % 3;
+				if (z[k] >= SHADOW_MAP_NEAR) {
+					poly[n] = d[k];
+					poly_z[n++] = z[k];
+				}
+				if ((z[k] >= SHADOW_MAP_NEAR) != (z[next] >= SHADOW_MAP_NEAR)) {
+					double t = (SHADOW_MAP_NEAR - z[k]) / (z[next] - z[k]);
+					poly[n] = d[k] + t * (d[next] - d[k]);
+					poly_z[n++] = SHADOW_MAP_NEAR;
+				}
+			}
+			for (int k = 1; k + 1 < n; k++) {
+				Vec3d tri[3] = { poly[0], poly[k], poly[k + 1] };
+				double tri_z[3] = { poly_z[0], poly_z[k], poly_z[k + 1] };
+				rasterize(side, tri, tri_z);
+			}
+		}
+	});
+}
+
+void ShadowMap::rasterize(int side, const Vec3d *d, const double *z) {
+	int a = side / 2;
+	double x[3], y[3];
+	for (int k = 0; k < 3; k++) {
+		x[k] = (d[k][(a + 1) % 3] / z[k] + 1) / 2 * res;
+		y[k] = (d[k][(a + 2) % 3] / z[k] + 1) / 2 * res;
+	}
+	double area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	if (area == 0)
+		return;
+
+	// texel centres inside the bounding rectangle
+	double x_lo = fmax(0., ceil(fmin(x[0], fmin(x[1], x[2])) - 0.5));
+	double x_hi = fmin(res - 1., floor(fmax(x[0], fmax(x[1], x[2])) - 0.5));
+	double y_lo = fmax(0., ceil(fmin(y[0], fmin(y[1], y[2])) - 0.5));
+	double y_hi = fmin(res - 1., floor(fmax(y[0], fmax(y[1], y[2])) - 0.5));
+	if (x_lo > x_hi || y_lo > y_hi)
+		return;
+
+	float *map = &depths[side * res * res];
+	for (int ty = (int)y_lo; ty <= (int)y_hi; ty++) {
+		for (int tx = (int)x_lo; tx <= (int)x_hi; tx++) {
+			double px = tx + 0.5, py = ty + 0.5;
+			double w0 = ((x[2] - x[1]) * (py - y[1]) - (y[2] - y[1]) * (px - x[1])) / area;
+			double w1 = ((x[0] - x[2]) * (py - y[2]) - (y[0] - y[2]) * (px - x[2])) / area;
+			double w2 = 1 - w0 - w1;
+			if (w0 < 0 || w1 < 0 || w2 < 0)
+				continue;
+			// 1/z is linear across the cube face
+			double depth = 1 / (w0 / z[0] + w1 / z[1] + w2 / z[2]);
+			float &texel = map[ty * res + tx];
+			if (depth < texel)
+				texel = depth;
+		}
+	}
+}
+
+void ShadowMap::trace(int side, const Primitive &primitive) {
+	int a = side / 2;
+	double s = side % 2 ? -1 : 1;
+
+	// texels the bounding box covers, all of them if it reaches behind the near plane
+	Vec3d low, high;
+	primitive.bounds(low, high);
+	double x_lo = 0, x_hi = res - 1., y_lo = 0, y_hi = res - 1.;
+	double bx_lo = INFINITY, bx_hi = -INFINITY, by_lo = INFINITY, by_hi = -INFINITY;
+	bool in_front = true;
+	for (int c = 0; c < 8; c++) {
+		Vec3d d = Vec3d(c & 1 ? high[X] : low[X], c & 2 ? high[Y] : low[Y], c & 4 ? high[Z] : low[Z]) - position;
+		double z = s * d[a];
+		if (z < SHADOW_MAP_NEAR) {
+			in_front = false;
+			break;
+		}
+		double x = (d[(a + 1) % 3] / z + 1) / 2 * res, y = (d[(a + 2) % 3] / z + 1) / 2 * res;
+		bx_lo = fmin(bx_lo, x);	bx_hi = fmax(bx_hi, x);
+		by_lo = fmin(by_lo, y);	by_hi = fmax(by_hi, y);
+	}
+	if (in_front) {
+		x_lo = fmax(x_lo, floor(bx_lo));	x_hi = fmin(x_hi, ceil(bx_hi));
+		y_lo = fmax(y_lo, floor(by_lo));	y_hi = fmin(y_hi, ceil(by_hi));
+	}
+
+	// a ray through every texel centre
+	float *map = &depths[side * res * res];
+	for (int ty = (int)y_lo; ty <= (int)y_hi; ty++) {
+		for (int tx = (int)x_lo; tx <= (int)x_hi; tx++) {
+			Vec3d dir;
+			dir[a] = s;
+			dir[(a + 1) % 3] = 2 * (tx + 0.5) / res - 1;
+			dir[(a + 2) % 3] = 2 * (ty + 0.5) / res - 1;
+			double len = dir.norm();
+			double r = primitive.intersect(Ray(position, dir / len));
+			if (r < 0)
+				continue;
+			// distance along the axis
+			double depth = r / len;
+			float &texel = map[ty * res + tx];
+			if (depth >= SHADOW_MAP_NEAR && depth < texel)
+				texel = depth;
+		}
+	}
+}
+
+double ShadowMap::lookup(const Vec3d &pos, const Vec3d &normal) const {
+	Vec3d d = pos - position;
+	int a = fabs(d[X]) > fabs(d[Y]) ? (fabs(d[X]) > fabs(d[Z]) ? X : Z) : (fabs(d[Y]) > fabs(d[Z]) ? Y : Z);
+	double z = fabs(d[a]);
+	if (z < SHADOW_MAP_NEAR)
+		return 1;
+	int side = 2 * a + (d[a] < 0);
+	double x = (d[(a + 1) % 3] / z + 1) / 2 * res - 0.5;
+	double y = (d[(a + 2) % 3] / z + 1) / 2 * res - 0.5;
+	int cx = (int)fmin(res - 1., fmax(0., floor(x + 0.5)));
+	int cy = (int)fmin(res - 1., fmax(0., floor(y + 0.5)));
+
+	// bias: the texel size at this depth, more on surfaces at a slant to the light
+	Vec3d to_light = -d;
+	to_light.normalize();
+	double cos_t = fabs(normal.dot(to_light));
+	double slope = cos_t > 0 ? fmin(sqrt(fmax(0., 1 - cos_t * cos_t)) / cos_t, SHADOW_MAP_MAX_SLOPE) : SHADOW_MAP_MAX_SLOPE;
+	double bias = 2 * z / res * SHADOW_MAP_BIAS * (1 + slope);
+
+	const float *map = &depths[side * res * res];
+	int lit = 0, n = 0;
+	for (int ty = cy - 1; ty <= cy + 1; ty++) {
+		for (int tx = cx - 1; tx <= cx + 1; tx++) {
+			if (tx < 0 || tx >= res || ty < 0 || ty >= res)
+				continue;
+			n++;
+			lit += z - bias <= map[ty * res + tx];
+		}
+	}
+	return (double)lit / n;
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "vec.h"
+#include "mesh.h"
+#include "workerpool.h"
+#include "definitions.h"
+
+#include <vector>
+
+using namespace std;
+
+/* ShadowMap is the depth of the nearest face around a point light, rasterized
+ * into the six faces of a cube (analytic primitives are ray traced into it). A cube face covers the directions whose
+ * largest component is along its axis, and stores per texel the distance
+ * along that axis to the nearest face.
+ * lookup() compares a point against the 3x3 texels around it (percentage-
+ * closer filtering), with a bias that grows with the texel size and the slope
+ * of the surface seen from the light. */
+class ShadowMap {
+private:
+	Vec3d position;			// of the light
+	int res;				// texels per cube face side
+	vector<float> depths;	// [cube face][row][column], cube face = 2 * axis + (negative side)
+
+	void rasterize(int side, const Vec3d *d, const double *z);	// one triangle, light-relative, z > 0
+	void trace(int side, const Primitive &primitive);			// one analytic primitive, by a ray per texel
+
+public:
+	/* params: position         - the point light
+	 *         meshes, n_meshes - the faces casting shadows
+	 *         resolution       - texels per cube face side
+	 *         pool             - the workers rasterizing the cube faces */
+	ShadowMap(const Vec3d &position, Mesh *meshes, int n_meshes, int resolution, WorkerPool &pool);
+
+	/* Lit fraction of the 3x3 texels around pos, on a surface with the given normal, in [0,1] */
+	double lookup(const Vec3d &pos, const Vec3d &normal) const;
+
+	// Getters
+	const Vec3d &getPosition() const { return position; }
+	int getResolution() const { return res; }
+};
@@ -0,0 +1,257 @@
+#include "simplify.h"
+
+#include <cmath>
+#include <queue>
+#include <unordered_map>
+#include <algorithm>
+
+constexpr double BOUNDARY_WEIGHT = 100.;	// weight of the boundary planes against the face planes
+constexpr double MIN_FLIP_COS = 0.;			// a collapse may not turn a face normal further than this
+
+/* Quadric error of a point: its squared distance to a set of planes, as the
+ * symmetric 4x4 matrix sum(p p^T) over planes p = (a, b, c, d), upper triangle */
+struct Quadric {
+	double q[10];	// aa ab ac ad bb bc bd cc cd dd
+
+	Quadric() { fill(q, q + 10, 0.); }
+	Quadric(const Vec3d &n, double d, double weight) {
+		double p[4] = { n[X], n[Y], n[Z], d };
+		int k = 0;
+		for (int i = 0; i < 4; i++) {
+			for (int j = i; j < 4; j++)
+				q[k++] = weight * p[i] * p[j];
+		}
+	}
+
+	Quadric &operator+= (const Quadric &other) {
+		for (int k = 0; k < 10; k++)
+			q[k] += other.q[k];
+		return *this;
+	}
+
+	double error(const Vec3d &v) const {
+		return q[0] * v[X] * v[X] + 2 * q[1] * v[X] * v[Y] + 2 * q[2] * v[X] * v[Z] + 2 * q[3] * v[X]
+			+ q[4] * v[Y] * v[Y] + 2 * q[5] * v[Y] * v[Z] + 2 * q[6] * v[Y]
+			+ q[7] * v[Z] * v[Z] + 2 * q[8] * v[Z] + q[9];
+	}
+
+	/* The point of least error, false if it isn't unique */
+	bool optimum(Vec3d &ret) const {
+		// solve A v = -b by Cramer's rule
+		double a[3][3] = { { q[0], q[1], q[2] }, { q[1], q[4], q[5] }, { q[2], q[5], q[7] } };
+		double b[3] = { -q[3], -q[6], -q[8] };
+		double det = a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+			- a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+			+ a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+		double scale = q[0] + q[4] + q[7];
+		if (fabs(det) <= 1e-9 * scale * scale * scale)
+			return false;
+		for (int c = 0; c < 3; c++) {
+			double m[3][3];
+			for (int i = 0; i < 3; i++) {
+				for (int j = 0; j < 3; j++)
+					m[i][j] = j == c ? b[i] : a[i][j];
+			}
+			ret[c] = (m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+				- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+				+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0])) / det;
+		}
+		return true;
+	}
+};
+
+/* A candidate collapse of edge (a, b) to target, valid while both ends are
+ * as they were when it was queued */
+struct Collapse {
+	double cost;
+	int a, b;
+	unsigned stamp_a, stamp_b;
+	Vec3d target;
+
+	bool operator< (const Collapse &other) const { return cost > other.cost; }	// cheapest first
+};
+
+static long long edge_key(int a, int b, int n) {
+	return a < b ? (long long)a * n + b : (long long)b * n + a;
+}
+
+vector<MeshLevel> simplify(const vector<Vec3d> &vertices, const vector<int> &triangles, double ratio, int min_faces) {
+	int n_v = vertices.size(), n_f = triangles.size() / 3;
+	vector<Vec3d> pos(vertices);
+	vector<int> tris(triangles);
+	vector<char> tri_alive(n_f, 1), vert_alive(n_v, 1);
+	vector<unsigned> stamps(n_v, 0);
+	vector<vector<int> > vert_tris(n_v);
+	vector<Quadric> quadrics(n_v);
+
+	// Quadrics of the face planes, by area
+	unordered_map<long long, int> edge_uses;
+	for (int t = 0; t < n_f; t++) {
+		const int *v = &tris[3 * t];
+		Vec3d n = (pos[v[1]] - pos[v[0]]).cross(pos[v[2]] - pos[v[0]]);
+		double area2 = n.norm();
+		if (area2 > 0) {
+			n /= area2;
+			Quadric plane(n, -n.dot(pos[v[0]]), area2 / 2);
+			for (int k = 0; k < 3; k++)
+				quadrics[v[k]] += plane;
+		}
+		for (int k = 0; k < 3; k++) {
+			vert_tris[v[k]].push_back(t);
+			edge_uses[edge_key(v[k], v[(k + 1) % 3], n_v)]++;
+		}
+	}
+	// and of the planes holding the boundary edges
+	for (int t = 0; t < n_f; t++) {
+		const int *v = &tris[3 * t];
+		Vec3d n = (pos[v[1]] - pos[v[0]]).cross(pos[v[2]] - pos[v[0]]);
+		if (n.norm() == 0)
+			continue;
+		n.normalize();
+		for (int k = 0; k < 3; k++) {
+			int i = v[k], j = v[(k + 1) % 3];
+			if (edge_uses[edge_key(i, j, n_v)] != 1)
+				continue;
+			Vec3d e = pos[j] - pos[i];
+			Vec3d m = e.cross(n);
+			if (m.norm() == 0)
+				continue;
+			m.normalize();
+			Quadric plane(m, -m.dot(pos[i]), BOUNDARY_WEIGHT * e.dot(e));
+			quadrics[i] += plane;
+			quadrics[j] += plane;
+		}
+	}
+
+	// Candidate collapses
+	priority_queue<Collapse> queue;
+	auto push = [&](int a, int b) {
+		Quadric q = quadrics[a];
+		q += quadrics[b];
+		Collapse c = { 0, a, b, stamps[a], stamps[b], Vec3d() };
+		if (!q.optimum(c.target)) {
+			// the best of the ends and the midpoint
+			Vec3d candidates[3] = { pos[a], pos[b], (pos[a] + pos[b]) / 2 };
+			c.target = candidates[0];
+			for (int k = 1; k < 3; k++) {
+				if (q.error(candidates[k]) < q.error(c.target))
+					c.target = candidates[k];
+			}
+		}
+		c.cost = q.error(c.target);
+		queue.push(c);
+	};
+	auto neighbours = [&](int a, vector<int> &ret) {
+		ret.clear();
+		for (size_t k = 0; k < vert_tris[a].size(); k++) {
+			const int *v = &tris[3 * vert_tris[a][k]];
+			for (int i = 0; i < 3; i++) {
+				if (v[i] != a)
+					ret.push_back(v[i]);
+			}
+		}
+		sort(ret.begin(), ret.end());
+		ret.erase(unique(ret.begin(), ret.end()), ret.end());
+	};
+	vector<int> around;
+	for (int a = 0; a < n_v; a++) {
+		neighbours(a, around);
+		for (size_t k = 0; k < around.size(); k++) {
+			if (a < around[k])
+				push(a, around[k]);
+		}
+	}
+
+	// Would moving the ends of (a, b) to target flip a face around them?
+	auto flips = [&](int a, int b, const Vec3d &target) {
+		int ends[2] = { a, b };
+		for (int e = 0; e < 2; e++) {
+			for (size_t k = 0; k < vert_tris[ends[e]].size(); k++) {
+				const int *v = &tris[3 * vert_tris[ends[e]][k]];
+				if ((v[0] == a || v[1] == a || v[2] == a) && (v[0] == b || v[1] == b || v[2] == b))
+					continue;		// collapses with the edge
+				Vec3d p[3], moved[3];
+				for (int i = 0; i < 3; i++) {
+					p[i] = pos[v[i]];
+					moved[i] = v[i] == ends[e] ? target : p[i];
+				}
+				Vec3d before = (p[1] - p[0]).cross(p[2] - p[0]);
+				Vec3d after = (moved[1] - moved[0]).cross(moved[2] - moved[0]);
+				double len = before.norm() * after.norm();
+				if (len == 0 || before.dot(after) <= MIN_FLIP_COS * len)
+					return true;
+			}
+		}
+		return false;
+	};
+
+	vector<MeshLevel> levels;
+	int n_alive = n_f;
+	int target_faces = (int)(n_f * ratio);
+	while (target_faces >= min_faces && !queue.empty()) {
+		// Collapse the cheapest edges down to the level's size
+		while (n_alive > target_faces && !queue.empty()) {
+			Collapse c = queue.top();
+			queue.pop();
+			int a = c.a, b = c.b;
+			if (!vert_alive[a] || !vert_alive[b] || stamps[a] != c.stamp_a || stamps[b] != c.stamp_b)
+				continue;
+			if (flips(a, b, c.target))
+				continue;
+
+			// b merges into a
+			pos[a] = c.target;
+			quadrics[a] += quadrics[b];
+			for (size_t k = 0; k < vert_tris[b].size(); k++) {
+				int t = vert_tris[b][k];
+				int *v = &tris[3 * t];
+				if (v[0] == a || v[1] == a || v[2] == a) {
+					tri_alive[t] = 0;
+					n_alive--;
+					continue;
+				}
+				for (int i = 0; i < 3; i++) {
+					if (v[i] == b)
+						v[i] = a;
+				}
+				vert_tris[a].push_back(t);
+			}
+			vert_alive[b] = 0;
+			vert_tris[b].clear();
+			stamps[a]++;
+
+			// drop the collapsed faces from the lists around, then requeue a's
+			// edges; the others keep their cost
+			neighbours(a, around);
+			around.push_back(a);
+			for (size_t k = 0; k < around.size(); k++) {
+				vector<int> &list = vert_tris[around[k]];
+				list.erase(remove_if(list.begin(), list.end(), [&](int t) { return !tri_alive[t]; }), list.end());
+			}
+			neighbours(a, around);
+			for (size_t k = 0; k < around.size(); k++)
+				push(a, around[k]);
+		}
+		if (n_alive > target_faces)
+			break;
+
+		// Snapshot: the live vertices and faces, renumbered
+		MeshLevel level;
+		vector<int> index(n_v, -1);
+		for (int t = 0; t < n_f; t++) {
+			if (!tri_alive[t])
+				continue;
+			for (int i = 0; i < 3; i++) {
+				int v = tris[3 * t + i];
+				if (index[v] < 0) {
+					index[v] = level.vertices.size();
+					level.vertices.push_back(pos[v]);
+				}
+				level.triangles.push_back(index[v]);
+			}
+		}
+		levels.push_back(level);
+		target_faces = (int)(n_alive * ratio);
+	}
+	return levels;
+}
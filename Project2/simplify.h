@@ -0,0 +1,26 @@
+#pragma once
+
+#include "vec.h"
+#include "definitions.h"
+
+#include <vector>
+
+using namespace std;
+
+/* One level of detail of a mesh: positions, and triangles as vertex indices */
+struct MeshLevel {
+	vector<Vec3d> vertices;
+	vector<int> triangles;		// 3 per face, CCW front as in the mesh
+};
+
+/* simplify() builds coarser and coarser copies of a triangle mesh by quadric
+ * edge collapse (Garland & Heckbert). Every vertex carries the sum of the
+ * quadrics of its faces' planes, weighted by area; collapsing an edge merges
+ * its ends at the point of least quadric error, cheapest edge first. Planes
+ * through the boundary edges, perpendicular to their face, keep holes from
+ * growing, and collapses that would flip a face are skipped.
+ * params: vertices, triangles - the mesh, as in MeshLevel
+ *         ratio               - faces of a level per face of the previous one, in (0,1)
+ *         min_faces           - no level has fewer faces
+ * return value: the levels, finest first, without the mesh itself */
+vector<MeshLevel> simplify(const vector<Vec3d> &vertices, const vector<int> &triangles, double ratio, int min_faces);
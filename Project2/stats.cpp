@@ -0,0 +1,139 @@
+#include "stats.h"
+
+#include <cstring>
+
+static const char *phase_names[RenderStats::N_PHASES] = {
+	"loading", "building", "rendering", "encoding"
+};
+
+void RenderStats::reset() {
+	resetCounters();
+	for (int i = 0; i < N_PHASES; i++)
+		seconds[i] = 0;
+}
+
+void RenderStats::resetCounters() {
+	primary_rays = reflection_rays = refraction_rays = shadow_rays = 0;
+	nodes_visited = triangle_tests = 0;
+	hits = misses = nodes_split = 0;
+	lights_culled = lights_sampled = penumbra_refinements = pixels_refined = 0;
+	occluder_lookups = occluder_hits = occluder_node_hits = 0;
+	raster_tests = raster_rays = 0;
+	shadow_map_lookups = shadow_map_fallbacks = 0;
+	leaves_lit = leaves_shadowed = 0;
+	irradiance_interpolated = irradiance_records = 0;
+	paged_faults = paged_evictions = 0;
+	tiles_rendered = tiles_reused = 0;
+	memset(depth_histogram, 0, sizeof depth_histogram);
+	tile_order = TILE_ORDER_SCANLINE;
+	tile_size = 0;
+}
+
+void RenderStats::merge(const RenderStats &other) {
+	primary_rays += other.primary_rays;
+	reflection_rays += other.reflection_rays;
+	refraction_rays += other.refraction_rays;
+	shadow_rays += other.shadow_rays;
+	nodes_visited += other.nodes_visited;
+	triangle_tests += other.triangle_tests;
+	hits += other.hits;
+	misses += other.misses;
+	nodes_split += other.nodes_split;
+	lights_culled += other.lights_culled;
+	lights_sampled += other.lights_sampled;
+	penumbra_refinements += other.penumbra_refinements;
+	pixels_refined += other.pixels_refined;
+	occluder_lookups += other.occluder_lookups;
+	occluder_hits += other.occluder_hits;
+	occluder_node_hits += other.occluder_node_hits;
+	raster_tests += other.raster_tests;
+	raster_rays += other.raster_rays;
+	shadow_map_lookups += other.shadow_map_lookups;
+	shadow_map_fallbacks += other.shadow_map_fallbacks;
+	leaves_lit += other.leaves_lit;
+	leaves_shadowed += other.leaves_shadowed;
+	irradiance_interpolated += other.irradiance_interpolated;
+	irradiance_records += other.irradiance_records;
+	paged_faults += other.paged_faults;
+	paged_evictions += other.paged_evictions;
+	tiles_rendered += other.tiles_rendered;
+	tiles_reused += other.tiles_reused;
+	for (int i = 0; i < STATS_DEPTH_BINS; i++)
+		depth_histogram[i] += other.depth_histogram[i];
+	for (int i = 0; i < N_PHASES; i++)
+		seconds[i] += other.seconds[i];
+}
+
+void RenderStats::writeJSON(ostream &os) const {
+	unsigned long long total_rays = primary_rays + reflection_rays + refraction_rays + shadow_rays;
+
+	os << "{\n";
+	os << "  \"rays\": {\n";
+	os << "    \"primary\": " << primary_rays << ",\n";
+	os << "    \"reflection\": " << reflection_rays << ",\n";
+	os << "    \"refraction\": " << refraction_rays << ",\n";
+	os << "    \"shadow\": " << shadow_rays << ",\n";
+	os << "    \"total\": " << total_rays << "\n";
+	os << "  },\n";
+	os << "  \"traversal\": {\n";
+	os << "    \"nodes_visited\": " << nodes_visited << ",\n";
+	os << "    \"triangle_tests\": " << triangle_tests << ",\n";
+	os << "    \"hits\": " << hits << ",\n";
+	os << "    \"misses\": " << misses << ",\n";
+	os << "    \"nodes_split\": " << nodes_split << "\n";
+	os << "  },\n";
+	os << "  \"shading\": {\n";
+	os << "    \"lights_culled\": " << lights_culled << ",\n";
+	os << "    \"lights_sampled\": " << lights_sampled << ",\n";
+	os << "    \"penumbra_refinements\": " << penumbra_refinements << ",\n";
+	os << "    \"pixels_refined\": " << pixels_refined << "\n";
+	os << "  },\n";
+	os << "  \"occluder_cache\": {\n";
+	os << "    \"lookups\": " << occluder_lookups << ",\n";
+	os << "    \"hits\": " << occluder_hits << ",\n";
+	os << "    \"node_hits\": " << occluder_node_hits << ",\n";
+	os << "    \"hit_rate\": " << (occluder_lookups ? (double)(occluder_hits + occluder_node_hits) / occluder_lookups : 0.) << "\n";
+	os << "  },\n";
+	os << "  \"rasterization\": {\n";
+	os << "    \"triangle_tests\": " << raster_tests << ",\n";
+	os << "    \"primary_rays\": " << raster_rays << "\n";
+	os << "  },\n";
+	os << "  \"shadow_maps\": {\n";
+	os << "    \"lookups\": " << shadow_map_lookups << ",\n";
+	os << "    \"fallbacks\": " << shadow_map_fallbacks << "\n";
+	os << "  },\n";
+	os << "  \"leaf_classes\": {\n";
+	os << "    \"lit\": " << leaves_lit << ",\n";
+	os << "    \"shadowed\": " << leaves_shadowed << "\n";
+	os << "  },\n";
+	os << "  \"irradiance_cache\": {\n";
+	os << "    \"interpolated\": " << irradiance_interpolated << ",\n";
+	os << "    \"records\": " << irradiance_records << "\n";
+	os << "  },\n";
+	os << "  \"out_of_core\": {\n";
+	os << "    \"faults\": " << paged_faults << ",\n";
+	os << "    \"evictions\": " << paged_evictions << "\n";
+	os << "  },\n";
+	os << "  \"tile_cache\": {\n";
+	os << "    \"rendered\": " << tiles_rendered << ",\n";
+	os << "    \"reused\": " << tiles_reused << "\n";
+	os << "  },\n";
+	os << "  \"schedule\": {\n";
+	os << "    \"order\": \"" << tile_order_name(tile_order) << "\",\n";
+	os << "    \"tile_size\": " << tile_size << "\n";
+	os << "  },\n";
+	os << "  \"depth_histogram\": [";
+	for (int i = 0; i < STATS_DEPTH_BINS; i++)
+		os << (i ? ", " : "") << depth_histogram[i];
+	os << "],\n";
+	os << "  \"seconds\": {\n";
+	for (int i = 0; i < N_PHASES; i++)
+		os << "    \"" << phase_names[i] << "\": " << seconds[i] << (i + 1 < N_PHASES ? ",\n" : "\n");
+	os << "  }\n";
+	os << "}\n";
+}
+
+RenderStats &RenderStats::local() {
+	static thread_local RenderStats stats;
+	return stats;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include "tileorder.h"
+
+#include <iostream>
+#include <chrono>
+
+using namespace std;
+
+constexpr int STATS_DEPTH_BINS = 8;		// ray-tree depth histogram size (last bin collects deeper rays)
+
+/* RenderStats collects ray and traversal counters for one frame.
+ * Hot paths only ever touch the calling thread's own copy (RenderStats::local()),
+ * which is merged into the frame total once that thread's work is done. */
+struct RenderStats {
+	enum Phase {
+		LOADING,
+		BUILDING,
+		RENDERING,
+		ENCODING,
+		N_PHASES
+	};
+
+	/* Ray counters */
+	unsigned long long primary_rays;
+	unsigned long long reflection_rays;
+	unsigned long long refraction_rays;
+	unsigned long long shadow_rays;
+
+	/* Traversal counters */
+	unsigned long long nodes_visited;		// octree nodes whose faces were tested
+	unsigned long long triangle_tests;		// ray-triangle intersection tests
+	unsigned long long hits;				// intersection queries that found a face
+	unsigned long long misses;				// intersection queries that found nothing
+	unsigned long long nodes_split;			// lazy octree nodes split by the first ray to enter them
+
+	/* Shading counters */
+	unsigned long long lights_culled;		// lights skipped below the contribution threshold
+	unsigned long long lights_sampled;		// lights picked by stochastic light sampling
+	unsigned long long penumbra_refinements;	// area-light hits that needed the full sample count
+	unsigned long long pixels_refined;		// pixels given more samples by adaptive anti-aliasing
+	unsigned long long occluder_lookups;	// shadow rays that consulted the occluder cache
+	unsigned long long occluder_hits;		// ... blocked by the cached face
+	unsigned long long occluder_node_hits;	// ... blocked by another face of the cached face's node
+
+	/* Rasterization pre-pass */
+	unsigned long long raster_tests;		// ray-triangle tests filling the visibility buffers
+	unsigned long long raster_rays;			// primary rays whose hit came from a visibility buffer
+
+	/* Shadow maps */
+	unsigned long long shadow_map_lookups;	// point-light visibility queries of primary hits
+	unsigned long long shadow_map_fallbacks;	// ... whose texels disagreed, left to a shadow ray
+
+	/* Leaf visibility classes */
+	unsigned long long leaves_lit;			// point-light visibility queries answered lit by the hit's leaf
+	unsigned long long leaves_shadowed;		// ... answered shadowed
+
+	/* Irradiance cache */
+	unsigned long long irradiance_interpolated;	// light visibilities interpolated from the records
+	unsigned long long irradiance_records;		// records added
+
+	/* Out-of-core meshes: the frame's change of the meshes' own counters, the
+	 * raster pre-pass included, rather than per-thread counts */
+	unsigned long long paged_faults;		// blocks paged in
+	unsigned long long paged_evictions;		// blocks evicted to stay within the budget
+
+	/* Tile cache */
+	unsigned long long tiles_rendered;
+	unsigned long long tiles_reused;
+
+	unsigned long long depth_histogram[STATS_DEPTH_BINS];	// cast() calls per ray-tree depth
+
+	/* Work schedule of the frame, set by render(), not merged */
+	TileOrder tile_order;
+	int tile_size;							// work tile side in pixels, 0 for scanline rows
+
+	double seconds[N_PHASES];				// wall-clock time per phase
+
+	RenderStats() { reset(); }
+
+	void reset();				// clears counters and timings
+	void resetCounters();		// clears counters only
+	void merge(const RenderStats &other);
+	void writeJSON(ostream &os) const;
+
+	// Counter set of the calling thread
+	static RenderStats &local();
+};
+
+/* Simple wall-clock stopwatch, started on construction. */
+class Timer {
+private:
+	chrono::steady_clock::time_point start;
+public:
+	Timer() : start(chrono::steady_clock::now()) {}
+
+	void restart() { start = chrono::steady_clock::now(); }
+	double seconds() const {
+		return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+};
@@ -0,0 +1,79 @@
+#include "tileorder.h"
+
+#include <algorithm>
+
+/* Cell (x, y) at distance d along the Hilbert curve over n x n cells, n a power of 2 */
+static void hilbert_cell(int n, int d, int &x, int &y) {
+	x = y = 0;
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			// rotate the quadrant
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+/* Position of cell (row, col) along the Z-order curve: the bits of both interleaved */
+static unsigned long long morton_key(unsigned row, unsigned col) {
+	unsigned long long key = 0;
+	for (int b = 0; b < 32; b++) {
+		key |= (unsigned long long)((col >> b) & 1) << (2 * b);
+		key |= (unsigned long long)((row >> b) & 1) << (2 * b + 1);
+	}
+	return key;
+}
+
+vector<int> order_tiles(TileOrder order, int rows, int cols) {
+	vector<int> ret;
+	ret.reserve(rows * cols);
+	switch (order) {
+	case TILE_ORDER_MORTON: {
+		vector<pair<unsigned long long, int> > keyed;
+		for (int r = 0; r < rows; r++) {
+			for (int c = 0; c < cols; c++)
+				keyed.push_back(make_pair(morton_key(r, c), r * cols + c));
+		}
+		sort(keyed.begin(), keyed.end());
+		for (size_t t = 0; t < keyed.size(); t++)
+			ret.push_back(keyed[t].second);
+		break;
+	}
+	case TILE_ORDER_HILBERT: {
+		// the curve over the enclosing power-of-2 square, skipping the cells outside
+		int n = 1;
+		while (n < rows || n < cols)
+			n *= 2;
+		for (int d = 0; d < n * n; d++) {
+			int c, r;
+			hilbert_cell(n, d, c, r);
+			if (r < rows && c < cols)
+				ret.push_back(r * cols + c);
+		}
+		break;
+	}
+	default:
+		for (int t = 0; t < rows * cols; t++)
+			ret.push_back(t);
+	}
+	return ret;
+}
+
+const char *tile_order_name(TileOrder order) {
+	switch (order) {
+	case TILE_ORDER_MORTON:
+		return "morton";
+	case TILE_ORDER_HILBERT:
+		return "hilbert";
+	default:
+		return "scanline";
+	}
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "definitions.h"
+
+#include <vector>
+
+using namespace std;
+
+/* Order in which render() hands the tiles of a view to the worker threads. */
+enum TileOrder {
+	TILE_ORDER_SCANLINE,	// one row of pixels per work item, top to bottom
+	TILE_ORDER_MORTON,		// square tiles along the Z-order curve
+	TILE_ORDER_HILBERT		// square tiles along the Hilbert curve
+};
+
+/* order_tiles() lists the tiles of a grid of rows x cols along the order's
+ * curve, so consecutive tiles are mostly neighbours in the image and their
+ * rays reach the same parts of the scene. The Hilbert curve never jumps
+ * within a power-of-2 square of tiles, the Z curve jumps between quadrants.
+ * return value: row-major tile indices (row * cols + col), each once;
+ *               TILE_ORDER_SCANLINE gives them row by row */
+vector<int> order_tiles(TileOrder order, int rows, int cols);
+
+const char *tile_order_name(TileOrder order);
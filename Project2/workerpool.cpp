@@ -0,0 +1,49 @@
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(int n_threads) : stopping(false) {
+	if (n_threads <= 0)
+		n_threads = thread::hardware_concurrency() > 0 ? thread::hardware_concurrency() : 1;
+	for (int t = 0; t < n_threads; t++)
+		workers.push_back(thread(&WorkerPool::work, this));
+}
+
+WorkerPool::~WorkerPool() {
+	{
+		lock_guard<mutex> lock(m);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+}
+
+void WorkerPool::run(int n_items, const function<void(int)> &task) {
+	if (n_items <= 0)
+		return;
+	Job job = { &task, n_items, 0, 0 };
+	unique_lock<mutex> lock(m);
+	jobs.push_back(&job);
+	wake.notify_all();
+	finished.wait(lock, [&job] { return job.done == job.n_items; });
+}
+
+void WorkerPool::work() {
+	unique_lock<mutex> lock(m);
+	while (true) {
+		wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+		if (jobs.empty())
+			return;
+
+		// take the next item of the oldest job
+		Job *job = jobs.front();
+		int item = job->next++;
+		if (job->next == job->n_items)
+			jobs.pop_front();
+
+		lock.unlock();
+		(*job->task)(item);
+		lock.lock();
+		if (++job->done == job->n_items)
+			finished.notify_all();
+	}
+}
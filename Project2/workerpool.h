@@ -0,0 +1,43 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using namespace std;
+
+/* WorkerPool keeps a fixed set of threads for the lifetime of its owner.
+ * run() hands a job of n items to the pool and blocks until every item is done.
+ * Several threads may call run() at the same time; their jobs are served in
+ * order of arrival, items of one job by all free workers. The threads, and so
+ * their thread-local state, outlive the jobs. */
+class WorkerPool {
+private:
+	struct Job {
+		const function<void(int)> *task;
+		int n_items;
+		int next;		// next item to hand out
+		int done;		// finished items
+	};
+
+	vector<thread> workers;
+	deque<Job *> jobs;			// jobs with items left to hand out
+	mutex m;					// guards jobs and the Job counters
+	condition_variable wake;	// a job arrived, or the pool stops
+	condition_variable finished;	// an item was finished
+	bool stopping;
+
+	void work();
+
+public:
+	WorkerPool(int n_threads = 0);	// 0: one per hardware thread
+	~WorkerPool();
+
+	/* Calls task(0) ... task(n_items - 1) on the workers and waits for them */
+	void run(int n_items, const function<void(int)> &task);
+
+	int getSize() const { return workers.size(); }
+};